@@ -0,0 +1,362 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include "Bento5Committer.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   DirectFileByteStream
++---------------------------------------------------------------------*/
+const AP4_Size DIRECT_IO_ALIGNMENT   = 4096;
+const AP4_Size DIRECT_IO_BUFFER_SIZE = 1024*1024;
+
+// write-only file stream that writes with O_DIRECT from an aligned buffer, Flush() writes the
+// tail of the file without it
+class DirectFileByteStream : public AP4_ByteStream {
+public:
+    // falls back to regular writes when the file system does not support O_DIRECT
+    static AP4_Result Create(const char* path, bool direct, AP4_UI64* direct_size, DirectFileByteStream*& stream) {
+        stream = NULL;
+        int flags = O_WRONLY | O_CREAT | O_TRUNC;
+        int fd    = -1;
+#if defined(O_DIRECT)
+        if (direct) fd = open(path, flags | O_DIRECT, 0666);
+#endif
+        direct = fd >= 0;
+        if (fd < 0) fd = open(path, flags, 0666);
+        if (fd < 0) return AP4_ERROR_CANNOT_OPEN_FILE;
+        void* buffer = NULL;
+        if (posix_memalign(&buffer, DIRECT_IO_ALIGNMENT, DIRECT_IO_BUFFER_SIZE) != 0) {
+            close(fd);
+            return AP4_ERROR_OUT_OF_MEMORY;
+        }
+        stream = new DirectFileByteStream(fd, direct, (AP4_UI08*)buffer, direct_size);
+        return AP4_SUCCESS;
+    }
+
+    // AP4_ByteStream methods
+    AP4_Result ReadPartial(void* /*buffer*/, AP4_Size /*bytes_to_read*/, AP4_Size& bytes_read) {
+        bytes_read = 0;
+        return AP4_ERROR_NOT_SUPPORTED;
+    }
+    AP4_Result WritePartial(const void* buffer, AP4_Size bytes_to_write, AP4_Size& bytes_written) {
+        bytes_written = 0;
+        if (bytes_to_write == 0) return AP4_SUCCESS;
+        AP4_Size chunk = std::min<AP4_Size>(bytes_to_write, DIRECT_IO_BUFFER_SIZE-m_BufferFill);
+        memcpy(m_Buffer+m_BufferFill, buffer, chunk);
+        m_BufferFill += chunk;
+        m_Position   += chunk;
+        bytes_written = chunk;
+        if (m_BufferFill < DIRECT_IO_BUFFER_SIZE) return AP4_SUCCESS;
+        m_BufferFill = 0;
+        return WriteBuffer(DIRECT_IO_BUFFER_SIZE);
+    }
+    AP4_Result Seek(AP4_Position /*position*/) { return AP4_ERROR_NOT_SUPPORTED; }
+    AP4_Result Tell(AP4_Position& position) { position = m_Position; return AP4_SUCCESS; }
+    AP4_Result GetSize(AP4_LargeSize& size) { size = m_Position; return AP4_SUCCESS; }
+    AP4_Result Flush();
+
+    // allocate the blocks of the file up front, TrimOutput frees what is not written
+    void Preallocate(AP4_UI64 size) {
+#if defined(__linux__)
+        (void)fallocate(m_Fd, FALLOC_FL_KEEP_SIZE, 0, (off_t)size);
+#endif
+    }
+
+    // AP4_Referenceable methods
+    void AddReference() { m_ReferenceCount++; }
+    void Release() {
+        if (--m_ReferenceCount == 0) delete this;
+    }
+
+private:
+    DirectFileByteStream(int fd, bool direct, AP4_UI08* buffer, AP4_UI64* direct_size) :
+        m_Fd(fd), m_Direct(direct), m_Buffer(buffer), m_BufferFill(0), m_Position(0), m_DirectSize(direct_size), m_ReferenceCount(1) {}
+    ~DirectFileByteStream() {
+        Flush();
+        close(m_Fd);
+        free(m_Buffer);
+    }
+
+    AP4_Result WriteBuffer(AP4_Size size);
+
+    int          m_Fd;
+    bool         m_Direct;
+    AP4_UI08*    m_Buffer;
+    AP4_Size     m_BufferFill;
+    AP4_Position m_Position;
+    AP4_UI64*    m_DirectSize;
+    AP4_Cardinal m_ReferenceCount;
+};
+
+/*----------------------------------------------------------------------
+|   DirectFileByteStream::WriteBuffer
++---------------------------------------------------------------------*/
+AP4_Result
+DirectFileByteStream::WriteBuffer(AP4_Size size)
+{
+    AP4_Size written = 0;
+    while (written < size) {
+        ssize_t result = write(m_Fd, m_Buffer+written, size-written);
+        if (result < 0 && errno == EINTR) continue;
+        if (result <= 0) return AP4_ERROR_WRITE_FAILED;
+        written += (AP4_Size)result;
+    }
+    if (m_Direct && m_DirectSize) *m_DirectSize += size;
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   DirectFileByteStream::Flush
++---------------------------------------------------------------------*/
+AP4_Result
+DirectFileByteStream::Flush()
+{
+    // the whole blocks can still be written directly
+    AP4_Size   aligned = m_Direct ? m_BufferFill & ~(DIRECT_IO_ALIGNMENT-1) : m_BufferFill;
+    AP4_Result result;
+    if (aligned) {
+        result = WriteBuffer(aligned);
+        if (AP4_FAILED(result)) return result;
+        memmove(m_Buffer, m_Buffer+aligned, m_BufferFill-aligned);
+        m_BufferFill -= aligned;
+    }
+    if (m_BufferFill == 0) return AP4_SUCCESS;
+
+    // the tail leaves the file offset unaligned
+#if defined(O_DIRECT)
+    fcntl(m_Fd, F_SETFL, fcntl(m_Fd, F_GETFL) & ~O_DIRECT);
+#endif
+    m_Direct = false;
+    result = WriteBuffer(m_BufferFill);
+    m_BufferFill = 0;
+    return result;
+}
+
+/*----------------------------------------------------------------------
+|   OpenOutput
++---------------------------------------------------------------------*/
+AP4_ByteStream*
+OpenOutput(std::filesystem::path out_folder, const char* filename, AP4_UI64* direct_size, AP4_UI64 preallocate_size, OutputSink* sink)
+{
+    TraceSpan span("OpenOutput", "io");
+    AP4_ByteStream* output = NULL;
+    if (sink) {
+        AP4_Result result = sink->CreateFile(out_folder.append(filename).generic_string(), output);
+        if (AP4_FAILED(result)) {
+            LogError("cannot open output %s (%d)", out_folder.generic_string().c_str(), result);
+            return NULL;
+        }
+        return output;
+    }
+    std::string path = std::filesystem::absolute(out_folder.append(filename)).string();
+    AP4_Result  result;
+    if (direct_size || preallocate_size) {
+        // the preallocation goes through the file descriptor of the stream
+        DirectFileByteStream* file = NULL;
+        result = DirectFileByteStream::Create(path.c_str(), direct_size != NULL, direct_size, file);
+        if (AP4_SUCCEEDED(result) && preallocate_size) file->Preallocate(preallocate_size);
+        output = file;
+    } else {
+        result = AP4_FileByteStream::Create(path.c_str(), AP4_FileByteStream::STREAM_MODE_WRITE, output);
+    }
+    if (AP4_FAILED(result)) {
+        LogError("cannot open output %s (%d)", path.c_str(), result);
+        return NULL;
+    }
+    return output;
+}
+
+/*----------------------------------------------------------------------
+|   TrimOutput
++---------------------------------------------------------------------*/
+AP4_Result
+TrimOutput(std::filesystem::path out_folder, const char* filename, AP4_UI64 size)
+{
+    if (truncate(out_folder.append(filename).string().c_str(), (off_t)size) != 0) return AP4_ERROR_WRITE_FAILED;
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   SyncPath
++---------------------------------------------------------------------*/
+AP4_Result
+SyncPath(const std::filesystem::path& path)
+{
+    int fd = open(path.string().c_str(), O_RDONLY);
+    if (fd < 0) return AP4_ERROR_CANNOT_OPEN_FILE;
+    int result = fsync(fd);
+    close(fd);
+    return result == 0 ? AP4_SUCCESS : AP4_ERROR_WRITE_FAILED;
+}
+
+/*----------------------------------------------------------------------
+|   WriteOutputAtomically
++---------------------------------------------------------------------*/
+AP4_Result
+WriteOutputAtomically(std::filesystem::path out_folder, const char* filename, const std::string& content, bool durable, OutputSink* sink)
+{
+    if (sink) {
+        AP4_ByteStream* output = OpenOutput(out_folder, filename, NULL, 0, sink);
+        if (output == NULL) return AP4_ERROR_CANNOT_OPEN_FILE;
+        AP4_Result result = output->Write(content.data(), (AP4_Size)content.size());
+        output->Release();
+        return result;
+    }
+
+    std::string temp_filename = std::string(filename)+".tmp";
+    AP4_ByteStream* output = OpenOutput(out_folder, temp_filename.c_str());
+    if (output == NULL) return AP4_ERROR_CANNOT_OPEN_FILE;
+    AP4_Result result = output->Write(content.data(), (AP4_Size)content.size());
+    output->Release();
+    if (AP4_FAILED(result)) return result;
+    if (durable) {
+        result = SyncPath(out_folder/temp_filename);
+        if (AP4_FAILED(result)) return result;
+    }
+
+    std::error_code error;
+    std::filesystem::rename(out_folder/temp_filename, out_folder/filename, error);
+    if (error) {
+        LogError("cannot rename %s (%s)", temp_filename.c_str(), error.message().c_str());
+        return AP4_ERROR_CANNOT_OPEN_FILE;
+    }
+    return durable ? SyncPath(out_folder) : AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   SegmentCommitter::~SegmentCommitter
++---------------------------------------------------------------------*/
+SegmentCommitter::~SegmentCommitter()
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+    }
+    wake.notify_all();
+    thread.join();
+}
+
+/*----------------------------------------------------------------------
+|   SegmentCommitter::Commit
++---------------------------------------------------------------------*/
+void
+SegmentCommitter::Commit(const std::filesystem::path& temp_path, const std::filesystem::path& path)
+{
+    {
+        std::lock_guard<std::mutex> guard(lock);
+        pending.push_back({ temp_path, path });
+        queued++;
+    }
+    wake.notify_all();
+}
+
+/*----------------------------------------------------------------------
+|   SegmentCommitter::Flush
++---------------------------------------------------------------------*/
+AP4_Result
+SegmentCommitter::Flush()
+{
+    std::unique_lock<std::mutex> guard(lock);
+    AP4_UI64 target = queued;
+    done.wait(guard, [this, target] { return committed >= target; });
+    return result;
+}
+
+/*----------------------------------------------------------------------
+|   SegmentCommitter::Run
++---------------------------------------------------------------------*/
+void
+SegmentCommitter::Run()
+{
+    RunLogScope                  scope(log);
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+        wake.wait(guard, [this] { return stopping || !pending.empty(); });
+        if (pending.empty()) return;
+        std::vector<Item> batch;
+        batch.swap(pending);
+        guard.unlock();
+        AP4_Result batch_result = CommitBatch(batch);
+        guard.lock();
+        if (AP4_FAILED(batch_result) && AP4_SUCCEEDED(result)) result = batch_result;
+        committed += batch.size();
+        batch_count++;
+        done.notify_all();
+    }
+}
+
+/*----------------------------------------------------------------------
+|   SegmentCommitter::CommitBatch
++---------------------------------------------------------------------*/
+AP4_Result
+SegmentCommitter::CommitBatch(const std::vector<Item>& batch)
+{
+    TraceSpan span("commit", "io", "segments", batch.size());
+    AP4_Result                         result = AP4_SUCCESS;
+    std::vector<std::filesystem::path> folders;
+    for (const Item& item : batch) {
+        AP4_Result item_result = SyncPath(item.temp_path);
+        if (AP4_SUCCEEDED(item_result)) {
+            std::error_code error;
+            std::filesystem::rename(item.temp_path, item.path, error);
+            if (error) item_result = AP4_ERROR_WRITE_FAILED;
+        }
+        if (AP4_FAILED(item_result)) {
+            LogError("cannot commit %s", item.path.string().c_str());
+            result = item_result;
+        }
+        if (std::find(folders.begin(), folders.end(), item.path.parent_path()) == folders.end()) {
+            folders.push_back(item.path.parent_path());
+        }
+    }
+    for (const std::filesystem::path& folder : folders) {
+        if (AP4_FAILED(SyncPath(folder))) result = AP4_ERROR_WRITE_FAILED;
+    }
+    return result;
+}
+
+/*----------------------------------------------------------------------
+|   ReadTextFile
++---------------------------------------------------------------------*/
+AP4_Result
+ReadTextFile(std::filesystem::path path, std::string& content)
+{
+    AP4_ByteStream* input = NULL;
+    AP4_Result result = AP4_FileByteStream::Create(path.string().c_str(), AP4_FileByteStream::STREAM_MODE_READ, input);
+    if (AP4_FAILED(result)) return result;
+    AP4_LargeSize size = 0;
+    result = input->GetSize(size);
+    if (AP4_SUCCEEDED(result)) {
+        content.resize((size_t)size);
+        if (size) result = input->Read(&content[0], (AP4_Size)size);
+    }
+    input->Release();
+    return result;
+}
+
+}
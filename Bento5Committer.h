@@ -0,0 +1,111 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENTO5_COMMITTER_H_
+#define _BENTO5_COMMITTER_H_
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
+#include "Ap4.h"
+#include "Bento5Common.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   ByteStreamReleaser
++---------------------------------------------------------------------*/
+// releases what a stream variable points to when it goes out of scope, on every return path
+class ByteStreamReleaser {
+public:
+    ByteStreamReleaser(AP4_ByteStream*& stream) : stream(stream) {}
+    ~ByteStreamReleaser() { if (stream) stream->Release(); }
+private:
+    AP4_ByteStream*& stream;
+};
+
+/*----------------------------------------------------------------------
+|   functions
++---------------------------------------------------------------------*/
+// with direct_size the file is written with O_DIRECT, with a sink out_folder is relative to it
+AP4_ByteStream* OpenOutput(std::filesystem::path out_folder, const char* filename, AP4_UI64* direct_size = NULL, AP4_UI64 preallocate_size = 0,
+                           OutputSink* sink = NULL);
+
+// cut a preallocated file to its size once it has been written and closed
+AP4_Result TrimOutput(std::filesystem::path out_folder, const char* filename, AP4_UI64 size);
+
+// fsync a file or a folder
+AP4_Result SyncPath(const std::filesystem::path& path);
+
+// write a whole file under a temporary name and rename it, readers only ever see complete files
+AP4_Result WriteOutputAtomically(std::filesystem::path out_folder, const char* filename, const std::string& content, bool durable = false,
+                                 OutputSink* sink = NULL);
+
+AP4_Result ReadTextFile(std::filesystem::path path, std::string& content);
+
+/*----------------------------------------------------------------------
+|   SegmentCommitter
++---------------------------------------------------------------------*/
+// --durable: the segments are fsynced and renamed into place in batches by a background thread
+class SegmentCommitter {
+public:
+    // the errors of the commits go to log
+    SegmentCommitter(RunLog* log) : log(log), queued(0), committed(0), batch_count(0), result(AP4_SUCCESS), stopping(false),
+        thread(&SegmentCommitter::Run, this) {}
+    ~SegmentCommitter();
+
+    void Commit(const std::filesystem::path& temp_path, const std::filesystem::path& path);
+
+    AP4_Result Flush();
+
+    AP4_UI64 GetBatchCount() {
+        std::lock_guard<std::mutex> guard(lock);
+        return batch_count;
+    }
+
+private:
+    struct Item {
+        std::filesystem::path temp_path;
+        std::filesystem::path path;
+    };
+
+    void Run();
+
+    static AP4_Result CommitBatch(const std::vector<Item>& batch);
+
+    RunLog*                 log;
+    AP4_UI64                queued;
+    AP4_UI64                committed;
+    AP4_UI64                batch_count;
+    AP4_Result              result;
+    bool                    stopping;
+    std::vector<Item>       pending;
+    std::mutex              lock;
+    std::condition_variable wake;
+    std::condition_variable done;
+    std::thread             thread; // last, it starts running in the constructor
+};
+
+}
+
+#endif // _BENTO5_COMMITTER_H_
@@ -0,0 +1,197 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <chrono>
+#include "Bento5Common.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   AllocationCounter
++---------------------------------------------------------------------*/
+thread_local AP4_UI64 AllocationCounter::count = 0;
+
+/*----------------------------------------------------------------------
+|   IoCounters::Sample
++---------------------------------------------------------------------*/
+IoCounters
+IoCounters::Sample()
+{
+    IoCounters counters;
+    int fd = open("/proc/thread-self/io", O_RDONLY);
+    if (fd < 0) fd = open("/proc/self/io", O_RDONLY);
+    if (fd < 0) return counters;
+    char buffer[512];
+    ssize_t size = read(fd, buffer, sizeof(buffer)-1);
+    close(fd);
+    if (size <= 0) return counters;
+    buffer[size] = '\0';
+    counters.snapshot_size = size;
+    char* line = buffer;
+    while (line && *line) {
+        unsigned long long value = 0;
+        if (sscanf(line, "rchar: %llu", &value) == 1) counters.bytes_read = value;
+        else if (sscanf(line, "wchar: %llu", &value) == 1) counters.bytes_written = value;
+        else if (sscanf(line, "syscr: %llu", &value) == 1) counters.read_syscalls = value;
+        else if (sscanf(line, "syscw: %llu", &value) == 1) counters.write_syscalls = value;
+        line = strchr(line, '\n');
+        if (line) line++;
+    }
+    return counters;
+}
+
+/*----------------------------------------------------------------------
+|   IoCounters::Delta
++---------------------------------------------------------------------*/
+IoCounters
+IoCounters::Delta(const IoCounters& start, const IoCounters& end)
+{
+    IoCounters delta;
+    if (start.snapshot_size == 0 || end.snapshot_size == 0) return delta;
+    delta.bytes_read     = end.bytes_read-start.bytes_read-start.snapshot_size;
+    delta.bytes_written  = end.bytes_written-start.bytes_written;
+    delta.read_syscalls  = end.read_syscalls-start.read_syscalls-1;
+    delta.write_syscalls = end.write_syscalls-start.write_syscalls;
+    return delta;
+}
+
+/*----------------------------------------------------------------------
+|   GetWallTime
++---------------------------------------------------------------------*/
+double
+GetWallTime()
+{
+    return std::chrono::duration<double>(std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
+/*----------------------------------------------------------------------
+|   GetCpuTime
++---------------------------------------------------------------------*/
+double
+GetCpuTime(clockid_t clock)
+{
+    struct timespec ts;
+    if (clock_gettime(clock, &ts) != 0) return 0.0;
+    return (double)ts.tv_sec + (double)ts.tv_nsec/1e9;
+}
+
+/*----------------------------------------------------------------------
+|   RunLog
++---------------------------------------------------------------------*/
+thread_local RunLog* RunLog::Current = NULL;
+
+/*----------------------------------------------------------------------
+|   LogMessage
++---------------------------------------------------------------------*/
+static void
+LogMessage(bool error, const char* format, va_list args)
+{
+    char message[1024];
+    vsnprintf(message, sizeof(message), format, args);
+    if (RunLog::Current) {
+        RunLog::Current->Add(error, message);
+    } else {
+        fprintf(stderr, "%s: %s\n", error ? "ERROR" : "WARNING", message);
+    }
+}
+
+/*----------------------------------------------------------------------
+|   LogError
++---------------------------------------------------------------------*/
+void
+LogError(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    LogMessage(true, format, args);
+    va_end(args);
+}
+
+/*----------------------------------------------------------------------
+|   LogWarning
++---------------------------------------------------------------------*/
+void
+LogWarning(const char* format, ...)
+{
+    va_list args;
+    va_start(args, format);
+    LogMessage(false, format, args);
+    va_end(args);
+}
+
+/*----------------------------------------------------------------------
+|   TraceRecorder::Instance
++---------------------------------------------------------------------*/
+std::atomic<TraceRecorder*> TraceRecorder::Instance(NULL);
+
+/*----------------------------------------------------------------------
+|   TraceRecorder::Save
++---------------------------------------------------------------------*/
+AP4_Result
+TraceRecorder::Save(const std::string& path)
+{
+    JsonWriter json;
+    json.BeginObject();
+    json.Key("displayTimeUnit");
+    json.String("ms");
+    json.Key("traceEvents");
+    json.BeginArray();
+    std::lock_guard<std::mutex> guard(lock);
+    for (const Event& event : events) {
+        json.BeginObject();
+        json.Key("name");
+        json.String(event.name);
+        json.Key("cat");
+        json.String(event.category);
+        json.Key("ph");
+        json.String("X");
+        json.Key("ts");
+        json.Number(event.start*1e6);
+        json.Key("dur");
+        json.Number(event.duration*1e6);
+        json.Key("pid");
+        json.Integer(1);
+        json.Key("tid");
+        json.Integer(event.tid);
+        if (event.arg_name) {
+            json.Key("args");
+            json.BeginObject();
+            json.Key(event.arg_name);
+            json.SignedInteger(event.arg);
+            json.EndObject();
+        }
+        json.EndObject();
+    }
+    json.EndArray();
+    json.EndObject();
+
+    AP4_ByteStream* output = NULL;
+    AP4_Result result = AP4_FileByteStream::Create(path.c_str(), AP4_FileByteStream::STREAM_MODE_WRITE, output);
+    if (AP4_FAILED(result)) return result;
+    result = output->Write(json.GetString().data(), (AP4_Size)json.GetString().size());
+    output->Release();
+    return result;
+}
+
+}
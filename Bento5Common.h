@@ -0,0 +1,338 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENTO5_COMMON_H_
+#define _BENTO5_COMMON_H_
+
+#include <time.h>
+#include <cmath>
+#include <string>
+#include <vector>
+#include <mutex>
+#include <atomic>
+#include "Ap4.h"
+#include "Bento5Packager.h"
+
+namespace Bento5 {
+
+const uint PMT_PID = 0x100;
+const uint AUDIO_PID = 0x101;
+const uint VIDEO_PID = 0x102;
+
+const char* const SEGMENT_FILENAME_TEMPLATE = "segment-%d.ts";
+const char* const INDEX_FILENAME = "stream.m3u8";
+const char* const CHECKSUMS_FILENAME = "checksums.txt";
+const char* const IFRAME_INDEX_FILENAME = "iframes.m3u8";
+const char* const SHARD_FILENAME_TEMPLATE = "shard-%u-of-%u.txt";
+const char* const JOURNAL_FILENAME = "journal.txt";
+
+const float MAX_DTS_DELTA = 0.2;
+
+/*----------------------------------------------------------------------
+|   Stage
++---------------------------------------------------------------------*/
+enum Stage {
+    STAGE_OPEN,
+    STAGE_KEYFRAME_SCAN,
+    STAGE_SAMPLE_READ,
+    STAGE_PACKETIZE,
+    STAGE_WRITE,
+    STAGE_PLAYLIST,
+    STAGE_COUNT
+};
+
+const char* const STAGE_NAMES[STAGE_COUNT] = {
+    "open",
+    "keyframe_scan",
+    "sample_read",
+    "packetize",
+    "write",
+    "playlist"
+};
+
+/*----------------------------------------------------------------------
+|   IoCounters
++---------------------------------------------------------------------*/
+class IoCounters {
+public:
+    IoCounters(): bytes_read(0), bytes_written(0), read_syscalls(0), write_syscalls(0), snapshot_size(0) {}
+    AP4_UI64 bytes_read;
+    AP4_UI64 bytes_written;
+    AP4_UI64 read_syscalls;
+    AP4_UI64 write_syscalls;
+    AP4_UI64 snapshot_size; // bytes returned by the read that took this snapshot
+
+    // snapshot of the I/O accounting of the calling thread (Linux only, zeros elsewhere)
+    static IoCounters Sample();
+
+    // I/O done between two snapshots, not counting the read of the first snapshot itself
+    static IoCounters Delta(const IoCounters& start, const IoCounters& end);
+};
+
+/*----------------------------------------------------------------------
+|   StageStats
++---------------------------------------------------------------------*/
+class StageStats {
+public:
+    StageStats(): wall_time(0.0), cpu_time(0.0) {}
+    double     wall_time;
+    double     cpu_time;
+    IoCounters io;
+
+    void AddIo(const IoCounters& delta) {
+        io.bytes_read     += delta.bytes_read;
+        io.bytes_written  += delta.bytes_written;
+        io.read_syscalls  += delta.read_syscalls;
+        io.write_syscalls += delta.write_syscalls;
+    }
+};
+
+double GetWallTime();
+double GetCpuTime(clockid_t clock = CLOCK_THREAD_CPUTIME_ID);
+
+/*----------------------------------------------------------------------
+|   StageTimer
++---------------------------------------------------------------------*/
+class StageTimer {
+public:
+    // a NULL stage makes the timer a no-op, with_io also samples the thread I/O counters
+    StageTimer(StageStats* stage, bool with_io = false) : stage(stage), with_io(with_io), wall_start(0.0), cpu_start(0.0) {
+        if (stage == NULL) return;
+        if (with_io) io_start = IoCounters::Sample();
+        wall_start = GetWallTime();
+        cpu_start  = GetCpuTime();
+    }
+    ~StageTimer() {
+        if (stage == NULL) return;
+        stage->wall_time += GetWallTime()-wall_start;
+        stage->cpu_time  += GetCpuTime()-cpu_start;
+        if (with_io) stage->AddIo(IoCounters::Delta(io_start, IoCounters::Sample()));
+    }
+private:
+    StageStats* stage;
+    bool        with_io;
+    double      wall_start;
+    double      cpu_start;
+    IoCounters  io_start;
+};
+
+/*----------------------------------------------------------------------
+|   RunLog
++---------------------------------------------------------------------*/
+// Errors and warnings of a Packager::Run, from any of its threads. Each thread of a run points
+// RunLog::Current at the log of the run with a RunLogScope, LogError and LogWarning write to
+// stderr outside of a run.
+class RunLog {
+public:
+    void Add(bool error, const std::string& message) {
+        std::lock_guard<std::mutex> guard(lock);
+        (error ? errors : warnings).push_back(message);
+    }
+
+    static thread_local RunLog* Current;
+
+    std::mutex               lock;
+    std::vector<std::string> errors;
+    std::vector<std::string> warnings;
+};
+
+class RunLogScope {
+public:
+    RunLogScope(RunLog* log) : previous(RunLog::Current) { RunLog::Current = log; }
+    ~RunLogScope() { RunLog::Current = previous; }
+private:
+    RunLog* previous;
+};
+
+void LogError(const char* format, ...);
+void LogWarning(const char* format, ...);
+
+/*----------------------------------------------------------------------
+|   SegmentChecksum
++---------------------------------------------------------------------*/
+class SegmentChecksum {
+public:
+    SegmentChecksum() : crc32c(0) { memset(sha256, 0, sizeof(sha256)); }
+    AP4_UI32 crc32c;
+    AP4_UI08 sha256[32];
+
+    std::string GetCrc32cString() const {
+        char buffer[16];
+        snprintf(buffer, sizeof(buffer), "%08x", crc32c);
+        return buffer;
+    }
+    std::string GetSha256String() const {
+        char buffer[65];
+        for (unsigned int i = 0; i < 32; i++) snprintf(buffer+2*i, 3, "%02x", sha256[i]);
+        return buffer;
+    }
+};
+
+class Stats {
+public:
+    Stats(): segments_total_size(0), segments_total_duration(0.0), segment_count(0), max_segment_bitrate(0.0), codecs(""), resolution(""), payload_size(0),
+        iframe_count(0), iframe_max_bitrate(0.0), iframe_average_bitrate(0.0), sample_allocations(0), steady_state_allocations(0), arena_size(0),
+        fragment_peak_buffered_size(0), fragment_rereads(0), input_cache_released(0), direct_written_size(0) {}
+    AP4_UI64 segments_total_size;
+    double   segments_total_duration;
+    AP4_UI32 segment_count;
+    double   max_segment_bitrate;
+    std::string codecs;
+    std::string resolution;
+    std::string video_codec;
+    AP4_UI64 payload_size;
+    AP4_UI32 iframe_count; // entries of the I-frame playlist, 0 when there is none
+    double   iframe_max_bitrate;
+    double   iframe_average_bitrate;
+    std::vector<AP4_UI32> segment_sizes;
+    std::vector<double>   segment_durations;
+    std::vector<SegmentChecksum> segment_checksums; // only filled in with --checksums
+    StageStats stages[STAGE_COUNT];
+    AP4_UI64 sample_allocations;       // heap allocations while reading, packetizing and writing the samples
+    AP4_UI64 steady_state_allocations; // the same, from the second segment on
+    AP4_UI64 arena_size;               // size of the segment arena at the end
+    AP4_UI64 fragment_peak_buffered_size; // most sample data waiting for the other track, fragmented inputs only
+    AP4_UI32 fragment_rereads;            // tracks read again after going past the buffer cap
+    AP4_UI64 input_cache_released;        // input bytes dropped from the page cache, with --release-input-cache
+    AP4_UI64 direct_written_size;         // segment bytes written with O_DIRECT, with --direct-io
+};
+
+/*----------------------------------------------------------------------
+|   JsonWriter
++---------------------------------------------------------------------*/
+class JsonWriter {
+public:
+    JsonWriter() : need_comma(false) {}
+    void BeginObject() { Separate(); out += '{'; need_comma = false; }
+    void EndObject()   { out += '}'; need_comma = true; }
+    void BeginArray()  { Separate(); out += '['; need_comma = false; }
+    void EndArray()    { out += ']'; need_comma = true; }
+    void Key(const char* key) { Separate(); Quote(key); out += ':'; need_comma = false; }
+    void String(const std::string& value) { Separate(); Quote(value); need_comma = true; }
+    void Bool(bool value) { Separate(); out += value ? "true" : "false"; need_comma = true; }
+    void Integer(AP4_UI64 value) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%llu", (unsigned long long)value);
+        Separate(); out += buffer; need_comma = true;
+    }
+    void SignedInteger(AP4_SI64 value) {
+        char buffer[32];
+        snprintf(buffer, sizeof(buffer), "%lld", (long long)value);
+        Separate(); out += buffer; need_comma = true;
+    }
+    void Number(double value) {
+        char buffer[64];
+        if (std::isfinite(value)) {
+            snprintf(buffer, sizeof(buffer), "%.9g", value);
+        } else {
+            snprintf(buffer, sizeof(buffer), "null");
+        }
+        Separate(); out += buffer; need_comma = true;
+    }
+    const std::string& GetString() const { return out; }
+
+private:
+    void Separate() { if (need_comma) out += ','; }
+    void Quote(const std::string& value) {
+        out += '"';
+        for (unsigned char c : value) {
+            if (c == '"' || c == '\\') {
+                out += '\\'; out += c;
+            } else if (c < 0x20) {
+                char buffer[8];
+                snprintf(buffer, sizeof(buffer), "\\u%04x", c);
+                out += buffer;
+            } else {
+                out += c;
+            }
+        }
+        out += '"';
+    }
+    std::string out;
+    bool        need_comma;
+};
+
+/*----------------------------------------------------------------------
+|   TraceRecorder
++---------------------------------------------------------------------*/
+class TraceRecorder {
+public:
+    // the active recorder, NULL when tracing is off
+    static std::atomic<TraceRecorder*> Instance;
+
+    TraceRecorder() : origin(GetWallTime()) {}
+
+    double Now() const { return GetWallTime()-origin; }
+
+    void AddSpan(const char* name, const char* category, double start, double end, const char* arg_name, AP4_SI64 arg) {
+        Event event = { name, category, arg_name, arg, start, end-start, CurrentThreadId() };
+        std::lock_guard<std::mutex> guard(lock);
+        events.push_back(event);
+    }
+
+    // Chrome/Perfetto trace event format, one complete ('X') event per span
+    AP4_Result Save(const std::string& path);
+
+private:
+    struct Event {
+        const char*  name;
+        const char*  category;
+        const char*  arg_name;
+        AP4_SI64     arg;
+        double       start;
+        double       duration;
+        unsigned int tid;
+    };
+
+    static unsigned int CurrentThreadId() {
+        static std::atomic<unsigned int> next_id(1);
+        thread_local unsigned int id = next_id++;
+        return id;
+    }
+
+    double             origin;
+    std::mutex         lock;
+    std::vector<Event> events;
+};
+
+/*----------------------------------------------------------------------
+|   TraceSpan
++---------------------------------------------------------------------*/
+class TraceSpan {
+public:
+    TraceSpan(const char* name, const char* category, const char* arg_name = NULL, AP4_SI64 arg = 0) :
+        recorder(TraceRecorder::Instance.load()), name(name), category(category), arg_name(arg_name), arg(arg), start(0.0) {
+        if (recorder) start = recorder->Now();
+    }
+    ~TraceSpan() {
+        if (recorder) recorder->AddSpan(name, category, start, recorder->Now(), arg_name, arg);
+    }
+private:
+    TraceRecorder* recorder;
+    const char*    name;
+    const char*    category;
+    const char*    arg_name;
+    AP4_SI64       arg;
+    double         start;
+};
+
+}
+
+#endif // _BENTO5_COMMON_H_
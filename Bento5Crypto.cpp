@@ -0,0 +1,545 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <array>
+#include <algorithm>
+#if defined(__x86_64__) || defined(__i386__)
+#include <cpuid.h>
+#include <immintrin.h>
+#elif defined(__aarch64__)
+#include <arm_acle.h>
+#if defined(__linux__)
+#include <sys/auxv.h>
+#include <asm/hwcap.h>
+#endif
+#endif
+#include "Bento5Crypto.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   Crc32c
++---------------------------------------------------------------------*/
+static bool
+HasCrc32cInstructions()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __builtin_cpu_supports("sse4.2");
+#elif defined(__aarch64__) && defined(__linux__)
+    return (getauxval(AT_HWCAP) & HWCAP_CRC32) != 0;
+#else
+    return false;
+#endif
+}
+
+static AP4_UI32
+UpdateCrc32cSoftware(AP4_UI32 crc, const AP4_UI08* data, AP4_Size size)
+{
+    static const std::array<AP4_UI32, 256> table = [] {
+        std::array<AP4_UI32, 256> entries;
+        for (AP4_UI32 i = 0; i < 256; i++) {
+            AP4_UI32 value = i;
+            for (unsigned int bit = 0; bit < 8; bit++) {
+                value = (value >> 1) ^ (value & 1 ? 0x82F63B78 : 0);
+            }
+            entries[i] = value;
+        }
+        return entries;
+    }();
+    while (size--) crc = (crc >> 8) ^ table[(crc ^ *data++) & 0xFF];
+    return crc;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+__attribute__((target("sse4.2")))
+static AP4_UI32
+UpdateCrc32cHardware(AP4_UI32 crc, const AP4_UI08* data, AP4_Size size)
+{
+#if defined(__x86_64__)
+    AP4_UI64 crc64 = crc;
+    for (; size >= 8; data += 8, size -= 8) {
+        AP4_UI64 value;
+        memcpy(&value, data, 8);
+        crc64 = _mm_crc32_u64(crc64, value);
+    }
+    crc = (AP4_UI32)crc64;
+#endif
+    for (; size >= 4; data += 4, size -= 4) {
+        AP4_UI32 value;
+        memcpy(&value, data, 4);
+        crc = _mm_crc32_u32(crc, value);
+    }
+    while (size--) crc = _mm_crc32_u8(crc, *data++);
+    return crc;
+}
+#elif defined(__aarch64__)
+__attribute__((target("+crc")))
+static AP4_UI32
+UpdateCrc32cHardware(AP4_UI32 crc, const AP4_UI08* data, AP4_Size size)
+{
+    for (; size >= 8; data += 8, size -= 8) {
+        AP4_UI64 value;
+        memcpy(&value, data, 8);
+        crc = __crc32cd(crc, value);
+    }
+    while (size--) crc = __crc32cb(crc, *data++);
+    return crc;
+}
+#else
+static AP4_UI32
+UpdateCrc32cHardware(AP4_UI32 crc, const AP4_UI08* data, AP4_Size size)
+{
+    return UpdateCrc32cSoftware(crc, data, size);
+}
+#endif
+
+/*----------------------------------------------------------------------
+|   Crc32c::HasHardwareSupport
++---------------------------------------------------------------------*/
+bool
+Crc32c::HasHardwareSupport()
+{
+    static const bool supported = HasCrc32cInstructions();
+    return supported;
+}
+
+/*----------------------------------------------------------------------
+|   Crc32c::Update
++---------------------------------------------------------------------*/
+void
+Crc32c::Update(const AP4_UI08* data, AP4_Size size)
+{
+    crc = hardware ? UpdateCrc32cHardware(crc, data, size) : UpdateCrc32cSoftware(crc, data, size);
+}
+
+/*----------------------------------------------------------------------
+|   Sha256
++---------------------------------------------------------------------*/
+static const AP4_UI32 SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static AP4_UI32
+Rotr(AP4_UI32 x, unsigned int n)
+{
+    return (x >> n) | (x << (32-n));
+}
+
+static void
+TransformSha256Software(AP4_UI32 state[8], const AP4_UI08* data, size_t blocks)
+{
+    for (; blocks; blocks--, data += 64) {
+        AP4_UI32 w[64];
+        for (unsigned int i = 0; i < 16; i++) w[i] = AP4_BytesToUInt32BE(data+4*i);
+        for (unsigned int i = 16; i < 64; i++) {
+            AP4_UI32 s0 = Rotr(w[i-15], 7) ^ Rotr(w[i-15], 18) ^ (w[i-15] >> 3);
+            AP4_UI32 s1 = Rotr(w[i-2], 17) ^ Rotr(w[i-2], 19) ^ (w[i-2] >> 10);
+            w[i] = w[i-16]+s0+w[i-7]+s1;
+        }
+        AP4_UI32 a = state[0], b = state[1], c = state[2], d = state[3];
+        AP4_UI32 e = state[4], f = state[5], g = state[6], h = state[7];
+        for (unsigned int i = 0; i < 64; i++) {
+            AP4_UI32 t1 = h+(Rotr(e, 6) ^ Rotr(e, 11) ^ Rotr(e, 25))+((e & f) ^ (~e & g))+SHA256_K[i]+w[i];
+            AP4_UI32 t2 = (Rotr(a, 2) ^ Rotr(a, 13) ^ Rotr(a, 22))+((a & b) ^ (a & c) ^ (b & c));
+            h = g; g = f; f = e; e = d+t1;
+            d = c; c = b; b = a; a = t1+t2;
+        }
+        state[0] += a; state[1] += b; state[2] += c; state[3] += d;
+        state[4] += e; state[5] += f; state[6] += g; state[7] += h;
+    }
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+static bool
+HasShaInstructions()
+{
+    unsigned int eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(7, 0, &eax, &ebx, &ecx, &edx)) return false;
+    return (ebx & bit_SHA) != 0 && __builtin_cpu_supports("sse4.1");
+}
+
+__attribute__((target("sha,sse4.1")))
+static void
+TransformSha256Hardware(AP4_UI32 state[8], const AP4_UI08* data, size_t blocks)
+{
+    const __m128i byte_swap = _mm_set_epi64x(0x0c0d0e0f08090a0bULL, 0x0405060700010203ULL);
+
+    // the instructions work on the state as ABEF/CDGH
+    __m128i dcba = _mm_loadu_si128((const __m128i*)&state[0]);
+    __m128i hgfe = _mm_loadu_si128((const __m128i*)&state[4]);
+    __m128i cdab = _mm_shuffle_epi32(dcba, 0xB1);
+    __m128i efgh = _mm_shuffle_epi32(hgfe, 0x1B);
+    __m128i abef = _mm_alignr_epi8(cdab, efgh, 8);
+    __m128i cdgh = _mm_blend_epi16(efgh, cdab, 0xF0);
+
+    for (; blocks; blocks--, data += 64) {
+        __m128i abef_save = abef;
+        __m128i cdgh_save = cdgh;
+        __m128i w[4];
+        for (unsigned int i = 0; i < 16; i++) {
+            if (i < 4) {
+                w[i] = _mm_shuffle_epi8(_mm_loadu_si128((const __m128i*)(data+16*i)), byte_swap);
+            } else {
+                // w[i%4] still holds the words of group i-4
+                __m128i next = _mm_sha256msg1_epu32(w[i%4], w[(i+1)%4]);
+                next = _mm_add_epi32(next, _mm_alignr_epi8(w[(i+3)%4], w[(i+2)%4], 4));
+                w[i%4] = _mm_sha256msg2_epu32(next, w[(i+3)%4]);
+            }
+            __m128i message = _mm_add_epi32(w[i%4], _mm_loadu_si128((const __m128i*)&SHA256_K[4*i]));
+            cdgh = _mm_sha256rnds2_epu32(cdgh, abef, message);
+            abef = _mm_sha256rnds2_epu32(abef, cdgh, _mm_shuffle_epi32(message, 0x0E));
+        }
+        abef = _mm_add_epi32(abef, abef_save);
+        cdgh = _mm_add_epi32(cdgh, cdgh_save);
+    }
+
+    __m128i feba = _mm_shuffle_epi32(abef, 0x1B);
+    __m128i dchg = _mm_shuffle_epi32(cdgh, 0xB1);
+    _mm_storeu_si128((__m128i*)&state[0], _mm_blend_epi16(feba, dchg, 0xF0));
+    _mm_storeu_si128((__m128i*)&state[4], _mm_alignr_epi8(dchg, feba, 8));
+}
+#endif
+
+static void
+TransformSha256(AP4_UI32 state[8], const AP4_UI08* data, size_t blocks, bool hardware)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (hardware) {
+        TransformSha256Hardware(state, data, blocks);
+        return;
+    }
+#endif
+    TransformSha256Software(state, data, blocks);
+}
+
+/*----------------------------------------------------------------------
+|   Sha256::Sha256
++---------------------------------------------------------------------*/
+Sha256::Sha256(bool hardware) :
+    buffered(0),
+    length(0),
+    hardware(hardware && HasHardwareSupport())
+{
+    static const AP4_UI32 initial_state[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+    memcpy(state, initial_state, sizeof(state));
+}
+
+/*----------------------------------------------------------------------
+|   Sha256::HasHardwareSupport
++---------------------------------------------------------------------*/
+bool
+Sha256::HasHardwareSupport()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool supported = HasShaInstructions();
+    return supported;
+#else
+    return false;
+#endif
+}
+
+/*----------------------------------------------------------------------
+|   Sha256::Update
++---------------------------------------------------------------------*/
+void
+Sha256::Update(const AP4_UI08* data, AP4_Size size)
+{
+    length += size;
+    if (buffered) {
+        AP4_Size chunk = std::min<AP4_Size>(size, 64-buffered);
+        memcpy(buffer+buffered, data, chunk);
+        buffered += chunk;
+        data += chunk;
+        size -= chunk;
+        if (buffered < 64) return;
+        TransformSha256(state, buffer, 1, hardware);
+        buffered = 0;
+    }
+    if (size >= 64) {
+        TransformSha256(state, data, size/64, hardware);
+        data += size & ~63u;
+        size &= 63;
+    }
+    memcpy(buffer, data, size);
+    buffered = size;
+}
+
+/*----------------------------------------------------------------------
+|   Sha256::Final
++---------------------------------------------------------------------*/
+void
+Sha256::Final(AP4_UI08 digest[32])
+{
+    AP4_UI64 bit_length = length*8;
+    AP4_UI08 padding[72] = { 0x80 };
+    AP4_Size padding_size = (buffered < 56 ? 56 : 120)-buffered;
+    AP4_BytesFromUInt64BE(padding+padding_size, bit_length);
+    Update(padding, padding_size+8);
+    for (unsigned int i = 0; i < 8; i++) {
+        AP4_BytesFromUInt32BE(digest+4*i, state[i]);
+    }
+}
+
+/*----------------------------------------------------------------------
+|   ChecksumByteStream::Finish
++---------------------------------------------------------------------*/
+SegmentChecksum
+ChecksumByteStream::Finish()
+{
+    SegmentChecksum checksum;
+    checksum.crc32c = m_Crc32c.GetValue();
+    m_Sha256.Final(checksum.sha256);
+    return checksum;
+}
+
+/*----------------------------------------------------------------------
+|   ChecksumByteStream::WritePartial
++---------------------------------------------------------------------*/
+AP4_Result
+ChecksumByteStream::WritePartial(const void* buffer, AP4_Size bytes_to_write, AP4_Size& bytes_written)
+{
+    AP4_Result result = m_Output->WritePartial(buffer, bytes_to_write, bytes_written);
+    if (AP4_SUCCEEDED(result)) {
+        m_Crc32c.Update((const AP4_UI08*)buffer, bytes_written);
+        m_Sha256.Update((const AP4_UI08*)buffer, bytes_written);
+    }
+    return result;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+/*----------------------------------------------------------------------
+|   AES-NI
++---------------------------------------------------------------------*/
+__attribute__((target("aes,sse2")))
+static __m128i
+ExpandAesKeyStep(__m128i key, __m128i generated)
+{
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    key = _mm_xor_si128(key, _mm_slli_si128(key, 4));
+    return _mm_xor_si128(key, _mm_shuffle_epi32(generated, 0xFF));
+}
+
+__attribute__((target("aes,sse2")))
+static void
+ExpandAesKeyHardware(const AP4_UI08 key[16], AP4_UI08 round_keys[11*16])
+{
+    __m128i k[11];
+    k[0]  = _mm_loadu_si128((const __m128i*)key);
+    // the round constant has to be an immediate
+    k[1]  = ExpandAesKeyStep(k[0], _mm_aeskeygenassist_si128(k[0], 0x01));
+    k[2]  = ExpandAesKeyStep(k[1], _mm_aeskeygenassist_si128(k[1], 0x02));
+    k[3]  = ExpandAesKeyStep(k[2], _mm_aeskeygenassist_si128(k[2], 0x04));
+    k[4]  = ExpandAesKeyStep(k[3], _mm_aeskeygenassist_si128(k[3], 0x08));
+    k[5]  = ExpandAesKeyStep(k[4], _mm_aeskeygenassist_si128(k[4], 0x10));
+    k[6]  = ExpandAesKeyStep(k[5], _mm_aeskeygenassist_si128(k[5], 0x20));
+    k[7]  = ExpandAesKeyStep(k[6], _mm_aeskeygenassist_si128(k[6], 0x40));
+    k[8]  = ExpandAesKeyStep(k[7], _mm_aeskeygenassist_si128(k[7], 0x80));
+    k[9]  = ExpandAesKeyStep(k[8], _mm_aeskeygenassist_si128(k[8], 0x1B));
+    k[10] = ExpandAesKeyStep(k[9], _mm_aeskeygenassist_si128(k[9], 0x36));
+    for (unsigned int i = 0; i < 11; i++) {
+        _mm_storeu_si128((__m128i*)(round_keys+16*i), k[i]);
+    }
+}
+
+__attribute__((target("aes,sse2")))
+static void
+EncryptAesCbcHardware(const AP4_UI08 round_keys[11*16], const AP4_UI08* input, AP4_Size size, AP4_UI08* output, const AP4_UI08 iv[16])
+{
+    __m128i k[11];
+    for (unsigned int i = 0; i < 11; i++) {
+        k[i] = _mm_loadu_si128((const __m128i*)(round_keys+16*i));
+    }
+    __m128i block = _mm_loadu_si128((const __m128i*)iv);
+    for (; size; size -= 16, input += 16, output += 16) {
+        block = _mm_xor_si128(block, _mm_loadu_si128((const __m128i*)input));
+        block = _mm_xor_si128(block, k[0]);
+        for (unsigned int i = 1; i < 10; i++) {
+            block = _mm_aesenc_si128(block, k[i]);
+        }
+        block = _mm_aesenclast_si128(block, k[10]);
+        _mm_storeu_si128((__m128i*)output, block);
+    }
+}
+#endif
+
+/*----------------------------------------------------------------------
+|   Aes128CbcEncrypter::Aes128CbcEncrypter
++---------------------------------------------------------------------*/
+Aes128CbcEncrypter::Aes128CbcEncrypter(const AP4_UI08 key[16], bool hardware) :
+    m_Hardware(false),
+    m_BlockCipher(NULL)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    if (hardware && HasHardwareSupport()) {
+        ExpandAesKeyHardware(key, m_RoundKeys);
+        m_Hardware = true;
+        return;
+    }
+#endif
+    AP4_DefaultBlockCipherFactory::Instance.CreateCipher(AP4_BlockCipher::AES_128,
+                                                         AP4_BlockCipher::ENCRYPT,
+                                                         AP4_BlockCipher::CBC,
+                                                         NULL,
+                                                         key,
+                                                         16,
+                                                         m_BlockCipher);
+}
+
+/*----------------------------------------------------------------------
+|   Aes128CbcEncrypter::HasHardwareSupport
++---------------------------------------------------------------------*/
+bool
+Aes128CbcEncrypter::HasHardwareSupport()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    static const bool supported = __builtin_cpu_supports("aes");
+    return supported;
+#else
+    return false;
+#endif
+}
+
+/*----------------------------------------------------------------------
+|   Aes128CbcEncrypter::Process
++---------------------------------------------------------------------*/
+AP4_Result
+Aes128CbcEncrypter::Process(const AP4_UI08* input, AP4_Size size, AP4_UI08* output, AP4_UI08 chain[16]) const
+{
+    if (size % 16) return AP4_ERROR_INVALID_PARAMETERS;
+    if (size == 0) return AP4_SUCCESS;
+    if (m_Hardware) {
+#if defined(__x86_64__) || defined(__i386__)
+        EncryptAesCbcHardware(m_RoundKeys, input, size, output, chain);
+#endif
+    } else if (m_BlockCipher) {
+        AP4_Result result = m_BlockCipher->Process(input, size, output, chain);
+        if (AP4_FAILED(result)) return result;
+    } else {
+        return AP4_ERROR_INTERNAL;
+    }
+    memcpy(chain, output+size-16, 16);
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   EncryptingByteStream::Finish
++---------------------------------------------------------------------*/
+AP4_Result
+EncryptingByteStream::Finish()
+{
+    AP4_UI08 padding = (AP4_UI08)(16-m_PendingSize);
+    memset(m_Pending+m_PendingSize, padding, padding);
+    m_PendingSize = 0;
+    AP4_UI08 block[16];
+    AP4_Result result = m_Encrypter.Process(m_Pending, 16, block, m_Chain);
+    if (AP4_FAILED(result)) return result;
+    return m_Output->Write(block, 16);
+}
+
+/*----------------------------------------------------------------------
+|   EncryptingByteStream::WritePartial
++---------------------------------------------------------------------*/
+AP4_Result
+EncryptingByteStream::WritePartial(const void* buffer, AP4_Size bytes_to_write, AP4_Size& bytes_written)
+{
+    const AP4_UI08* data = (const AP4_UI08*)buffer;
+    AP4_Size        size = bytes_to_write;
+    bytes_written = 0;
+
+    // not enough to complete a block yet
+    if (m_PendingSize+size < 16) {
+        memcpy(m_Pending+m_PendingSize, data, size);
+        m_PendingSize += size;
+        bytes_written = bytes_to_write;
+        return AP4_SUCCESS;
+    }
+
+    // encrypt the pending block and the whole blocks that follow it, written in runs of up
+    // to the size of the output buffer
+    AP4_Size   output_size = 0;
+    AP4_Result result;
+    if (m_PendingSize) {
+        AP4_Size chunk = 16-m_PendingSize;
+        memcpy(m_Pending+m_PendingSize, data, chunk);
+        data += chunk;
+        size -= chunk;
+        result = m_Encrypter.Process(m_Pending, 16, m_Buffer, m_Chain);
+        if (AP4_FAILED(result)) return result;
+        output_size = 16;
+    }
+    while (size >= 16) {
+        AP4_Size blocks_size = std::min<AP4_Size>(size & ~15u, sizeof(m_Buffer)-output_size);
+        result = m_Encrypter.Process(data, blocks_size, m_Buffer+output_size, m_Chain);
+        if (AP4_FAILED(result)) return result;
+        data        += blocks_size;
+        size        -= blocks_size;
+        output_size += blocks_size;
+        if (output_size == sizeof(m_Buffer)) {
+            result = m_Output->Write(m_Buffer, output_size);
+            if (AP4_FAILED(result)) return result;
+            output_size = 0;
+        }
+    }
+    if (output_size) {
+        result = m_Output->Write(m_Buffer, output_size);
+        if (AP4_FAILED(result)) return result;
+    }
+
+    // keep the rest for later
+    m_PendingSize = size;
+    memcpy(m_Pending, data, m_PendingSize);
+
+    bytes_written = bytes_to_write;
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   ReadFileCrc32c
++---------------------------------------------------------------------*/
+AP4_Result
+ReadFileCrc32c(std::filesystem::path path, AP4_UI32& crc32c)
+{
+    AP4_ByteStream* input = NULL;
+    AP4_Result result = AP4_FileByteStream::Create(path.string().c_str(), AP4_FileByteStream::STREAM_MODE_READ, input);
+    if (AP4_FAILED(result)) return result;
+    Crc32c                crc;
+    std::vector<AP4_UI08> buffer(1024*1024);
+    AP4_Size              bytes_read = 0;
+    while (AP4_SUCCEEDED(result = input->ReadPartial(buffer.data(), (AP4_Size)buffer.size(), bytes_read)) && bytes_read) {
+        crc.Update(buffer.data(), bytes_read);
+    }
+    input->Release();
+    if (AP4_FAILED(result) && result != AP4_ERROR_EOS) return result;
+    crc32c = crc.GetValue();
+    return AP4_SUCCESS;
+}
+
+}
@@ -0,0 +1,205 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENTO5_CRYPTO_H_
+#define _BENTO5_CRYPTO_H_
+
+#include <string.h>
+#include <string>
+#include <filesystem>
+#include "Ap4.h"
+#include "Bento5Common.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   Crc32c
++---------------------------------------------------------------------*/
+// CRC-32C (Castagnoli), with the SSE4.2 or ARMv8 CRC instructions when the CPU has them
+class Crc32c {
+public:
+    // hardware false forces the portable code, it is only used when the CPU supports it
+    Crc32c(bool hardware = true) : crc(0xFFFFFFFF), hardware(hardware && HasHardwareSupport()) {}
+
+    static bool HasHardwareSupport();
+
+    void     Update(const AP4_UI08* data, AP4_Size size);
+    AP4_UI32 GetValue() const { return crc ^ 0xFFFFFFFF; }
+
+private:
+    AP4_UI32 crc;
+    bool     hardware;
+};
+
+/*----------------------------------------------------------------------
+|   Sha256
++---------------------------------------------------------------------*/
+// SHA-256 (FIPS 180-4), with the x86 SHA extensions when the CPU has them
+class Sha256 {
+public:
+    Sha256(bool hardware = true);
+
+    static bool HasHardwareSupport();
+
+    void Update(const AP4_UI08* data, AP4_Size size);
+    void Final(AP4_UI08 digest[32]);
+
+private:
+    AP4_UI32 state[8];
+    AP4_UI08 buffer[64];
+    AP4_Size buffered;
+    AP4_UI64 length;
+    bool     hardware;
+};
+
+/*----------------------------------------------------------------------
+|   ChecksumByteStream
++---------------------------------------------------------------------*/
+// write-only stream that hashes the bytes on their way to another stream
+class ChecksumByteStream : public AP4_ByteStream {
+public:
+    ChecksumByteStream(AP4_ByteStream* output) : m_Output(output), m_ReferenceCount(1) {
+        m_Output->AddReference();
+    }
+
+    // the checksums of everything written so far, can only be called once
+    SegmentChecksum Finish();
+
+    // AP4_ByteStream methods
+    AP4_Result ReadPartial(void* /*buffer*/, AP4_Size /*bytes_to_read*/, AP4_Size& bytes_read) {
+        bytes_read = 0;
+        return AP4_ERROR_NOT_SUPPORTED;
+    }
+    AP4_Result WritePartial(const void* buffer, AP4_Size bytes_to_write, AP4_Size& bytes_written);
+    AP4_Result Seek(AP4_Position /*position*/) { return AP4_ERROR_NOT_SUPPORTED; }
+    AP4_Result Tell(AP4_Position& position) { return m_Output->Tell(position); }
+    AP4_Result GetSize(AP4_LargeSize& size) { return m_Output->GetSize(size); }
+    AP4_Result Flush() { return m_Output->Flush(); }
+
+    // AP4_Referenceable methods
+    void AddReference() { m_ReferenceCount++; }
+    void Release() {
+        if (--m_ReferenceCount == 0) delete this;
+    }
+
+private:
+    ~ChecksumByteStream() { m_Output->Release(); }
+
+    AP4_ByteStream* m_Output;
+    AP4_Cardinal    m_ReferenceCount;
+    Crc32c          m_Crc32c;
+    Sha256          m_Sha256;
+};
+
+/*----------------------------------------------------------------------
+|   Aes128CbcEncrypter
++---------------------------------------------------------------------*/
+// AES-128 CBC encryption of whole blocks, with AES-NI when the CPU has it
+class Aes128CbcEncrypter {
+public:
+    Aes128CbcEncrypter(const AP4_UI08 key[16], bool hardware = true);
+    ~Aes128CbcEncrypter() { delete m_BlockCipher; }
+
+    static bool HasHardwareSupport();
+
+    // encrypt size bytes (a multiple of 16), chain holds the IV on input and the last cipher block on output
+    AP4_Result Process(const AP4_UI08* input, AP4_Size size, AP4_UI08* output, AP4_UI08 chain[16]) const;
+
+private:
+    AP4_UI08         m_RoundKeys[11*16]; // only with AES-NI
+    bool             m_Hardware;
+    AP4_BlockCipher* m_BlockCipher;      // NULL when using AES-NI
+};
+
+/*----------------------------------------------------------------------
+|   EncryptionKey
++---------------------------------------------------------------------*/
+// AES-128 key of the segments and the URI the players fetch it from
+class EncryptionKey {
+public:
+    EncryptionKey(const AP4_UI08 key[16], std::string uri) : encrypter(key), uri(uri) { memcpy(this->key, key, 16); }
+
+    // the implicit IV of a segment is its media sequence number as a big-endian 128 bit integer
+    static void GetSegmentIV(unsigned int media_sequence, AP4_UI08 iv[16]) {
+        memset(iv, 0, 16);
+        AP4_BytesFromUInt32BE(iv+12, media_sequence);
+    }
+
+    Aes128CbcEncrypter encrypter;
+    std::string        uri;
+    AP4_UI08           key[16]; // only for the fingerprint of the journal
+};
+
+/*----------------------------------------------------------------------
+|   EncryptingByteStream
++---------------------------------------------------------------------*/
+// write-only stream that encrypts with AES-128 CBC on the way to another stream, Finish()
+// writes the last block with its PKCS7 padding
+class EncryptingByteStream : public AP4_ByteStream {
+public:
+    EncryptingByteStream(AP4_ByteStream* output, const Aes128CbcEncrypter& encrypter, const AP4_UI08 iv[16]) :
+        m_Output(output), m_Encrypter(encrypter), m_PendingSize(0), m_ReferenceCount(1) {
+        m_Output->AddReference();
+        memcpy(m_Chain, iv, 16);
+    }
+
+    AP4_Result Finish();
+
+    // AP4_ByteStream methods
+    AP4_Result ReadPartial(void* /*buffer*/, AP4_Size /*bytes_to_read*/, AP4_Size& bytes_read) {
+        bytes_read = 0;
+        return AP4_ERROR_NOT_SUPPORTED;
+    }
+    AP4_Result WritePartial(const void* buffer, AP4_Size bytes_to_write, AP4_Size& bytes_written);
+    AP4_Result Seek(AP4_Position /*position*/) { return AP4_ERROR_NOT_SUPPORTED; }
+    AP4_Result Tell(AP4_Position& position) {
+        AP4_Result result = m_Output->Tell(position);
+        position += m_PendingSize;
+        return result;
+    }
+    AP4_Result GetSize(AP4_LargeSize& size) { return m_Output->GetSize(size); }
+    AP4_Result Flush() { return m_Output->Flush(); }
+
+    // AP4_Referenceable methods
+    void AddReference() { m_ReferenceCount++; }
+    void Release() {
+        if (--m_ReferenceCount == 0) delete this;
+    }
+
+private:
+    ~EncryptingByteStream() { m_Output->Release(); }
+
+    AP4_ByteStream*           m_Output;
+    const Aes128CbcEncrypter& m_Encrypter;
+    AP4_UI08                  m_Chain[16];
+    AP4_UI08                  m_Pending[16];
+    AP4_Size                  m_PendingSize;
+    AP4_UI08                  m_Buffer[64*1024]; // fixed, the stream does not allocate while writing
+    AP4_Cardinal              m_ReferenceCount;
+};
+
+/*----------------------------------------------------------------------
+|   functions
++---------------------------------------------------------------------*/
+AP4_Result ReadFileCrc32c(std::filesystem::path path, AP4_UI32& crc32c);
+
+}
+
+#endif // _BENTO5_CRYPTO_H_
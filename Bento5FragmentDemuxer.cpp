@@ -0,0 +1,214 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <algorithm>
+#include "Bento5FragmentDemuxer.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   FragmentDemuxer::FragmentDemuxer
++---------------------------------------------------------------------*/
+FragmentDemuxer::FragmentDemuxer(AP4_Movie& movie, AP4_ByteStream& stream, const std::string& path, AP4_UI64 buffer_cap, bool release_cache) :
+    m_Movie(movie),
+    m_Path(path),
+    m_ReleaseCache(release_cache),
+    m_FragmentsPosition(0),
+    m_BufferCap(buffer_cap),
+    m_BufferedSize(0),
+    m_PeakBufferedSize(0),
+    m_RereadCount(0)
+{
+    stream.Tell(m_FragmentsPosition);
+    m_Reader = new AP4_LinearReader(movie, &stream);
+}
+
+/*----------------------------------------------------------------------
+|   FragmentDemuxer::~FragmentDemuxer
++---------------------------------------------------------------------*/
+FragmentDemuxer::~FragmentDemuxer()
+{
+    for (Track& track : m_Tracks) {
+        delete track.reader;
+        if (track.stream) track.stream->Release();
+    }
+    delete m_Reader;
+}
+
+/*----------------------------------------------------------------------
+|   FragmentDemuxer::EnableTrack
++---------------------------------------------------------------------*/
+AP4_Result
+FragmentDemuxer::EnableTrack(AP4_UI32 track_id)
+{
+    if (GetTrack(track_id)) return AP4_SUCCESS;
+    AP4_Result result = m_Reader->EnableTrack(track_id);
+    if (AP4_FAILED(result)) return result;
+    m_Tracks.emplace_back(track_id);
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   FragmentDemuxer::GetTrack
++---------------------------------------------------------------------*/
+FragmentDemuxer::Track*
+FragmentDemuxer::GetTrack(AP4_UI32 track_id)
+{
+    for (Track& track : m_Tracks) {
+        if (track.id == track_id) return &track;
+    }
+    return NULL;
+}
+
+/*----------------------------------------------------------------------
+|   FragmentDemuxer::FindFragment
++---------------------------------------------------------------------*/
+// position of the last moof before the data of a sample, from the top-level box headers only
+AP4_Result
+FragmentDemuxer::FindFragment(AP4_Position sample_offset, AP4_Position& position)
+{
+    AP4_ByteStream* stream = NULL;
+    AP4_Result result = AP4_FileByteStream::Create(m_Path.c_str(), AP4_FileByteStream::STREAM_MODE_READ, stream);
+    if (AP4_FAILED(result)) return result;
+    AP4_LargeSize stream_size = 0;
+    result = stream->GetSize(stream_size);
+    position = m_FragmentsPosition;
+    for (AP4_Position box = m_FragmentsPosition; AP4_SUCCEEDED(result) && box < sample_offset;) {
+        BoxHeader header;
+        result = BoxHeader::Read(*stream, box, stream_size, header);
+        if (AP4_FAILED(result)) break;
+        if (header.type == AP4_ATOM_TYPE_MOOF) position = box;
+        box += header.size;
+    }
+    stream->Release();
+    return result == AP4_ERROR_EOS ? AP4_SUCCESS : result;
+}
+
+/*----------------------------------------------------------------------
+|   FragmentDemuxer::OpenTrackReader
++---------------------------------------------------------------------*/
+// start a reader of the track at the fragment of its first unread sample
+AP4_Result
+FragmentDemuxer::OpenTrackReader(Track& track, AP4_Sample& sample, AP4_DataBuffer& sample_data)
+{
+    AP4_Position fragment_position = m_FragmentsPosition;
+    AP4_Result   result = FindFragment(track.reread_offset, fragment_position);
+    if (AP4_FAILED(result)) return result;
+
+    for (;;) {
+        if (m_ReleaseCache) {
+            SequentialFileByteStream* sequential_stream = NULL;
+            result = SequentialFileByteStream::Create(m_Path.c_str(), sequential_stream);
+            track.stream = sequential_stream;
+        } else {
+            result = AP4_FileByteStream::Create(m_Path.c_str(), AP4_FileByteStream::STREAM_MODE_READ, track.stream);
+        }
+        if (AP4_FAILED(result)) return result;
+        result = track.stream->Seek(fragment_position);
+        if (AP4_FAILED(result)) return result;
+        track.reader = new AP4_LinearReader(m_Movie, track.stream);
+        result = track.reader->EnableTrack(track.id);
+        if (AP4_FAILED(result)) return result;
+
+        while (AP4_SUCCEEDED(result = track.reader->ReadNextSample(track.id, sample, sample_data))) {
+            if (sample.GetOffset() == track.reread_offset) {
+                track.dts_shift = track.reread_dts-sample.GetDts();
+                ++m_RereadCount;
+                return AP4_SUCCESS;
+            }
+        }
+        if (result != AP4_ERROR_EOS || fragment_position == m_FragmentsPosition) return result;
+
+        delete track.reader;
+        track.reader = NULL;
+        track.stream->Release();
+        track.stream = NULL;
+        fragment_position = m_FragmentsPosition;
+    }
+}
+
+/*----------------------------------------------------------------------
+|   FragmentDemuxer::ReadSample
++---------------------------------------------------------------------*/
+AP4_Result
+FragmentDemuxer::ReadSample(AP4_UI32 track_id, AP4_Sample& sample, AP4_DataBuffer& sample_data)
+{
+    Track* track = GetTrack(track_id);
+    if (track == NULL) return AP4_ERROR_INVALID_PARAMETERS;
+
+    AP4_Result result;
+    if (track->reread) {
+        if (track->reader == NULL) {
+            result = OpenTrackReader(*track, sample, sample_data);
+        } else {
+            result = track->reader->ReadNextSample(track->id, sample, sample_data);
+        }
+        if (AP4_SUCCEEDED(result)) sample.SetDts(sample.GetDts()+track->dts_shift);
+    } else if (track->samples.size()) {
+        BufferedSample& buffered = track->samples.front();
+        sample = buffered.sample;
+        result = sample_data.SetData(buffered.data.GetData(), buffered.data.GetDataSize());
+        track->buffered_size -= buffered.data.GetDataSize();
+        m_BufferedSize       -= buffered.data.GetDataSize();
+        track->samples.pop_front();
+    } else {
+        // read in file order, keeping the samples of the other tracks for later
+        for (;;) {
+            AP4_UI32 sample_track_id = 0;
+            result = m_Reader->GetNextSample(sample, sample_track_id);
+            if (AP4_FAILED(result)) break;
+            if (sample_track_id == track_id) {
+                result = sample.ReadData(sample_data);
+                break;
+            }
+            Track* other = GetTrack(sample_track_id);
+            if (other == NULL || other->reread) continue;
+            if (m_BufferCap && other->buffered_size+sample.GetSize() > m_BufferCap) {
+                const AP4_Sample& first = other->samples.size() ? other->samples.front().sample : sample;
+                other->reread_offset = first.GetOffset();
+                other->reread_dts    = first.GetDts();
+                m_BufferedSize -= other->buffered_size;
+                other->buffered_size = 0;
+                other->samples.clear();
+                other->reread = true;
+                continue;
+            }
+            other->samples.emplace_back();
+            other->samples.back().sample = sample;
+            result = sample.ReadData(other->samples.back().data);
+            if (AP4_FAILED(result)) return result;
+            other->buffered_size += sample.GetSize();
+            m_BufferedSize       += sample.GetSize();
+            m_PeakBufferedSize    = std::max(m_PeakBufferedSize, m_BufferedSize);
+        }
+    }
+    return result;
+}
+
+/*----------------------------------------------------------------------
+|   FragmentedSampleReader
++---------------------------------------------------------------------*/
+AP4_Result
+FragmentedSampleReader::ReadSample(AP4_Sample& sample, AP4_DataBuffer& sample_data, SegmentArena* /*arena*/)
+{
+    return m_Demuxer.ReadSample(m_TrackId, sample, sample_data);
+}
+
+}
@@ -0,0 +1,106 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENTO5_FRAGMENT_DEMUXER_H_
+#define _BENTO5_FRAGMENT_DEMUXER_H_
+
+#include <string>
+#include <deque>
+#include "Ap4.h"
+#include "Bento5Input.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   FragmentDemuxer
++---------------------------------------------------------------------*/
+// reads the tracks of a fragmented file in file order with a single reader, a track that gets
+// too far ahead is dropped from the buffer and read again later by a reader of its own
+class FragmentDemuxer
+{
+public:
+    // buffer_cap is in bytes of sample data per track, 0 for no cap
+    FragmentDemuxer(AP4_Movie& movie, AP4_ByteStream& stream, const std::string& path, AP4_UI64 buffer_cap, bool release_cache);
+    ~FragmentDemuxer();
+
+    // all the tracks have to be enabled before the first read
+    AP4_Result EnableTrack(AP4_UI32 track_id);
+    AP4_Result ReadSample(AP4_UI32 track_id, AP4_Sample& sample, AP4_DataBuffer& sample_data);
+    AP4_UI64     GetPeakBufferedSize() const { return m_PeakBufferedSize; }
+    AP4_Cardinal GetRereadCount() const      { return m_RereadCount; }
+
+private:
+    struct BufferedSample {
+        AP4_Sample     sample;
+        AP4_DataBuffer data;
+    };
+    struct Track {
+        Track(AP4_UI32 id) : id(id), buffered_size(0), reread(false), reread_offset(0), reread_dts(0), dts_shift(0),
+            stream(NULL), reader(NULL) {}
+        AP4_UI32                   id;
+        std::deque<BufferedSample> samples;
+        AP4_UI64                   buffered_size;
+        bool                       reread;        // went past the cap, read with its own reader from now on
+        AP4_Position               reread_offset; // data offset and DTS of the first sample to read again
+        AP4_UI64                   reread_dts;
+        AP4_UI64                   dts_shift;     // added to the DTS of the reader, which may start without a tfdt
+        AP4_ByteStream*            stream;
+        AP4_LinearReader*          reader;
+    };
+
+    Track*     GetTrack(AP4_UI32 track_id);
+    AP4_Result FindFragment(AP4_Position sample_offset, AP4_Position& position);
+    AP4_Result OpenTrackReader(Track& track, AP4_Sample& sample, AP4_DataBuffer& sample_data);
+
+    AP4_Movie&        m_Movie;
+    std::string       m_Path;
+    bool              m_ReleaseCache;
+    AP4_Position      m_FragmentsPosition; // where the linear readers start
+    AP4_UI64          m_BufferCap;
+    AP4_LinearReader* m_Reader;
+    std::deque<Track> m_Tracks;
+    AP4_UI64          m_BufferedSize;
+    AP4_UI64          m_PeakBufferedSize;
+    AP4_Cardinal      m_RereadCount;
+};
+
+/*----------------------------------------------------------------------
+|   FragmentedSampleReader
++---------------------------------------------------------------------*/
+class FragmentedSampleReader : public SampleReader
+{
+public:
+    FragmentedSampleReader(FragmentDemuxer& demuxer, AP4_UI32 track_id) :
+        m_Demuxer(demuxer), m_TrackId(track_id) {
+        demuxer.EnableTrack(track_id);
+    }
+    // the linear reader fills in the sample data itself, never in the arena
+    AP4_Result ReadSample(AP4_Sample& sample, AP4_DataBuffer& sample_data, SegmentArena* arena);
+    // there is no sample index to seek with
+    AP4_Result SeekSample(AP4_Ordinal /*index*/) { return AP4_ERROR_NOT_SUPPORTED; }
+
+private:
+    FragmentDemuxer& m_Demuxer;
+    AP4_UI32         m_TrackId;
+};
+
+}
+
+#endif // _BENTO5_FRAGMENT_DEMUXER_H_
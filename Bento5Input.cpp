@@ -0,0 +1,1045 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <algorithm>
+#include "Bento5Input.h"
+#include "Bento5FragmentDemuxer.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   SequentialFileByteStream::Create
++---------------------------------------------------------------------*/
+AP4_Result
+SequentialFileByteStream::Create(const char* path, SequentialFileByteStream*& stream)
+{
+    stream = NULL;
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) return AP4_ERROR_CANNOT_OPEN_FILE;
+    struct stat info;
+    if (fstat(fd, &info) != 0) {
+        close(fd);
+        return AP4_ERROR_CANNOT_OPEN_FILE;
+    }
+#if defined(POSIX_FADV_SEQUENTIAL)
+    posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+    stream = new SequentialFileByteStream(fd, info.st_size);
+    return AP4_SUCCESS;
+}
+/*----------------------------------------------------------------------
+|   SequentialFileByteStream::~SequentialFileByteStream
++---------------------------------------------------------------------*/
+SequentialFileByteStream::~SequentialFileByteStream()
+{
+    close(m_Fd);
+}
+
+/*----------------------------------------------------------------------
+|   SequentialFileByteStream::ReadPartial
++---------------------------------------------------------------------*/
+AP4_Result
+SequentialFileByteStream::ReadPartial(void* buffer, AP4_Size bytes_to_read, AP4_Size& bytes_read)
+{
+    bytes_read = 0;
+    if (bytes_to_read == 0) return AP4_SUCCESS;
+    if (m_Position >= m_Size) return AP4_ERROR_EOS;
+
+    // refill the buffer, except for the large reads that go straight to the caller
+    if (m_Position < m_BufferPosition || m_Position >= m_BufferPosition+m_BufferFill) {
+        bool      direct = bytes_to_read >= sizeof(m_Buffer);
+        AP4_UI08* target = direct ? (AP4_UI08*)buffer : m_Buffer;
+        AP4_Size  size   = direct ? bytes_to_read : sizeof(m_Buffer);
+        ssize_t   result;
+        do {
+            result = pread(m_Fd, target, size, m_Position);
+        } while (result < 0 && errno == EINTR);
+        if (result < 0) return AP4_ERROR_READ_FAILED;
+        if (result == 0) return AP4_ERROR_EOS;
+        ReleaseCache(m_Position, (AP4_Size)result);
+        if (direct) {
+            m_Position += result;
+            bytes_read  = (AP4_Size)result;
+            return AP4_SUCCESS;
+        }
+        m_BufferPosition = m_Position;
+        m_BufferFill     = (AP4_Size)result;
+    }
+
+    AP4_Size chunk = (AP4_Size)std::min<AP4_UI64>(bytes_to_read, m_BufferPosition+m_BufferFill-m_Position);
+    memcpy(buffer, m_Buffer+(m_Position-m_BufferPosition), chunk);
+    m_Position += chunk;
+    bytes_read  = chunk;
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   SequentialFileByteStream::ReleaseCache
++---------------------------------------------------------------------*/
+void
+SequentialFileByteStream::ReleaseCache(AP4_Position position, AP4_Size size)
+{
+    // a seek back before the run or far past it starts a new one
+    if (position < m_RunStart || position > m_RunEnd+CACHE_RELEASE_LAG) {
+        m_RunStart = position;
+        m_RunEnd   = position;
+    }
+    m_RunEnd = std::max<AP4_Position>(m_RunEnd, position+size);
+    if (m_RunEnd < m_RunStart+CACHE_RELEASE_LAG+CACHE_RELEASE_STEP) return;
+
+    AP4_Position end = m_RunEnd-CACHE_RELEASE_LAG;
+#if defined(POSIX_FADV_DONTNEED)
+    posix_fadvise(m_Fd, m_RunStart, end-m_RunStart, POSIX_FADV_DONTNEED);
+#endif
+    m_ReleasedSize += end-m_RunStart;
+    m_RunStart      = end;
+}
+
+/*----------------------------------------------------------------------
+|   BoxHeader::Parse
++---------------------------------------------------------------------*/
+bool
+BoxHeader::Parse(const AP4_UI08* data, AP4_UI64 available, BoxHeader& header)
+{
+    if (available < 8) return false;
+    header.size        = AP4_BytesToUInt32BE(data);
+    header.type        = AP4_BytesToUInt32BE(data+4);
+    header.header_size = 8;
+    if (header.size == 1) {
+        if (available < 16) return false;
+        header.size        = AP4_BytesToUInt64BE(data+8);
+        header.header_size = 16;
+    } else if (header.size == 0) {
+        header.size = available;
+    }
+    return header.size >= header.header_size && header.size <= available;
+}
+
+/*----------------------------------------------------------------------
+|   BoxHeader::Read
++---------------------------------------------------------------------*/
+AP4_Result
+BoxHeader::Read(AP4_ByteStream& stream, AP4_Position position, AP4_LargeSize stream_size, BoxHeader& header)
+{
+    if (position+8 > stream_size) return AP4_ERROR_EOS;
+    AP4_UI08 bytes[16];
+    AP4_Result result = stream.Seek(position);
+    if (AP4_FAILED(result)) return result;
+    result = stream.Read(bytes, 8);
+    if (AP4_FAILED(result)) return result;
+    if (AP4_BytesToUInt32BE(bytes) == 1) {
+        result = stream.Read(bytes+8, 8);
+        if (AP4_FAILED(result)) return result;
+    }
+    return Parse(bytes, stream_size-position, header) ? AP4_SUCCESS : AP4_ERROR_INVALID_FORMAT;
+}
+
+/*----------------------------------------------------------------------
+|   FindChildBox
++---------------------------------------------------------------------*/
+bool
+FindChildBox(const AP4_UI08* data, AP4_UI64 size, AP4_UI32 type, const AP4_UI08*& box, BoxHeader& header)
+{
+    while (BoxHeader::Parse(data, size, header)) {
+        if (header.type == type) {
+            box = data;
+            return true;
+        }
+        data += header.size;
+        size -= header.size;
+    }
+    return false;
+}
+
+/*----------------------------------------------------------------------
+|   FindBoxPayload
++---------------------------------------------------------------------*/
+bool
+FindBoxPayload(const AP4_UI08* data, AP4_UI64 size, std::initializer_list<AP4_UI32> path, const AP4_UI08*& payload, AP4_UI64& payload_size)
+{
+    for (AP4_UI32 type : path) {
+        const AP4_UI08* box = NULL;
+        BoxHeader header;
+        if (!FindChildBox(data, size, type, box, header)) return false;
+        data = box+header.header_size;
+        size = header.GetPayloadSize();
+    }
+    payload      = data;
+    payload_size = size;
+    return true;
+}
+
+/*----------------------------------------------------------------------
+|   SampleIndex::Build
++---------------------------------------------------------------------*/
+AP4_Result
+SampleIndex::Build(AP4_Track& track)
+{
+    // a single pass over the atom sample tables, nothing else goes through AP4_Sample afterwards
+    AP4_Cardinal sample_count = track.GetSampleCount();
+    m_Durations.reserve(sample_count);
+    m_Sizes.reserve(sample_count);
+    m_Offsets.reserve(sample_count);
+    m_SyncBits.reserve((sample_count+63)/64);
+    AP4_Sample sample;
+    for (AP4_Ordinal i = 0; i < sample_count; i++) {
+        AP4_Result result = track.GetSample(i, sample);
+        if (AP4_FAILED(result)) return result;
+        result = Append(sample.GetDts(), sample.GetDuration(), sample.GetCtsDelta(), sample.GetSize(), sample.GetOffset(), sample.IsSync(), sample.GetDescriptionIndex());
+        if (AP4_FAILED(result)) return result;
+    }
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   SampleIndex::Build
++---------------------------------------------------------------------*/
+AP4_Result
+SampleIndex::Build(const AP4_UI08* stbl, AP4_UI64 stbl_size)
+{
+    // decode the raw stbl tables straight into the index, without building the Bento4 atoms
+    const AP4_UI08* stsz = NULL;
+    const AP4_UI08* stco = NULL;
+    const AP4_UI08* stsc = NULL;
+    const AP4_UI08* stts = NULL;
+    const AP4_UI08* ctts = NULL;
+    const AP4_UI08* stss = NULL;
+    AP4_UI64 stsz_size = 0, stco_size = 0, stsc_size = 0, stts_size = 0, ctts_size = 0, stss_size = 0;
+    bool compact_sizes = false;
+    bool large_offsets = false;
+    if (!FindBoxPayload(stbl, stbl_size, {AP4_ATOM_TYPE_STSZ}, stsz, stsz_size)) {
+        if (!FindBoxPayload(stbl, stbl_size, {AP4_ATOM_TYPE_STZ2}, stsz, stsz_size)) return AP4_ERROR_INVALID_FORMAT;
+        compact_sizes = true;
+    }
+    if (!FindBoxPayload(stbl, stbl_size, {AP4_ATOM_TYPE_STCO}, stco, stco_size)) {
+        if (!FindBoxPayload(stbl, stbl_size, {AP4_ATOM_TYPE_CO64}, stco, stco_size)) return AP4_ERROR_INVALID_FORMAT;
+        large_offsets = true;
+    }
+    if (!FindBoxPayload(stbl, stbl_size, {AP4_ATOM_TYPE_STSC}, stsc, stsc_size)) return AP4_ERROR_INVALID_FORMAT;
+    if (!FindBoxPayload(stbl, stbl_size, {AP4_ATOM_TYPE_STTS}, stts, stts_size)) return AP4_ERROR_INVALID_FORMAT;
+    FindBoxPayload(stbl, stbl_size, {AP4_ATOM_TYPE_CTTS}, ctts, ctts_size);
+    FindBoxPayload(stbl, stbl_size, {AP4_ATOM_TYPE_STSS}, stss, stss_size);
+
+    // all the tables start with version/flags and a 32-bit count (stz2 has its field size in between)
+    if (stsz_size < 12 || stco_size < 8 || stsc_size < 8 || stts_size < 8) return AP4_ERROR_INVALID_FORMAT;
+    AP4_UI32 constant_size = compact_sizes ? 0 : AP4_BytesToUInt32BE(stsz+4);
+    AP4_UI32 field_size    = compact_sizes ? stsz[7] : 32;
+    AP4_UI32 sample_count  = AP4_BytesToUInt32BE(stsz+8);
+    if (field_size != 4 && field_size != 8 && field_size != 16 && field_size != 32) return AP4_ERROR_INVALID_FORMAT;
+    if (constant_size == 0 && stsz_size < 12+((AP4_UI64)sample_count*field_size+7)/8) return AP4_ERROR_INVALID_FORMAT;
+    AP4_UI32 chunk_count = AP4_BytesToUInt32BE(stco+4);
+    if (stco_size < 8+(AP4_UI64)chunk_count*(large_offsets ? 8 : 4)) return AP4_ERROR_INVALID_FORMAT;
+    AP4_UI32 stsc_count = AP4_BytesToUInt32BE(stsc+4);
+    if (stsc_size < 8+(AP4_UI64)stsc_count*12) return AP4_ERROR_INVALID_FORMAT;
+    AP4_UI32 stts_count = AP4_BytesToUInt32BE(stts+4);
+    if (stts_size < 8+(AP4_UI64)stts_count*8) return AP4_ERROR_INVALID_FORMAT;
+    AP4_UI32 ctts_count = ctts_size >= 8 ? AP4_BytesToUInt32BE(ctts+4) : 0;
+    if (ctts_size < 8+(AP4_UI64)ctts_count*8) ctts_count = 0;
+    AP4_UI32 stss_count = stss_size >= 8 ? AP4_BytesToUInt32BE(stss+4) : 0;
+    if (stss && stss_size < 8+(AP4_UI64)stss_count*4) return AP4_ERROR_INVALID_FORMAT;
+
+    m_Durations.reserve(sample_count);
+    m_Sizes.reserve(sample_count);
+    m_Offsets.reserve(sample_count);
+    m_SyncBits.reserve((sample_count+63)/64);
+
+    AP4_UI32 sample       = 0;
+    AP4_UI64 dts          = 0;
+    AP4_UI32 stsc_entry   = 0;
+    AP4_UI32 stts_entry   = 0;
+    AP4_UI32 stts_left    = stts_count ? AP4_BytesToUInt32BE(stts+8) : 0;
+    AP4_UI32 ctts_entry   = 0;
+    AP4_UI32 ctts_left    = ctts_count ? AP4_BytesToUInt32BE(ctts+8) : 0;
+    AP4_UI32 stss_entry   = 0;
+    for (AP4_UI32 chunk = 1; chunk <= chunk_count && sample < sample_count; chunk++) {
+        while (stsc_entry+1 < stsc_count && chunk >= AP4_BytesToUInt32BE(stsc+8+(stsc_entry+1)*12)) {
+            ++stsc_entry;
+        }
+        if (stsc_count == 0) return AP4_ERROR_INVALID_FORMAT;
+        AP4_UI32 samples_per_chunk = AP4_BytesToUInt32BE(stsc+8+stsc_entry*12+4);
+        AP4_UI32 description_index = AP4_BytesToUInt32BE(stsc+8+stsc_entry*12+8);
+        AP4_Position offset = large_offsets ? AP4_BytesToUInt64BE(stco+8+(chunk-1)*8) : AP4_BytesToUInt32BE(stco+8+(chunk-1)*4);
+
+        for (AP4_UI32 i = 0; i < samples_per_chunk && sample < sample_count; i++, sample++) {
+            AP4_Size size = constant_size;
+            if (size == 0) {
+                const AP4_UI08* sizes = stsz+12;
+                switch (field_size) {
+                    case 4:  size = (sizes[sample/2]>>((sample&1) ? 0 : 4))&0x0F; break;
+                    case 8:  size = sizes[sample]; break;
+                    case 16: size = AP4_BytesToUInt16BE(sizes+sample*2); break;
+                    default: size = AP4_BytesToUInt32BE(sizes+sample*4); break;
+                }
+            }
+
+            while (stts_left == 0 && stts_entry+1 < stts_count) {
+                stts_left = AP4_BytesToUInt32BE(stts+8+(++stts_entry)*8);
+            }
+            if (stts_left == 0) return AP4_ERROR_INVALID_FORMAT;
+            AP4_UI32 duration = AP4_BytesToUInt32BE(stts+8+stts_entry*8+4);
+            --stts_left;
+
+            AP4_UI32 cts_delta = 0;
+            while (ctts_left == 0 && ctts_entry+1 < ctts_count) {
+                ctts_left = AP4_BytesToUInt32BE(ctts+8+(++ctts_entry)*8);
+            }
+            if (ctts_left) {
+                cts_delta = AP4_BytesToUInt32BE(ctts+8+ctts_entry*8+4);
+                --ctts_left;
+            }
+
+            // no stss means every sample is a sync sample
+            bool sync = (stss == NULL);
+            while (stss_entry < stss_count && AP4_BytesToUInt32BE(stss+8+stss_entry*4) < sample+1) ++stss_entry;
+            if (stss_entry < stss_count && AP4_BytesToUInt32BE(stss+8+stss_entry*4) == sample+1) sync = true;
+
+            AP4_Result result = Append(dts, duration, cts_delta, size, offset, sync, description_index ? description_index-1 : 0);
+            if (AP4_FAILED(result)) return result;
+            dts    += duration;
+            offset += size;
+        }
+    }
+    return sample == sample_count ? AP4_SUCCESS : AP4_ERROR_INVALID_FORMAT;
+}
+
+/*----------------------------------------------------------------------
+|   SampleIndex::Append
++---------------------------------------------------------------------*/
+AP4_Result
+SampleIndex::Append(AP4_UI64 dts, AP4_UI32 duration, AP4_UI32 cts_delta, AP4_Size size, AP4_Position offset, bool sync, AP4_Ordinal description_index)
+{
+    if (description_index > 0xFF) return AP4_ERROR_OUT_OF_RANGE;
+    AP4_Ordinal index = GetSampleCount();
+    if (index && dts != m_NextDts) {
+        // a gap or an overlap in the timeline, the previous sample lasts until this one
+        AP4_UI64 previous_dts = m_NextDts-m_Durations.back();
+        if (dts < previous_dts || dts-previous_dts > 0xFFFFFFFF) return AP4_ERROR_OUT_OF_RANGE;
+        m_Durations.back() = (AP4_UI32)(dts-previous_dts);
+    }
+    if (index % DTS_CHECKPOINT_INTERVAL == 0) m_DtsCheckpoints.push_back(dts);
+    m_NextDts = dts+duration;
+
+    m_Durations.push_back(duration);
+    m_Sizes.push_back(size);
+    m_Offsets.push_back(offset);
+    if (index % 64 == 0) m_SyncBits.push_back(0);
+    if (sync) m_SyncBits.back() |= (AP4_UI64)1<<(index&63);
+    if (cts_delta && m_CtsDeltas.empty()) m_CtsDeltas.resize(index, 0);
+    if (!m_CtsDeltas.empty()) m_CtsDeltas.push_back(cts_delta);
+    if (description_index && m_DescriptionIndexes.empty()) m_DescriptionIndexes.resize(index, 0);
+    if (!m_DescriptionIndexes.empty()) m_DescriptionIndexes.push_back((AP4_UI08)description_index);
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   SampleIndex::GetDts
++---------------------------------------------------------------------*/
+AP4_UI64
+SampleIndex::GetDts(AP4_Ordinal index) const
+{
+    AP4_Ordinal checkpoint = index/DTS_CHECKPOINT_INTERVAL;
+    AP4_UI64 dts = m_DtsCheckpoints[checkpoint];
+    for (AP4_Ordinal i = checkpoint*DTS_CHECKPOINT_INTERVAL; i < index; i++) {
+        dts += m_Durations[i];
+    }
+    return dts;
+}
+
+const AP4_Size SEGMENT_ARENA_CHUNK_SIZE = 1024*1024;
+
+/*----------------------------------------------------------------------
+|   SegmentArena::~SegmentArena
++---------------------------------------------------------------------*/
+SegmentArena::~SegmentArena()
+{
+    // the buffers outlive the arena, they are left empty
+    for (AP4_DataBuffer* buffer : m_Buffers) {
+        buffer->SetDataSize(0);
+        buffer->SetBuffer(NULL, 0);
+    }
+    for (Chunk& chunk : m_Chunks) delete[] chunk.data;
+}
+
+/*----------------------------------------------------------------------
+|   SegmentArena::Allocate
++---------------------------------------------------------------------*/
+AP4_UI08*
+SegmentArena::Allocate(AP4_Size size)
+{
+    size = Align(size);
+    if (m_Chunks.empty() || m_Used+size > m_Chunks.back().size) {
+        // chunks never get smaller
+        AP4_Size chunk_size = m_Chunks.empty() ? SEGMENT_ARENA_CHUNK_SIZE : m_Chunks.back().size;
+        if (chunk_size < size) chunk_size = size;
+        Chunk chunk = { new AP4_UI08[chunk_size], chunk_size };
+        m_Chunks.push_back(chunk);
+        m_Used = 0;
+    }
+    AP4_UI08* data = m_Chunks.back().data+m_Used;
+    m_Used        += size;
+    m_SegmentSize += size;
+    return data;
+}
+
+/*----------------------------------------------------------------------
+|   SegmentArena::SetDataSize
++---------------------------------------------------------------------*/
+AP4_Result
+SegmentArena::SetDataSize(AP4_DataBuffer& buffer, AP4_Size size)
+{
+    bool attached = std::find(m_Buffers.begin(), m_Buffers.end(), &buffer) != m_Buffers.end();
+    if (size <= buffer.GetBufferSize() && (attached || size == 0)) return buffer.SetDataSize(size);
+
+    // at least double, a buffer only grows a few times per segment
+    AP4_Size buffer_size = attached && size < 2*buffer.GetBufferSize() ? 2*buffer.GetBufferSize() : size;
+    AP4_UI08* data = Allocate(buffer_size);
+    AP4_Size  kept = std::min(buffer.GetDataSize(), size);
+    if (kept) memcpy(data, buffer.GetData(), kept);
+    buffer.SetBuffer(data, buffer_size);
+    if (!attached) m_Buffers.push_back(&buffer);
+    return buffer.SetDataSize(size);
+}
+
+/*----------------------------------------------------------------------
+|   SegmentArena::Reset
++---------------------------------------------------------------------*/
+void
+SegmentArena::Reset()
+{
+    if (m_Chunks.empty()) return;
+
+    // moved down in address order, in place within a single chunk
+    std::sort(m_Buffers.begin(), m_Buffers.end(), [](AP4_DataBuffer* a, AP4_DataBuffer* b) {
+        return std::less<const AP4_UI08*>()(a->GetData(), b->GetData());
+    });
+    Chunk destination = m_Chunks.front();
+    if (m_Chunks.size() > 1) {
+        destination.size = m_SegmentSize;
+        destination.data = new AP4_UI08[destination.size];
+    }
+    AP4_Size offset = 0;
+    for (AP4_DataBuffer* buffer : m_Buffers) {
+        AP4_Size size = buffer->GetDataSize();
+        AP4_UI08* data = destination.data+offset;
+        if (size) memmove(data, buffer->GetData(), size);
+        buffer->SetBuffer(data, Align(size));
+        offset += Align(size);
+    }
+    if (m_Chunks.size() > 1) {
+        for (Chunk& chunk : m_Chunks) delete[] chunk.data;
+        m_Chunks.clear();
+        m_Chunks.push_back(destination);
+    }
+    m_Used        = offset;
+    m_SegmentSize = offset;
+}
+
+/*----------------------------------------------------------------------
+|   SegmentArena::GetSize
++---------------------------------------------------------------------*/
+AP4_UI64
+SegmentArena::GetSize() const
+{
+    AP4_UI64 size = 0;
+    for (const Chunk& chunk : m_Chunks) size += chunk.size;
+    return size;
+}
+
+/*----------------------------------------------------------------------
+|   IndexedSampleReader::SeekSample
++---------------------------------------------------------------------*/
+AP4_Result
+IndexedSampleReader::SeekSample(AP4_Ordinal index)
+{
+    if (index > m_Index.GetSampleCount()) return AP4_ERROR_OUT_OF_RANGE;
+    m_SampleIndex = index;
+    m_Dts         = index < m_Index.GetSampleCount() ? m_Index.GetDts(index) : 0;
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   IndexedSampleReader
++---------------------------------------------------------------------*/
+AP4_Result
+IndexedSampleReader::ReadSample(AP4_Sample& sample, AP4_DataBuffer& sample_data, SegmentArena* arena)
+{
+    if (m_SampleIndex >= m_Index.GetSampleCount()) return AP4_ERROR_EOS;
+
+    AP4_Size size = m_Index.GetSize(m_SampleIndex);
+    sample.SetDts(m_Dts);
+    sample.SetCtsDelta(m_Index.GetCtsDelta(m_SampleIndex));
+    sample.SetDuration(m_Index.GetDuration(m_SampleIndex));
+    sample.SetSync(m_Index.IsSync(m_SampleIndex));
+    sample.SetDescriptionIndex(m_Index.GetDescriptionIndex(m_SampleIndex));
+    sample.SetOffset(m_Index.GetOffset(m_SampleIndex));
+    sample.SetSize(size);
+
+    AP4_Size   data_size = m_ReadData ? size : 0;
+    AP4_Result result    = arena ? arena->SetDataSize(sample_data, data_size) : sample_data.SetDataSize(data_size);
+    if (AP4_FAILED(result)) return result;
+    if (m_ReadData) {
+        result = m_Stream.Seek(m_Index.GetOffset(m_SampleIndex));
+        if (AP4_FAILED(result)) return result;
+        result = m_Stream.Read(sample_data.UseData(), size);
+        if (AP4_FAILED(result)) return result;
+    }
+
+    m_Dts += m_Index.GetDuration(m_SampleIndex);
+    ++m_SampleIndex;
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   ReadSample
++---------------------------------------------------------------------*/
+AP4_Result
+ReadSample(SampleReader&   reader,
+           AP4_Track&      track,
+           AP4_Sample&     sample,
+           AP4_DataBuffer& sample_data,
+           SegmentArena*   arena,
+           double&         ts,
+           double&         duration,
+           bool&           eos)
+{
+    AP4_Result result = reader.ReadSample(sample, sample_data, arena);
+    if (AP4_FAILED(result)) {
+        if (result == AP4_ERROR_EOS) {
+            ts += duration;
+            eos = true;
+        } else {
+            return result;
+        }
+    }
+    ts = (double)sample.GetDts()/(double)track.GetMediaTimeScale();
+    duration = sample.GetDuration()/(double)track.GetMediaTimeScale();
+
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::open
++---------------------------------------------------------------------*/
+AP4_Result
+InputStream::open(bool fast_open, AP4_UI64 fragment_buffer_cap, bool release_cache, bool profile, std::string& error)
+{
+    this->profile = profile;
+    StageTimer timer(&open_stage, profile);
+    TraceSpan span("open", "input");
+    AP4_Result result = AP4_SUCCESS;
+    if (input) {
+        // the stream cannot be opened again, the tracks of a fragmented one are buffered without a cap
+        fragment_buffer_cap = 0;
+    } else if (release_cache) {
+        result = SequentialFileByteStream::Create(file_path.data(), sequential_input);
+        input  = sequential_input;
+    } else {
+        result = AP4_FileByteStream::Create(file_path.data(), AP4_FileByteStream::STREAM_MODE_READ, input);
+    }
+    if (AP4_FAILED(result)) {
+        error = "cannot open input ("+file_path+")";
+        return result;
+    }
+
+    // try the fast path first, it falls back to a full parse for fragmented or unusual files
+    if (fast_open && AP4_SUCCEEDED(openMoov())) {
+        if (audio_track) audio_reader = new IndexedSampleReader(audio_index, *input);
+        if (video_track) video_reader = new IndexedSampleReader(video_index, *input);
+        return AP4_SUCCESS;
+    }
+    input->Seek(0);
+
+    // open the file
+    input_file = new AP4_File(*input, true);
+
+    // get the movie
+    movie = input_file->GetMovie();
+    if (movie == NULL) {
+        error = "no movie in file "+file_path;
+        return AP4_ERROR_INVALID_FORMAT;
+    }
+    // get the audio and video tracks
+    audio_track = movie->GetTrack(AP4_Track::TYPE_AUDIO);
+    video_track = movie->GetTrack(AP4_Track::TYPE_VIDEO);
+
+    if (audio_track == NULL && video_track == NULL) {
+        error = "no video and audio track in "+file_path;
+        return AP4_ERROR_INVALID_FORMAT;
+    }
+
+    if (movie->HasFragments()) {
+        // read the samples of both tracks in file order, with a bounded buffer
+        fragment_demuxer = new FragmentDemuxer(*movie, *input, file_path, fragment_buffer_cap, release_cache);
+
+        if (audio_track) {
+            audio_reader = new FragmentedSampleReader(*fragment_demuxer, audio_track->GetId());
+        }
+        if (video_track) {
+            video_reader = new FragmentedSampleReader(*fragment_demuxer, video_track->GetId());
+        }
+    } else {
+        // index the sample tables once, everything else reads from the indexes
+        if (audio_track) {
+            if (AP4_FAILED(audio_index.Build(*audio_track))) {
+                error = "cannot index the audio samples of "+file_path;
+                return AP4_ERROR_INVALID_FORMAT;
+            }
+            audio_reader = new IndexedSampleReader(audio_index, *input);
+        }
+        if (video_track) {
+            if (AP4_FAILED(video_index.Build(*video_track))) {
+                error = "cannot index the video samples of "+file_path;
+                return AP4_ERROR_INVALID_FORMAT;
+            }
+            video_reader = new IndexedSampleReader(video_index, *input);
+        }
+        releaseSampleTables();
+    }
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::~InputStream
++---------------------------------------------------------------------*/
+InputStream::~InputStream()
+{
+    delete video_reader;
+    delete audio_reader;
+    delete fragment_demuxer;
+    if (input_file == NULL) {
+        // the tracks of the fast path are ours, and reference the sample descriptions of the stsd atoms
+        delete audio_track;
+        delete video_track;
+        std::for_each(sample_description_atoms.begin(), sample_description_atoms.end(), [](AP4_Atom* atom) {delete atom;});
+    }
+    delete input_file;
+    if(input != NULL) {
+        input->Release();
+    }
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::getKeyframesDTSTimeList
++---------------------------------------------------------------------*/
+std::vector<float>
+InputStream::getKeyframesDTSTimeList()
+{
+    StageTimer timer(&keyframe_scan_stage, profile);
+    TraceSpan span("keyframe_scan", "input");
+    std::vector<float> array;
+    if (video_track && fragment_demuxer) {
+        // fragmented: the sample tables of the moov are empty, the samples are in the fragments
+        std::vector<double> times;
+        AP4_Position        position = 0;
+        input->Tell(position);
+        if (AP4_FAILED(indexFragmentKeyframes(times))) {
+            LogWarning("cannot find the keyframes in the fragments of %s", file_path.data());
+        }
+        input->Seek(position);
+        for (double time : times) array.push_back(float(time));
+    } else if (video_track) {
+        AP4_UI64 dts = video_index.GetSampleCount() ? video_index.GetDts(0) : 0;
+        for(unsigned int i = 0; i < video_index.GetSampleCount(); i++) {
+            if (video_index.IsSync(i)) {
+                array.push_back(float(dts) / video_track->GetMediaTimeScale());
+            }
+            dts += video_index.GetDuration(i);
+        }
+    }
+    return array;
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::openMoov
++---------------------------------------------------------------------*/
+AP4_Result
+InputStream::openMoov()
+{
+    AP4_LargeSize stream_size = 0;
+    AP4_Result result = input->GetSize(stream_size);
+    if (AP4_FAILED(result)) return result;
+
+    AP4_Position position = 0;
+    BoxHeader header;
+    for (;;) {
+        result = BoxHeader::Read(*input, position, stream_size, header);
+        if (AP4_FAILED(result)) return result;
+        if (header.type == AP4_ATOM_TYPE_MOOV) break;
+        if (header.type == AP4_ATOM_TYPE_MOOF) return AP4_ERROR_NOT_SUPPORTED;
+        position += header.size;
+    }
+
+    AP4_DataBuffer moov((AP4_Size)header.GetPayloadSize());
+    moov.SetDataSize((AP4_Size)header.GetPayloadSize());
+    result = input->Seek(position+header.header_size);
+    if (AP4_FAILED(result)) return result;
+    result = input->Read(moov.UseData(), moov.GetDataSize());
+    if (AP4_FAILED(result)) return result;
+
+    // fragmented movies go through the linear reader
+    const AP4_UI08* box = NULL;
+    if (FindChildBox(moov.GetData(), moov.GetDataSize(), AP4_ATOM_TYPE_MVEX, box, header)) return AP4_ERROR_NOT_SUPPORTED;
+
+    const AP4_UI08* data = moov.GetData();
+    AP4_UI64        size = moov.GetDataSize();
+    while (FindChildBox(data, size, AP4_ATOM_TYPE_TRAK, box, header)) {
+        const AP4_UI08* trak      = box+header.header_size;
+        AP4_UI64        trak_size = header.GetPayloadSize();
+        data += (box-data)+header.size;
+        size  = moov.GetDataSize()-(data-moov.GetData());
+
+        const AP4_UI08* hdlr = NULL;
+        AP4_UI64 hdlr_size = 0;
+        if (!FindBoxPayload(trak, trak_size, {AP4_ATOM_TYPE_MDIA, AP4_ATOM_TYPE_HDLR}, hdlr, hdlr_size) || hdlr_size < 12) continue;
+        AP4_UI32 handler_type = AP4_BytesToUInt32BE(hdlr+8);
+        if (handler_type == AP4_HANDLER_TYPE_SOUN && audio_track == NULL) {
+            result = createTrack(trak, trak_size, AP4_Track::TYPE_AUDIO, audio_index, audio_track);
+        } else if (handler_type == AP4_HANDLER_TYPE_VIDE && video_track == NULL) {
+            result = createTrack(trak, trak_size, AP4_Track::TYPE_VIDEO, video_index, video_track);
+        }
+        if (AP4_FAILED(result)) break;
+    }
+
+    if (AP4_FAILED(result) || (audio_track == NULL && video_track == NULL)) {
+        // leave everything as it was for the full parse
+        delete audio_track;
+        delete video_track;
+        audio_track = NULL;
+        video_track = NULL;
+        std::for_each(sample_description_atoms.begin(), sample_description_atoms.end(), [](AP4_Atom* atom) {delete atom;});
+        sample_description_atoms.clear();
+        audio_index = SampleIndex();
+        video_index = SampleIndex();
+        return AP4_FAILED(result) ? result : AP4_ERROR_INVALID_FORMAT;
+    }
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::releaseSampleTables
++---------------------------------------------------------------------*/
+void
+InputStream::releaseSampleTables()
+{
+    AP4_Track* audio_copy = NULL;
+    AP4_Track* video_copy = NULL;
+    if ((audio_track && AP4_FAILED(CopyTrack(*audio_track, audio_copy))) ||
+        (video_track && AP4_FAILED(CopyTrack(*video_track, video_copy)))) {
+        delete audio_copy;
+        return;
+    }
+    delete input_file;
+    input_file  = NULL;
+    movie       = NULL;
+    audio_track = audio_copy;
+    video_track = video_copy;
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::CopyTrack
++---------------------------------------------------------------------*/
+AP4_Result
+InputStream::CopyTrack(AP4_Track& track, AP4_Track*& copy)
+{
+    AP4_SyntheticSampleTable* sample_table = new AP4_SyntheticSampleTable();
+    for (AP4_Ordinal i = 0; i < track.GetSampleDescriptionCount(); i++) {
+        AP4_Result result = AP4_SUCCESS;
+        AP4_SampleDescription* sample_description = track.GetSampleDescription(i)->Clone(&result);
+        if (sample_description == NULL) {
+            delete sample_table;
+            return AP4_FAILED(result) ? result : AP4_ERROR_INVALID_FORMAT;
+        }
+        sample_table->AddSampleDescription(sample_description, true);
+    }
+    copy = new AP4_Track(track.GetType(), sample_table, track.GetId(), 0, 0, track.GetMediaTimeScale(), track.GetMediaDuration(),
+                         track.GetTrackLanguage(), track.GetWidth(), track.GetHeight());
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::createTrack
++---------------------------------------------------------------------*/
+AP4_Result
+InputStream::createTrack(const AP4_UI08* trak, AP4_UI64 trak_size, AP4_Track::Type type, SampleIndex& index, AP4_Track*& track)
+{
+    const AP4_UI08* tkhd = NULL;
+    const AP4_UI08* mdhd = NULL;
+    const AP4_UI08* stbl = NULL;
+    AP4_UI64 tkhd_size = 0, mdhd_size = 0, stbl_size = 0;
+    if (!FindBoxPayload(trak, trak_size, {AP4_ATOM_TYPE_TKHD}, tkhd, tkhd_size)) return AP4_ERROR_INVALID_FORMAT;
+    if (!FindBoxPayload(trak, trak_size, {AP4_ATOM_TYPE_MDIA, AP4_ATOM_TYPE_MDHD}, mdhd, mdhd_size)) return AP4_ERROR_INVALID_FORMAT;
+    if (!FindBoxPayload(trak, trak_size, {AP4_ATOM_TYPE_MDIA, AP4_ATOM_TYPE_MINF, AP4_ATOM_TYPE_STBL}, stbl, stbl_size)) return AP4_ERROR_INVALID_FORMAT;
+
+    // tkhd: track id, width and height (16.16), mdhd: timescale and duration
+    bool tkhd_v1 = tkhd_size > 0 && tkhd[0] == 1;
+    if (tkhd_size < (tkhd_v1 ? 96u : 84u)) return AP4_ERROR_INVALID_FORMAT;
+    AP4_UI32 track_id = AP4_BytesToUInt32BE(tkhd+(tkhd_v1 ? 20 : 12));
+    AP4_UI32 width    = AP4_BytesToUInt32BE(tkhd+(tkhd_v1 ? 88 : 76));
+    AP4_UI32 height   = AP4_BytesToUInt32BE(tkhd+(tkhd_v1 ? 92 : 80));
+    bool mdhd_v1 = mdhd_size > 0 && mdhd[0] == 1;
+    if (mdhd_size < (mdhd_v1 ? 32u : 20u)) return AP4_ERROR_INVALID_FORMAT;
+    AP4_UI32 media_time_scale = AP4_BytesToUInt32BE(mdhd+(mdhd_v1 ? 20 : 12));
+    AP4_UI64 media_duration   = mdhd_v1 ? AP4_BytesToUInt64BE(mdhd+24) : AP4_BytesToUInt32BE(mdhd+16);
+    if (media_time_scale == 0) return AP4_ERROR_INVALID_FORMAT;
+
+    // the sample descriptions are the only part of the track parsed by Bento4
+    const AP4_UI08* stsd = NULL;
+    BoxHeader stsd_header;
+    if (!FindChildBox(stbl, stbl_size, AP4_ATOM_TYPE_STSD, stsd, stsd_header)) return AP4_ERROR_INVALID_FORMAT;
+    AP4_MemoryByteStream* stsd_stream = new AP4_MemoryByteStream(stsd, (AP4_Size)stsd_header.size);
+    AP4_AtomFactory atom_factory;
+    AP4_Atom* atom = NULL;
+    AP4_Result result = atom_factory.CreateAtomFromStream(*stsd_stream, atom);
+    stsd_stream->Release();
+    if (AP4_FAILED(result)) return result;
+    sample_description_atoms.push_back(atom);
+    AP4_StsdAtom* stsd_atom = AP4_DYNAMIC_CAST(AP4_StsdAtom, atom);
+    if (stsd_atom == NULL || stsd_atom->GetSampleDescriptionCount() == 0) return AP4_ERROR_INVALID_FORMAT;
+
+    result = index.Build(stbl, stbl_size);
+    if (AP4_FAILED(result)) return result;
+
+    AP4_SyntheticSampleTable* sample_table = new AP4_SyntheticSampleTable();
+    for (AP4_Ordinal i = 0; i < stsd_atom->GetSampleDescriptionCount(); i++) {
+        sample_table->AddSampleDescription(stsd_atom->GetSampleDescription(i), false);
+    }
+    track = new AP4_Track(type, sample_table, track_id, 0, 0, media_time_scale, media_duration, "und", width, height);
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::indexFragmentKeyframes
++---------------------------------------------------------------------*/
+AP4_Result
+InputStream::indexFragmentKeyframes(std::vector<double>& times)
+{
+    AP4_LargeSize stream_size = 0;
+    AP4_Result result = input->GetSize(stream_size);
+    if (AP4_FAILED(result)) return result;
+    times.clear();
+    if (AP4_SUCCEEDED(readTfraKeyframes(stream_size, times))) return AP4_SUCCESS;
+    times.clear();
+    return scanFragmentKeyframes(stream_size, times);
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::readTfraKeyframes
++---------------------------------------------------------------------*/
+AP4_Result
+InputStream::readTfraKeyframes(AP4_LargeSize stream_size, std::vector<double>& times)
+{
+    if (stream_size < 16) return AP4_ERROR_NOT_SUPPORTED;
+    AP4_UI08 mfro[16];
+    AP4_Result result = input->Seek(stream_size-16);
+    if (AP4_FAILED(result)) return result;
+    result = input->Read(mfro, 16);
+    if (AP4_FAILED(result)) return result;
+    if (AP4_BytesToUInt32BE(mfro) != 16 || AP4_BytesToUInt32BE(mfro+4) != AP4_ATOM_TYPE_MFRO) return AP4_ERROR_NOT_SUPPORTED;
+    AP4_UI32 mfra_size = AP4_BytesToUInt32BE(mfro+12);
+    if (mfra_size < 16 || mfra_size > stream_size) return AP4_ERROR_INVALID_FORMAT;
+
+    AP4_DataBuffer mfra(mfra_size);
+    mfra.SetDataSize(mfra_size);
+    result = input->Seek(stream_size-mfra_size);
+    if (AP4_FAILED(result)) return result;
+    result = input->Read(mfra.UseData(), mfra_size);
+    if (AP4_FAILED(result)) return result;
+    BoxHeader header;
+    if (!BoxHeader::Parse(mfra.GetData(), mfra_size, header) || header.type != AP4_ATOM_TYPE_MFRA) return AP4_ERROR_INVALID_FORMAT;
+
+    // tfra: version, flags, track_ID, field lengths, entry count, then the entries
+    const AP4_UI08* data = mfra.GetData()+header.header_size;
+    AP4_UI64        size = header.GetPayloadSize();
+    for (; BoxHeader::Parse(data, size, header); data += header.size, size -= header.size) {
+        if (header.type != AP4_ATOM_TYPE_TFRA || header.GetPayloadSize() < 16) continue;
+        const AP4_UI08* tfra = data+header.header_size;
+        if (AP4_BytesToUInt32BE(tfra+4) != video_track->GetId()) continue;
+        bool     v1          = tfra[0] == 1;
+        AP4_UI32 lengths     = AP4_BytesToUInt32BE(tfra+8);
+        AP4_UI32 entry_count = AP4_BytesToUInt32BE(tfra+12);
+        AP4_UI64 entry_size  = (v1 ? 16 : 8)+((lengths >> 4) & 3)+((lengths >> 2) & 3)+(lengths & 3)+3;
+        if (16+entry_count*entry_size > header.GetPayloadSize()) return AP4_ERROR_INVALID_FORMAT;
+        for (AP4_UI32 i = 0; i < entry_count; i++) {
+            const AP4_UI08* entry = tfra+16+i*entry_size;
+            AP4_UI64 time = v1 ? AP4_BytesToUInt64BE(entry) : AP4_BytesToUInt32BE(entry);
+            times.push_back((double)time/video_track->GetMediaTimeScale());
+        }
+        return times.size() ? AP4_SUCCESS : AP4_ERROR_NOT_SUPPORTED;
+    }
+    return AP4_ERROR_NOT_SUPPORTED;
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::scanFragmentKeyframes
++---------------------------------------------------------------------*/
+AP4_Result
+InputStream::scanFragmentKeyframes(AP4_LargeSize stream_size, std::vector<double>& times)
+{
+    AP4_UI32       default_duration = 0;
+    AP4_UI32       default_flags = 0;
+    AP4_UI64       dts = 0;
+    bool           fragments = false;
+    AP4_DataBuffer box;
+    BoxHeader      header;
+    for (AP4_Position position = 0; AP4_SUCCEEDED(BoxHeader::Read(*input, position, stream_size, header)); position += header.size) {
+        if (header.type != AP4_ATOM_TYPE_MOOV && header.type != AP4_ATOM_TYPE_SIDX && header.type != AP4_ATOM_TYPE_MOOF) continue;
+        AP4_Result result = box.SetDataSize((AP4_Size)header.GetPayloadSize());
+        if (AP4_FAILED(result)) return result;
+        result = input->Seek(position+header.header_size);
+        if (AP4_FAILED(result)) return result;
+        result = input->Read(box.UseData(), box.GetDataSize());
+        if (AP4_FAILED(result)) return result;
+
+        if (header.type == AP4_ATOM_TYPE_MOOV) {
+            ParseTrexDefaults(box.GetData(), box.GetDataSize(), video_track->GetId(), default_duration, default_flags);
+        } else if (header.type == AP4_ATOM_TYPE_SIDX) {
+            if (!fragments && AP4_SUCCEEDED(ParseSidxKeyframes(box.GetData(), box.GetDataSize(), video_track->GetId(), times))) return AP4_SUCCESS;
+        } else {
+            fragments = true;
+            result = ParseMoofKeyframes(box.GetData(), box.GetDataSize(), video_track->GetId(), default_duration, default_flags,
+                                        video_track->GetMediaTimeScale(), dts, times);
+            if (AP4_FAILED(result)) return result;
+        }
+    }
+    return times.size() ? AP4_SUCCESS : AP4_ERROR_NOT_SUPPORTED;
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::ParseTrexDefaults
++---------------------------------------------------------------------*/
+void
+InputStream::ParseTrexDefaults(const AP4_UI08* moov, AP4_UI64 moov_size, AP4_UI32 track_id, AP4_UI32& default_duration, AP4_UI32& default_flags)
+{
+    const AP4_UI08* data = NULL;
+    AP4_UI64        size = 0;
+    if (!FindBoxPayload(moov, moov_size, { AP4_ATOM_TYPE_MVEX }, data, size)) return;
+    BoxHeader header;
+    for (; BoxHeader::Parse(data, size, header); data += header.size, size -= header.size) {
+        const AP4_UI08* trex = data+header.header_size;
+        if (header.type == AP4_ATOM_TYPE_TREX && header.GetPayloadSize() >= 24 && AP4_BytesToUInt32BE(trex+4) == track_id) {
+            default_duration = AP4_BytesToUInt32BE(trex+12);
+            default_flags    = AP4_BytesToUInt32BE(trex+20);
+        }
+    }
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::ParseSidxKeyframes
++---------------------------------------------------------------------*/
+AP4_Result
+InputStream::ParseSidxKeyframes(const AP4_UI08* sidx, AP4_UI64 size, AP4_UI32 track_id, std::vector<double>& times)
+{
+    if (size < 12 || AP4_BytesToUInt32BE(sidx+4) != track_id) return AP4_ERROR_NOT_SUPPORTED;
+    bool     v1 = sidx[0] == 1;
+    AP4_UI32 timescale = AP4_BytesToUInt32BE(sidx+8);
+    AP4_UI64 header_size = v1 ? 32 : 24;
+    if (timescale == 0 || size < header_size) return AP4_ERROR_INVALID_FORMAT;
+    AP4_UI64 time = v1 ? AP4_BytesToUInt64BE(sidx+12) : AP4_BytesToUInt32BE(sidx+12);
+    AP4_UI16 reference_count = AP4_BytesToUInt16BE(sidx+header_size-2);
+    if (header_size+12*(AP4_UI64)reference_count > size) return AP4_ERROR_INVALID_FORMAT;
+    std::vector<double> sidx_times;
+    for (unsigned int i = 0; i < reference_count; i++) {
+        const AP4_UI08* reference = sidx+header_size+12*i;
+        if (reference[0] & 0x80) return AP4_ERROR_NOT_SUPPORTED; // references another sidx
+        if (reference[8] & 0x80) sidx_times.push_back((double)time/timescale);
+        time += AP4_BytesToUInt32BE(reference+4);
+    }
+    if (sidx_times.empty()) return AP4_ERROR_NOT_SUPPORTED;
+    times.swap(sidx_times);
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   InputStream::ParseMoofKeyframes
++---------------------------------------------------------------------*/
+AP4_Result
+InputStream::ParseMoofKeyframes(const AP4_UI08* moof, AP4_UI64 moof_size, AP4_UI32 track_id, AP4_UI32 trex_duration, AP4_UI32 trex_flags, AP4_UI32 timescale, AP4_UI64& dts, std::vector<double>& times)
+{
+    BoxHeader header;
+    for (; BoxHeader::Parse(moof, moof_size, header); moof += header.size, moof_size -= header.size) {
+        if (header.type != AP4_ATOM_TYPE_TRAF) continue;
+        const AP4_UI08* traf = moof+header.header_size;
+        AP4_UI64        traf_size = header.GetPayloadSize();
+
+        // tfhd: the track and its defaults
+        const AP4_UI08* tfhd = NULL;
+        AP4_UI64        tfhd_size = 0;
+        if (!FindBoxPayload(traf, traf_size, { AP4_ATOM_TYPE_TFHD }, tfhd, tfhd_size) || tfhd_size < 8) return AP4_ERROR_INVALID_FORMAT;
+        if (AP4_BytesToUInt32BE(tfhd+4) != track_id) continue;
+        AP4_UI32 tfhd_flags = AP4_BytesToUInt32BE(tfhd) & 0xFFFFFF;
+        AP4_UI32 default_duration = trex_duration;
+        AP4_UI32 default_flags = trex_flags;
+        AP4_UI64 offset = 8+((tfhd_flags & 0x01) ? 8 : 0)+((tfhd_flags & 0x02) ? 4 : 0);
+        if (tfhd_flags & 0x08) {
+            if (offset+4 > tfhd_size) return AP4_ERROR_INVALID_FORMAT;
+            default_duration = AP4_BytesToUInt32BE(tfhd+offset);
+            offset += 4;
+        }
+        if (tfhd_flags & 0x10) offset += 4;
+        if (tfhd_flags & 0x20) {
+            if (offset+4 > tfhd_size) return AP4_ERROR_INVALID_FORMAT;
+            default_flags = AP4_BytesToUInt32BE(tfhd+offset);
+        }
+
+        const AP4_UI08* tfdt = NULL;
+        AP4_UI64        tfdt_size = 0;
+        if (FindBoxPayload(traf, traf_size, { AP4_ATOM_TYPE_TFDT }, tfdt, tfdt_size) && tfdt_size >= 8) {
+            dts = (tfdt[0] == 1 && tfdt_size >= 12) ? AP4_BytesToUInt64BE(tfdt+4) : AP4_BytesToUInt32BE(tfdt+4);
+        }
+
+        // trun: flags, sample count, then optional data offset, first sample flags and per sample fields
+        BoxHeader trun_header;
+        for (const AP4_UI08* data = traf; BoxHeader::Parse(data, traf_size, trun_header); data += trun_header.size, traf_size -= trun_header.size) {
+            if (trun_header.type != AP4_ATOM_TYPE_TRUN || trun_header.GetPayloadSize() < 8) continue;
+            const AP4_UI08* trun = data+trun_header.header_size;
+            AP4_UI32 trun_flags   = AP4_BytesToUInt32BE(trun) & 0xFFFFFF;
+            AP4_UI32 sample_count = AP4_BytesToUInt32BE(trun+4);
+            AP4_UI64 position     = 8+((trun_flags & 0x01) ? 4 : 0);
+            AP4_UI32 first_flags  = 0;
+            if (trun_flags & 0x04) {
+                if (position+4 > trun_header.GetPayloadSize()) return AP4_ERROR_INVALID_FORMAT;
+                first_flags = AP4_BytesToUInt32BE(trun+position);
+                position += 4;
+            }
+            unsigned int sample_size = ((trun_flags & 0x100) ? 4 : 0)+((trun_flags & 0x200) ? 4 : 0)+((trun_flags & 0x400) ? 4 : 0)+((trun_flags & 0x800) ? 4 : 0);
+            if (position+(AP4_UI64)sample_count*sample_size > trun_header.GetPayloadSize()) return AP4_ERROR_INVALID_FORMAT;
+            for (AP4_UI32 i = 0; i < sample_count; i++, position += sample_size) {
+                AP4_UI32 duration = (trun_flags & 0x100) ? AP4_BytesToUInt32BE(trun+position) : default_duration;
+                AP4_UI32 flags    = default_flags;
+                if (i == 0 && (trun_flags & 0x04)) {
+                    flags = first_flags;
+                } else if (trun_flags & 0x400) {
+                    flags = AP4_BytesToUInt32BE(trun+position+((trun_flags & 0x100) ? 4 : 0)+((trun_flags & 0x200) ? 4 : 0));
+                }
+                // sample_is_non_sync_sample
+                if ((flags & 0x10000) == 0) times.push_back((double)dts/timescale);
+                dts += duration;
+            }
+        }
+    }
+    return AP4_SUCCESS;
+}
+
+}
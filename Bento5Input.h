@@ -0,0 +1,298 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENTO5_INPUT_H_
+#define _BENTO5_INPUT_H_
+
+#include <string>
+#include <vector>
+#include <initializer_list>
+#include "Ap4.h"
+#include "Bento5Common.h"
+
+namespace Bento5 {
+
+class FragmentDemuxer;
+
+/*----------------------------------------------------------------------
+|   SequentialFileByteStream
++---------------------------------------------------------------------*/
+const AP4_Size SEQUENTIAL_READ_BUFFER_SIZE = 64*1024;
+const AP4_UI64 CACHE_RELEASE_LAG           = 8*1024*1024; // kept cached behind the reads, the tracks are not read quite in step
+const AP4_UI64 CACHE_RELEASE_STEP          = 8*1024*1024;
+
+// read-only input stream that drops what has been read from the page cache
+class SequentialFileByteStream : public AP4_ByteStream {
+public:
+    static AP4_Result Create(const char* path, SequentialFileByteStream*& stream);
+
+    // bytes dropped from the page cache so far
+    AP4_UI64 GetReleasedSize() const { return m_ReleasedSize; }
+
+    // AP4_ByteStream methods
+    AP4_Result ReadPartial(void* buffer, AP4_Size bytes_to_read, AP4_Size& bytes_read);
+    AP4_Result WritePartial(const void* /*buffer*/, AP4_Size /*bytes_to_write*/, AP4_Size& bytes_written) {
+        bytes_written = 0;
+        return AP4_ERROR_NOT_SUPPORTED;
+    }
+    AP4_Result Seek(AP4_Position position) { m_Position = position; return AP4_SUCCESS; }
+    AP4_Result Tell(AP4_Position& position) { position = m_Position; return AP4_SUCCESS; }
+    AP4_Result GetSize(AP4_LargeSize& size) { size = m_Size; return AP4_SUCCESS; }
+    AP4_Result Flush() { return AP4_SUCCESS; }
+
+    // AP4_Referenceable methods
+    void AddReference() { m_ReferenceCount++; }
+    void Release() {
+        if (--m_ReferenceCount == 0) delete this;
+    }
+
+private:
+    SequentialFileByteStream(int fd, AP4_LargeSize size) :
+        m_Fd(fd), m_Size(size), m_Position(0), m_BufferPosition(0), m_BufferFill(0), m_RunStart(0), m_RunEnd(0), m_ReleasedSize(0), m_ReferenceCount(1) {}
+    ~SequentialFileByteStream();
+
+    void ReleaseCache(AP4_Position position, AP4_Size size);
+
+    int           m_Fd;
+    AP4_LargeSize m_Size;
+    AP4_Position  m_Position;
+    AP4_UI08      m_Buffer[SEQUENTIAL_READ_BUFFER_SIZE];
+    AP4_Position  m_BufferPosition;
+    AP4_Size      m_BufferFill;
+    AP4_Position  m_RunStart; // first byte of the current run still cached
+    AP4_Position  m_RunEnd;
+    AP4_UI64      m_ReleasedSize;
+    AP4_Cardinal  m_ReferenceCount;
+};
+
+/*----------------------------------------------------------------------
+|   BoxHeader
++---------------------------------------------------------------------*/
+// header of an ISO-BMFF box, parsed without going through the atom factory
+class BoxHeader {
+public:
+    BoxHeader() : type(0), size(0), header_size(0) {}
+    AP4_UI32 type;
+    AP4_UI64 size;        // including the header
+    AP4_UI32 header_size;
+
+    AP4_UI64 GetPayloadSize() const { return size-header_size; }
+
+    // parse a header from memory, a size of 0 extends the box to the end of the available bytes
+    static bool Parse(const AP4_UI08* data, AP4_UI64 available, BoxHeader& header);
+
+    // read a header from a stream, for top-level boxes that are not loaded in memory
+    static AP4_Result Read(AP4_ByteStream& stream, AP4_Position position, AP4_LargeSize stream_size, BoxHeader& header);
+};
+
+/*----------------------------------------------------------------------
+|   functions
++---------------------------------------------------------------------*/
+// look for the first child box of a given type in a box payload
+bool FindChildBox(const AP4_UI08* data, AP4_UI64 size, AP4_UI32 type, const AP4_UI08*& box, BoxHeader& header);
+// follow a path of child box types ("mdia", "minf", ...) and return the payload of the last one
+bool FindBoxPayload(const AP4_UI08* data, AP4_UI64 size, std::initializer_list<AP4_UI32> path, const AP4_UI08*& payload, AP4_UI64& payload_size);
+
+/*----------------------------------------------------------------------
+|   SampleIndex
++---------------------------------------------------------------------*/
+// struct-of-arrays copy of a track's sample table, the DTS are delta coded with a checkpoint
+// every DTS_CHECKPOINT_INTERVAL samples
+class SampleIndex
+{
+public:
+    static const unsigned int DTS_CHECKPOINT_INTERVAL = 256;
+
+    SampleIndex() : m_NextDts(0) {}
+
+    AP4_Result Build(AP4_Track& track);
+    AP4_Result Build(const AP4_UI08* stbl, AP4_UI64 stbl_size);
+    AP4_Result Append(AP4_UI64 dts, AP4_UI32 duration, AP4_UI32 cts_delta, AP4_Size size, AP4_Position offset, bool sync, AP4_Ordinal description_index);
+
+    AP4_Cardinal GetSampleCount() const { return (AP4_Cardinal)m_Sizes.size(); }
+    AP4_UI64     GetDts(AP4_Ordinal index) const;
+    AP4_UI32     GetDuration(AP4_Ordinal index) const { return m_Durations[index]; }
+    AP4_UI32     GetCtsDelta(AP4_Ordinal index) const { return m_CtsDeltas.empty() ? 0 : m_CtsDeltas[index]; }
+    AP4_Size     GetSize(AP4_Ordinal index) const { return m_Sizes[index]; }
+    AP4_Position GetOffset(AP4_Ordinal index) const { return m_Offsets[index]; }
+    bool         IsSync(AP4_Ordinal index) const { return (m_SyncBits[index>>6]>>(index&63))&1; }
+    AP4_Ordinal  GetDescriptionIndex(AP4_Ordinal index) const { return m_DescriptionIndexes.empty() ? 0 : m_DescriptionIndexes[index]; }
+
+private:
+    std::vector<AP4_UI64>     m_DtsCheckpoints;
+    std::vector<AP4_UI32>     m_Durations;
+    std::vector<AP4_UI32>     m_CtsDeltas;
+    std::vector<AP4_Size>     m_Sizes;
+    std::vector<AP4_Position> m_Offsets;
+    std::vector<AP4_UI64>     m_SyncBits;
+    std::vector<AP4_UI08>     m_DescriptionIndexes;
+    AP4_UI64                  m_NextDts;
+};
+
+/*----------------------------------------------------------------------
+|   SegmentArena
++---------------------------------------------------------------------*/
+// bump allocator behind the buffers of the mux loop of a rendition, reset at every segment
+class SegmentArena
+{
+public:
+    SegmentArena() : m_Used(0), m_SegmentSize(0) { m_Buffers.reserve(4); }
+    ~SegmentArena();
+
+    // SetDataSize of a buffer of the loop, it moves to the arena the first time it holds data
+    AP4_Result SetDataSize(AP4_DataBuffer& buffer, AP4_Size size);
+
+    // start over for a new segment, keeping the data of the buffers
+    void Reset();
+
+    AP4_UI64 GetSize() const;
+
+private:
+    struct Chunk {
+        AP4_UI08* data;
+        AP4_Size  size;
+    };
+
+    static AP4_Size Align(AP4_Size size) { return (size+15) & ~15u; }
+    AP4_UI08* Allocate(AP4_Size size);
+
+    std::vector<Chunk>           m_Chunks;
+    AP4_Size                     m_Used;        // in the last chunk
+    AP4_Size                     m_SegmentSize; // allocated since the last reset, in all the chunks
+    std::vector<AP4_DataBuffer*> m_Buffers;
+};
+
+/*----------------------------------------------------------------------
+|   SampleReader
++---------------------------------------------------------------------*/
+class SampleReader
+{
+public:
+    virtual ~SampleReader() {}
+    // with an arena, the sample data is read into it when the reader can do that
+    virtual AP4_Result ReadSample(AP4_Sample& sample, AP4_DataBuffer& sample_data, SegmentArena* arena) = 0;
+    // continue reading at the sample with the given index
+    virtual AP4_Result SeekSample(AP4_Ordinal index) = 0;
+};
+
+/*----------------------------------------------------------------------
+|   IndexedSampleReader
++---------------------------------------------------------------------*/
+class IndexedSampleReader : public SampleReader
+{
+public:
+    // without read_data only the sample fields are set, and the sample data is left empty
+    IndexedSampleReader(const SampleIndex& index, AP4_ByteStream& stream, bool read_data = true) :
+        m_Index(index), m_Stream(stream), m_ReadData(read_data), m_SampleIndex(0), m_Dts(index.GetSampleCount() ? index.GetDts(0) : 0) {}
+    AP4_Result ReadSample(AP4_Sample& sample, AP4_DataBuffer& sample_data, SegmentArena* arena);
+    AP4_Result SeekSample(AP4_Ordinal index);
+
+private:
+    const SampleIndex& m_Index;
+    AP4_ByteStream&    m_Stream;
+    bool               m_ReadData;
+    AP4_Ordinal        m_SampleIndex;
+    AP4_UI64           m_Dts;
+};
+
+/*----------------------------------------------------------------------
+|   ReadSample
++---------------------------------------------------------------------*/
+// read the next sample of a track, ts and duration in seconds. At the end, eos is set and ts moves
+// past the last sample.
+AP4_Result ReadSample(SampleReader& reader, AP4_Track& track, AP4_Sample& sample, AP4_DataBuffer& sample_data, SegmentArena* arena,
+                      double& ts, double& duration, bool& eos);
+
+/*----------------------------------------------------------------------
+|   InputStream
++---------------------------------------------------------------------*/
+class InputStream {
+public:
+    // an input file, or an open stream of one (file_path is then only its name in the messages)
+    InputStream(std::string file_path, AP4_ByteStream* stream = NULL) : file_path(file_path), input(stream), sequential_input(NULL), input_file(NULL), movie(NULL),
+        audio_track(NULL), video_track(NULL), fragment_demuxer(NULL), audio_reader(NULL), video_reader(NULL), profile(false) {
+        if (input) input->AddReference();
+    }
+
+    // fragment_buffer_cap bounds the samples buffered per track for fragmented inputs, see FragmentDemuxer
+    AP4_Result open(bool fast_open, AP4_UI64 fragment_buffer_cap, bool release_cache, bool profile, std::string& error);
+    ~InputStream();
+
+    std::vector<float> getKeyframesDTSTimeList();
+
+    // once the audio packets are shared, the audio samples are only read for their timing
+    void dropAudioData() {
+        delete audio_reader;
+        audio_reader = new IndexedSampleReader(audio_index, *input, false);
+    }
+private:
+    // load the moov with a single read and only index the first audio and video tracks
+    AP4_Result openMoov();
+
+    // replace the parsed tracks with copies that only keep what the fast path keeps
+    void releaseSampleTables();
+
+    static AP4_Result CopyTrack(AP4_Track& track, AP4_Track*& copy);
+
+    AP4_Result createTrack(const AP4_UI08* trak, AP4_UI64 trak_size, AP4_Track::Type type, SampleIndex& index, AP4_Track*& track);
+
+    // keyframe times of a fragmented video track from its tfra, sidx or trun boxes
+    AP4_Result indexFragmentKeyframes(std::vector<double>& times);
+
+    // the mfro box, last in the file, gives the size of the mfra box before it
+    AP4_Result readTfraKeyframes(AP4_LargeSize stream_size, std::vector<double>& times);
+
+    // the moov for the trex defaults, then a sidx of the video track or the moof boxes
+    AP4_Result scanFragmentKeyframes(AP4_LargeSize stream_size, std::vector<double>& times);
+
+    // trex: version, flags, track_ID, default sample description index, duration, size and flags
+    static void ParseTrexDefaults(const AP4_UI08* moov, AP4_UI64 moov_size, AP4_UI32 track_id, AP4_UI32& default_duration, AP4_UI32& default_flags);
+
+    // sidx: the subsegments that start with a SAP, only for a flat index of the track
+    static AP4_Result ParseSidxKeyframes(const AP4_UI08* sidx, AP4_UI64 size, AP4_UI32 track_id, std::vector<double>& times);
+
+    // the sync samples of the trun boxes of the track, dts continues from the previous fragment
+    // unless there is a tfdt
+    static AP4_Result ParseMoofKeyframes(const AP4_UI08* moof, AP4_UI64 moof_size, AP4_UI32 track_id, AP4_UI32 trex_duration, AP4_UI32 trex_flags,
+                                         AP4_UI32 timescale, AP4_UI64& dts, std::vector<double>& times);
+
+    std::string file_path;
+    AP4_ByteStream* input;
+    SequentialFileByteStream* sequential_input; // the same stream as input, with --release-input-cache
+    AP4_File* input_file;
+    AP4_Movie* movie;
+    AP4_Track* audio_track;
+    AP4_Track* video_track;
+    FragmentDemuxer*  fragment_demuxer;
+    SampleReader*     audio_reader;
+    SampleReader*     video_reader;
+    SampleIndex       audio_index;
+    SampleIndex       video_index;
+    std::vector<AP4_Atom*> sample_description_atoms;
+    StageStats        open_stage;
+    StageStats        keyframe_scan_stage;
+    bool              profile;
+    friend class OutputStream;
+    friend class SharedAudio;
+};
+
+}
+
+#endif // _BENTO5_INPUT_H_
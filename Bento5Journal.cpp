@@ -0,0 +1,235 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <algorithm>
+#include "Bento5Journal.h"
+#include "Bento5Rendition.h"
+#include "Bento5Committer.h"
+#include "Bento5Crypto.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   SegmentJournal::~SegmentJournal
++---------------------------------------------------------------------*/
+SegmentJournal::~SegmentJournal()
+{
+    if (m_Fd >= 0) close(m_Fd);
+}
+
+/*----------------------------------------------------------------------
+|   SegmentJournal::Open
++---------------------------------------------------------------------*/
+AP4_Result
+SegmentJournal::Open(std::filesystem::path path, AP4_UI64 size)
+{
+    m_Fd = open(path.string().c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (m_Fd < 0) {
+        LogError("cannot open %s", path.string().c_str());
+        return AP4_ERROR_CANNOT_OPEN_FILE;
+    }
+    if (ftruncate(m_Fd, (off_t)size) != 0) return AP4_ERROR_WRITE_FAILED;
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   SegmentJournal::AppendFingerprint
++---------------------------------------------------------------------*/
+AP4_Result
+SegmentJournal::AppendFingerprint(const std::string& fingerprint)
+{
+    return Write("fingerprint "+fingerprint+"\n");
+}
+
+/*----------------------------------------------------------------------
+|   SegmentJournal::Append
++---------------------------------------------------------------------*/
+AP4_Result
+SegmentJournal::Append(const Entry& entry, const IFrame* iframes, AP4_Cardinal iframe_count)
+{
+    std::string lines;
+    char        line[256];
+    for (AP4_Ordinal i = 0; i < iframe_count; i++) {
+        sprintf(line, "iframe %u %llu %u %.17g\n", iframes[i].segment, (unsigned long long)iframes[i].offset, iframes[i].size, iframes[i].ts);
+        lines += line;
+    }
+    sprintf(line, "segment %u %u %.17g %s %s %u %u %u %u %.17g\n", entry.number, entry.size, entry.duration,
+            entry.has_checksum ? entry.checksum.GetCrc32cString().c_str() : "-",
+            entry.has_checksum ? entry.checksum.GetSha256String().c_str() : "-",
+            entry.next_video_sample, entry.next_audio_sample, entry.video_continuity_counter, entry.audio_continuity_counter, entry.next_start);
+    lines += line;
+    return Write(lines);
+}
+
+/*----------------------------------------------------------------------
+|   SegmentJournal::AppendEnd
++---------------------------------------------------------------------*/
+AP4_Result
+SegmentJournal::AppendEnd(double video_end)
+{
+    char line[64];
+    sprintf(line, "end %.17g\n", video_end);
+    return Write(line);
+}
+
+/*----------------------------------------------------------------------
+|   SegmentJournal::Write
++---------------------------------------------------------------------*/
+AP4_Result
+SegmentJournal::Write(const std::string& lines)
+{
+    if (m_Fd < 0) return AP4_ERROR_INVALID_STATE;
+    for (size_t offset = 0; offset < lines.size();) {
+        ssize_t written = write(m_Fd, lines.data()+offset, lines.size()-offset);
+        if (written < 0) {
+            if (errno == EINTR) continue;
+            return AP4_ERROR_WRITE_FAILED;
+        }
+        offset += written;
+    }
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   SegmentJournal::Load
++---------------------------------------------------------------------*/
+AP4_Result
+SegmentJournal::Load(std::filesystem::path path, std::string& fingerprint, std::vector<Entry>& entries, std::vector<IFrame>& iframes,
+                     bool& ended, double& video_end)
+{
+    fingerprint.clear();
+    entries.clear();
+    ended = false;
+    std::string content;
+    AP4_Result  result = ReadTextFile(path, content);
+    if (AP4_FAILED(result)) return result;
+
+    std::vector<IFrame> pending_iframes;
+    for (size_t start = 0, end; (end = content.find('\n', start)) != std::string::npos; start = end+1) {
+        std::string  line = content.substr(start, end-start);
+        Entry        entry = {};
+        IFrame       iframe = {};
+        unsigned int video_cc, audio_cc;
+        unsigned long long offset;
+        char         crc32c[16], sha256[80];
+        if (start == 0 && sscanf(line.c_str(), "fingerprint %79s", sha256) == 1) {
+            fingerprint = sha256;
+        } else if (sscanf(line.c_str(), "segment %u %u %lf %15s %79s %u %u %u %u %lf", &entry.number, &entry.size, &entry.duration, crc32c, sha256,
+                   &entry.next_video_sample, &entry.next_audio_sample, &video_cc, &audio_cc, &entry.next_start) == 10) {
+            if (entry.number != entries.size()) return AP4_ERROR_INVALID_FORMAT;
+            entry.has_checksum = strcmp(crc32c, "-") != 0 && AP4_SUCCEEDED(AP4_ParseHex(sha256, entry.checksum.sha256, 32));
+            if (entry.has_checksum) entry.checksum.crc32c = (AP4_UI32)strtoul(crc32c, NULL, 16);
+            entry.video_continuity_counter = (AP4_UI08)(video_cc & 0x0F);
+            entry.audio_continuity_counter = (AP4_UI08)(audio_cc & 0x0F);
+            entry.journal_end = end+1;
+            entries.push_back(entry);
+            iframes.insert(iframes.end(), pending_iframes.begin(), pending_iframes.end());
+            pending_iframes.clear();
+        } else if (sscanf(line.c_str(), "iframe %u %llu %u %lf", &iframe.segment, &offset, &iframe.size, &iframe.ts) == 4) {
+            iframe.offset = offset;
+            pending_iframes.push_back(iframe);
+        } else if (sscanf(line.c_str(), "end %lf", &video_end) == 1) {
+            ended = true;
+        } else {
+            return AP4_ERROR_INVALID_FORMAT;
+        }
+    }
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::getJournalFingerprint
++---------------------------------------------------------------------*/
+std::string
+OutputStream::getJournalFingerprint(OutputStream* output, float seg_duration, const std::vector<float>& segment_points, const WriteOptions& options)
+{
+    const InputStream* input = output->input_stream;
+    AP4_LargeSize      input_size = 0;
+    input->input->GetSize(input_size);
+    std::error_code error;
+    std::filesystem::file_time_type input_time = std::filesystem::last_write_time(input->file_path, error);
+
+    std::string description = input->file_path;
+    char        buffer[256];
+    sprintf(buffer, " %llu %lld %.9g %u", (unsigned long long)input_size, error ? 0LL : (long long)input_time.time_since_epoch().count(),
+            seg_duration, (unsigned int)segment_points.size());
+    description += buffer;
+    for (float point : segment_points) {
+        sprintf(buffer, " %.9g", point);
+        description += buffer;
+    }
+    if (options.encryption) {
+        description += " aes-128 ";
+        description.append((const char*)options.encryption->key, 16);
+    }
+
+    Sha256 hash;
+    hash.Update((const AP4_UI08*)description.data(), (AP4_Size)description.size());
+    SegmentChecksum checksum;
+    hash.Final(checksum.sha256);
+    return checksum.GetSha256String();
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::loadJournal
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::loadJournal(OutputStream* output, const WriteOptions& options, const std::string& fingerprint, std::vector<SegmentJournal::Entry>& entries, std::vector<IFrame>& iframes, bool& ended, double& video_end)
+{
+    std::filesystem::path path = output->out_folder/JOURNAL_FILENAME;
+    if (!std::filesystem::exists(path)) return AP4_SUCCESS;
+    std::string journaled_fingerprint;
+    AP4_Result  result = SegmentJournal::Load(path, journaled_fingerprint, entries, iframes, ended, video_end);
+    if (AP4_FAILED(result)) {
+        LogError("cannot read the journal of %s", output->out_folder.string().c_str());
+        return result;
+    }
+    if (journaled_fingerprint != fingerprint) {
+        LogError("the journal of %s was written for another input or other options", output->out_folder.string().c_str());
+        entries.clear();
+        return AP4_ERROR_INVALID_PARAMETERS;
+    }
+    for (unsigned int i = 0; i < entries.size(); i++) {
+        char filename[64];
+        sprintf(filename, SEGMENT_FILENAME_TEMPLATE, i);
+        std::error_code error;
+        std::uintmax_t  size = std::filesystem::file_size(output->out_folder/filename, error);
+        bool            kept = !error && size == entries[i].size && !(options.checksums && !entries[i].has_checksum);
+        if (kept && entries[i].has_checksum) {
+            AP4_UI32 crc32c = 0;
+            kept = AP4_SUCCEEDED(ReadFileCrc32c(output->out_folder/filename, crc32c)) && crc32c == entries[i].checksum.crc32c;
+        }
+        if (!kept) {
+            entries.resize(i);
+            ended = false;
+            break;
+        }
+    }
+    iframes.erase(std::remove_if(iframes.begin(), iframes.end(), [&entries](const IFrame& iframe) { return iframe.segment >= entries.size(); }), iframes.end());
+    return AP4_SUCCESS;
+}
+
+}
@@ -0,0 +1,85 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENTO5_JOURNAL_H_
+#define _BENTO5_JOURNAL_H_
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include "Ap4.h"
+#include "Bento5Common.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   IFrame
++---------------------------------------------------------------------*/
+// position of a keyframe in the segments, for the I-frame playlist
+struct IFrame {
+    unsigned int segment;
+    AP4_Position offset;
+    AP4_UI32     size;
+    double       ts;
+};
+
+/*----------------------------------------------------------------------
+|   SegmentJournal
++---------------------------------------------------------------------*/
+// append-only record of the completely written segments of a rendition, for --resume
+class SegmentJournal
+{
+public:
+    struct Entry {
+        unsigned int    number;
+        AP4_UI32        size;
+        double          duration;
+        bool            has_checksum;
+        SegmentChecksum checksum;
+        AP4_Ordinal     next_video_sample; // the first samples of the next segment
+        AP4_Ordinal     next_audio_sample;
+        AP4_UI08        video_continuity_counter;
+        AP4_UI08        audio_continuity_counter;
+        double          next_start;
+        AP4_UI64        journal_end; // offset of the end of the line in the journal
+    };
+
+    SegmentJournal() : m_Fd(-1) {}
+    ~SegmentJournal();
+
+    // open for appending after the first size bytes, anything after them is dropped
+    AP4_Result Open(std::filesystem::path path, AP4_UI64 size);
+    AP4_Result AppendFingerprint(const std::string& fingerprint);
+    AP4_Result Append(const Entry& entry, const IFrame* iframes, AP4_Cardinal iframe_count);
+    AP4_Result AppendEnd(double video_end);
+
+    // the segments of a journal, numbered from 0 without a gap, and their I-frames
+    static AP4_Result Load(std::filesystem::path path, std::string& fingerprint, std::vector<Entry>& entries, std::vector<IFrame>& iframes,
+                           bool& ended, double& video_end);
+
+private:
+    AP4_Result Write(const std::string& lines);
+
+    int m_Fd;
+};
+
+}
+
+#endif // _BENTO5_JOURNAL_H_
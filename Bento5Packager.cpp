@@ -0,0 +1,339 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <filesystem>
+#include <map>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include "Ap4.h"
+#include "Bento5Packager.h"
+#include "Bento5Common.h"
+#include "Bento5Committer.h"
+#include "Bento5Crypto.h"
+#include "Bento5Input.h"
+#include "Bento5TsPacketizer.h"
+#include "Bento5Plan.h"
+#include "Bento5Rendition.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   PackagerRun
++---------------------------------------------------------------------*/
+// what a Packager::Run allocates, freed when it returns
+class PackagerRun {
+public:
+    PackagerRun() : encryption(NULL) {}
+    ~PackagerRun() {
+        std::for_each(output_streams.begin(), output_streams.end(), [](OutputStream *ptr) {delete ptr;});
+        std::for_each(shared_audios.begin(), shared_audios.end(), [](SharedAudio *ptr) {delete ptr;});
+        delete write_options.committer;
+        delete encryption;
+    }
+
+    std::vector<InputStream*>  input_streams; // deleted with their output streams
+    std::vector<OutputStream*> output_streams;
+    std::vector<SharedAudio*>  shared_audios;
+    WriteOptions               write_options;
+    EncryptionKey*             encryption;
+};
+
+/*----------------------------------------------------------------------
+|   Packager::Run
++---------------------------------------------------------------------*/
+AP4_Result
+Packager::Run(OutputSink* sink, PackagerListener* listener)
+{
+    m_Error.clear();
+    m_Warnings.clear();
+    m_PlanJson.clear();
+    m_StatsJson.clear();
+
+    // everything the threads of the run report, the errors complete the one Execute fails with
+    RunLog     log;
+    AP4_Result result;
+    {
+        RunLogScope scope(&log);
+        result = Execute(sink, listener);
+    }
+    m_Warnings = log.warnings;
+    if (AP4_FAILED(result)) {
+        for (const std::string& error : log.errors) m_Error += (m_Error.empty() ? "" : ": ")+error;
+    }
+    return result;
+}
+
+/*----------------------------------------------------------------------
+|   Packager::Execute
++---------------------------------------------------------------------*/
+AP4_Result
+Packager::Execute(OutputSink* sink, PackagerListener* listener)
+{
+    const PackagerOptions& options = m_Options;
+    double      start_wall_time = GetWallTime();
+    double      start_cpu_time = GetCpuTime();
+    PackagerRun run;
+
+    if (m_Inputs.empty()) return Fail(AP4_ERROR_INVALID_PARAMETERS, "no input");
+    if (sink == NULL && options.output_dir.empty()) return Fail(AP4_ERROR_INVALID_PARAMETERS, "no output directory");
+    if (sink && (options.durable || options.resume || options.shard_count || options.merge || !options.plan_out.empty() ||
+                 options.direct_io || options.preallocate)) {
+        return Fail(AP4_ERROR_NOT_SUPPORTED, "durable, resume, shard, merge, plan-out, direct-io and preallocate need an output directory");
+    }
+    if (options.encrypt) {
+        if (options.encryption_key_uri.empty()) return Fail(AP4_ERROR_INVALID_PARAMETERS, "the URI of the key is needed to encrypt the segments");
+        run.encryption = new EncryptionKey(options.encryption_key, options.encryption_key_uri);
+    }
+
+    // with a sink, the paths are relative to the output directory it stands for
+    std::filesystem::path output_folder = sink ? std::filesystem::path("output") : std::filesystem::path(options.output_dir)/"output";
+    for (unsigned int i = 0; i < m_Inputs.size(); i++) {
+        InputStream* input_stream = new InputStream(m_Inputs[i].path, m_Inputs[i].stream);
+        run.input_streams.push_back(input_stream);
+        run.output_streams.push_back(new OutputStream(output_folder/("media-"+std::to_string(i)), input_stream, i));
+    }
+    for (unsigned int i = 0; i < m_Inputs.size(); i++) {
+        std::string error;
+        AP4_Result  result = run.input_streams[i]->open(options.fast_open, options.fragment_buffer, options.release_input_cache, options.profile, error);
+        if (AP4_SUCCEEDED(result)) result = run.output_streams[i]->createStreams(error);
+        if (AP4_FAILED(result)) return Fail(result, error);
+    }
+    std::vector<OutputStream*>& output_streams = run.output_streams;
+    std::vector<InputStream*>&  input_streams = run.input_streams;
+
+    std::vector<std::vector<float>> keyframeDTS;
+    std::transform(input_streams.begin(), input_streams.end(), std::back_inserter(keyframeDTS), [](InputStream *input) {return input->getKeyframesDTSTimeList();});
+
+    StageStats alignment_stage;
+    std::vector<float> filterdDTSByDuration;
+    {
+        StageTimer timer(&alignment_stage, options.profile);
+        TraceSpan span("alignment", "plan");
+        std::vector<float> alignedDTS = findAlignedDTS(keyframeDTS);
+        filterdDTSByDuration = filterDTSBySegmentDuration(alignedDTS, options.segment_duration);
+    }
+
+    WriteOptions& write_options = run.write_options;
+    write_options.profile         = options.profile;
+    write_options.checksums       = options.checksums;
+    write_options.encryption      = run.encryption;
+    write_options.iframe_playlist = options.iframe_playlists;
+    write_options.publish_every   = options.publish_every;
+    write_options.resume          = options.resume;
+    write_options.direct_io       = options.direct_io;
+    write_options.preallocate     = options.preallocate;
+    write_options.sink            = sink;
+    write_options.listener        = listener;
+
+    // the plan stops after the planning, everything comes from the sample tables
+    if (options.plan) {
+        for (OutputStream* output_stream : output_streams) {
+            if (AP4_FAILED(output_stream->planSegments(options.segment_duration, filterdDTSByDuration, write_options))) {
+                return Fail(AP4_ERROR_NOT_SUPPORTED, "cannot plan the segments of fragmented inputs");
+            }
+        }
+        m_PlanJson = OutputStream::getPlanJson(output_streams, options.segment_duration, filterdDTSByDuration);
+        return AP4_SUCCESS;
+    }
+
+    // plan_out stops after the planning too, the continuity counters cost a read of the video samples
+    if (!options.plan_out.empty()) {
+        for (OutputStream* output_stream : output_streams) {
+            if (AP4_FAILED(output_stream->planSegments(options.segment_duration, filterdDTSByDuration, write_options))) {
+                return Fail(AP4_ERROR_NOT_SUPPORTED, "cannot plan the segments of fragmented inputs");
+            }
+            if (AP4_FAILED(output_stream->planContinuityCounters())) {
+                return Fail(AP4_ERROR_READ_FAILED, "cannot read the video samples of the inputs");
+            }
+        }
+        if (AP4_FAILED(OutputStream::writePlanFile(output_streams, options.plan_out))) {
+            return Fail(AP4_ERROR_WRITE_FAILED, "could not write the plan to "+options.plan_out);
+        }
+        return AP4_SUCCESS;
+    }
+
+    // a shard writes its slice of the planned segments, the playlists are left to merge
+    if (options.shard_count) {
+        if (options.shard_index == 0 || options.shard_index > options.shard_count) {
+            return Fail(AP4_ERROR_INVALID_PARAMETERS, "invalid shard, expected k/N with k from 1 to N");
+        }
+        if (write_options.resume) return Fail(AP4_ERROR_INVALID_PARAMETERS, "shards cannot be resumed, run the shard again");
+        if (options.plan_in.empty()) return Fail(AP4_ERROR_INVALID_PARAMETERS, "a plan is needed to write a shard");
+        if (AP4_FAILED(OutputStream::readPlanFile(output_streams, options.plan_in))) {
+            return Fail(AP4_ERROR_INVALID_FORMAT, options.plan_in+" is not a plan of these inputs");
+        }
+        for (OutputStream* output_stream : output_streams) {
+            if (output_stream->getPlannedSegmentCount() < options.shard_count) {
+                return Fail(AP4_ERROR_INVALID_PARAMETERS, "some renditions have fewer than "+std::to_string(options.shard_count)+" segments");
+            }
+        }
+        if (write_options.publish_every) {
+            LogWarning("the playlists of shards are not published");
+            write_options.publish_every = 0;
+        }
+        write_options.shard_index = options.shard_index;
+        write_options.shard_count = options.shard_count;
+    }
+    if (options.durable) write_options.committer = new SegmentCommitter(RunLog::Current);
+    bool reuse_folders = write_options.shard_count || options.merge || write_options.resume;
+    for (OutputStream* output_stream : output_streams) {
+        std::string error;
+        if (sink == NULL && AP4_FAILED(output_stream->createOutputFolder(error, reuse_folders))) {
+            return Fail(AP4_ERROR_CANNOT_OPEN_FILE, error);
+        }
+    }
+
+    // merge only writes the playlists of the segments written by the shards
+    if (options.merge) {
+        for (OutputStream* output_stream : output_streams) {
+            if (AP4_FAILED(OutputStream::mergeShards(output_stream, options.merge, write_options))) {
+                return Fail(AP4_ERROR_INVALID_FORMAT, "could not merge the shards");
+            }
+        }
+        if (AP4_FAILED(OutputStream::generateMasterPlaylist(output_streams, output_folder, false, write_options.committer != NULL))) {
+            return Fail(AP4_ERROR_WRITE_FAILED, "could not write the master playlist");
+        }
+        return AP4_SUCCESS;
+    }
+
+    // inputs with the same audio track share its TS packets, not worth it for a slice of them
+    StageStats shared_audio_stage;
+    if (options.shared_audio && write_options.shard_count == 0) {
+        StageTimer timer(&shared_audio_stage, options.profile);
+        std::map<std::string, std::vector<unsigned int>> audio_groups;
+        for (unsigned int i = 0; i < input_streams.size(); i++) {
+            std::string key = SharedAudio::GetKey(*input_streams.at(i));
+            if (!key.empty()) audio_groups[key].push_back(i);
+        }
+        for (auto& group : audio_groups) {
+            if (group.second.size() < 2) continue;
+            SharedAudio* shared_audio = new SharedAudio();
+            if (AP4_FAILED(shared_audio->Build(*input_streams.at(group.second.front())))) {
+                delete shared_audio;
+                continue;
+            }
+            run.shared_audios.push_back(shared_audio);
+            for (unsigned int i : group.second) {
+                input_streams.at(i)->dropAudioData();
+                output_streams.at(i)->setSharedAudio(shared_audio);
+            }
+        }
+    }
+
+    // with a plan for every rendition, the master playlist is written first
+    StageStats master_playlist_stage;
+    bool       predicted = write_options.shard_count == 0;
+    for (unsigned int i = 0; predicted && i < output_streams.size(); i++) {
+        if (AP4_FAILED(output_streams[i]->planSegments(options.segment_duration, filterdDTSByDuration, write_options))) {
+            predicted = false;
+        }
+    }
+    if (!predicted && write_options.publish_every) {
+        LogWarning("cannot plan the segments of every input, the playlists are only written at the end");
+        write_options.publish_every = 0;
+    }
+    if (write_options.publish_every) {
+        for (OutputStream* output_stream : output_streams) {
+            // a resumed rendition does not take back what it published, it starts from its journal
+            if (write_options.resume && output_stream->hasJournal()) continue;
+            if (AP4_FAILED(OutputStream::writeMediaPlaylist(output_stream, std::vector<double>(), false, write_options))) {
+                return Fail(AP4_ERROR_WRITE_FAILED, "could not publish the media playlists");
+            }
+        }
+    }
+    if (predicted) {
+        StageTimer timer(&master_playlist_stage, options.profile);
+        if (AP4_FAILED(OutputStream::generateMasterPlaylist(output_streams, output_folder, true, write_options.committer != NULL, sink))) {
+            return Fail(AP4_ERROR_WRITE_FAILED, "could not write the master playlist");
+        }
+    }
+
+    // the renditions are independent, each worker takes the next one that is not written yet
+    double                    segment_duration = options.segment_duration;
+    unsigned int              jobs = std::max(1u, options.jobs);
+    std::atomic<unsigned int> next_output(0);
+    std::vector<AP4_Result>   results(output_streams.size(), AP4_SUCCESS);
+    auto write_outputs = [&output_streams, &next_output, &results, segment_duration, &filterdDTSByDuration, &write_options]() {
+        for (unsigned int i = next_output++; i < output_streams.size(); i = next_output++) {
+            results[i] = OutputStream::write_samples(output_streams.at(i), segment_duration, filterdDTSByDuration, write_options);
+        }
+    };
+    std::vector<std::thread> workers;
+    std::mutex               workers_lock;
+    double                   workers_cpu_time = 0.0;
+    RunLog*                  log = RunLog::Current;
+    for (unsigned int i = 1; i < jobs && i < output_streams.size(); i++) {
+        workers.push_back(std::thread([&write_outputs, &workers_lock, &workers_cpu_time, log]() {
+            RunLogScope scope(log);
+            write_outputs();
+            std::lock_guard<std::mutex> guard(workers_lock);
+            workers_cpu_time += GetCpuTime();
+        }));
+    }
+    write_outputs();
+    std::for_each(workers.begin(), workers.end(), [](std::thread& worker) { worker.join(); });
+    for (unsigned int i = 0; i < results.size(); i++) {
+        if (AP4_FAILED(results[i])) {
+            return Fail(results[i], "could not write the segments of "+m_Inputs[i].path);
+        }
+    }
+
+    // the predicted master playlist is only replaced when the written renditions prove it wrong
+    if (write_options.shard_count == 0 &&
+        (!predicted || std::count_if(output_streams.begin(), output_streams.end(), [](OutputStream* os) { return !os->checkPrediction(); }))) {
+        StageTimer timer(&master_playlist_stage, options.profile);
+        if (AP4_FAILED(OutputStream::generateMasterPlaylist(output_streams, output_folder, false, write_options.committer != NULL, sink))) {
+            return Fail(AP4_ERROR_WRITE_FAILED, "could not write the master playlist");
+        }
+    }
+
+    if (options.profile) {
+        m_StatsJson = OutputStream::getStatsJson(output_streams, alignment_stage, shared_audio_stage, master_playlist_stage,
+                                                 GetWallTime()-start_wall_time, GetCpuTime()-start_cpu_time+workers_cpu_time);
+    }
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   StartTrace
++---------------------------------------------------------------------*/
+void
+StartTrace()
+{
+    TraceRecorder* recorder = new TraceRecorder();
+    TraceRecorder* none = NULL;
+    if (!TraceRecorder::Instance.compare_exchange_strong(none, recorder)) delete recorder;
+}
+
+/*----------------------------------------------------------------------
+|   SaveTrace
++---------------------------------------------------------------------*/
+AP4_Result
+SaveTrace(const std::string& path)
+{
+    TraceRecorder* recorder = TraceRecorder::Instance.exchange(NULL);
+    if (recorder == NULL) return AP4_ERROR_INVALID_STATE;
+    AP4_Result result = recorder->Save(path);
+    delete recorder;
+    return result;
+}
+
+}
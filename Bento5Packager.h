@@ -0,0 +1,172 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENTO5_PACKAGER_H_
+#define _BENTO5_PACKAGER_H_
+
+#include <string.h>
+#include <string>
+#include <vector>
+#include "Ap4.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   AllocationCounter
++---------------------------------------------------------------------*/
+// heap allocations of the calling thread, for the allocation stats. The application counts them
+// in its global operator new (mov2hls does), they stay at 0 otherwise.
+class AllocationCounter {
+public:
+    static AP4_UI64 Get() { return count; }
+    static thread_local AP4_UI64 count;
+};
+
+/*----------------------------------------------------------------------
+|   OutputSink
++---------------------------------------------------------------------*/
+// where the packager writes its files instead of the output directory. The paths are relative
+// to the output directory (output/master.m3u8, output/media-0/segment-0.ts, ...), and each
+// stream gets a whole file from start to end. The segments are created once, the playlists can
+// be created again with the same path while the run goes on (master.m3u8 when the predicted one
+// proves wrong, stream.m3u8 at each publication): the new version replaces the previous one.
+// CreateFile is called from the worker threads.
+class OutputSink {
+public:
+    virtual ~OutputSink() {}
+
+    // stream gets a new reference, released by the packager when the file is written
+    virtual AP4_Result CreateFile(const std::string& path, AP4_ByteStream*& stream) = 0;
+};
+
+/*----------------------------------------------------------------------
+|   PackagerListener
++---------------------------------------------------------------------*/
+// progress of a run, called from the worker threads
+class PackagerListener {
+public:
+    virtual ~PackagerListener() {}
+
+    // planned_count is 0 when the segments of the rendition could not be planned
+    virtual void OnSegmentWritten(unsigned int rendition, unsigned int segment_number, unsigned int planned_count) = 0;
+};
+
+/*----------------------------------------------------------------------
+|   PackagerInput
++---------------------------------------------------------------------*/
+// an input file, or a seekable stream of one
+class PackagerInput {
+public:
+    PackagerInput(const std::string& path) : path(path), stream(NULL) {}
+    PackagerInput(const std::string& name, AP4_ByteStream* stream) : path(name), stream(stream) {}
+
+    std::string     path;   // only the name in the messages for a stream
+    AP4_ByteStream* stream; // NULL to open the file, referenced while the packager uses it
+};
+
+/*----------------------------------------------------------------------
+|   PackagerOptions
++---------------------------------------------------------------------*/
+// the options of mov2hls, with its defaults
+class PackagerOptions {
+public:
+    PackagerOptions() : segment_duration(6.0), fast_open(true), shared_audio(true), release_input_cache(false), direct_io(false),
+        preallocate(false), fragment_buffer(32*1024*1024), encrypt(false), iframe_playlists(true), checksums(false), publish_every(0),
+        durable(false), resume(false), profile(false), jobs(1), plan(false), shard_index(0), shard_count(0), merge(0) {
+        memset(encryption_key, 0, sizeof(encryption_key));
+    }
+
+    std::string  output_dir;          // the files go to its output folder, not used with a sink
+    double       segment_duration;
+    bool         fast_open;           // read only the selected tracks of the moov
+    bool         shared_audio;        // packetize the same audio track of several inputs once
+    bool         release_input_cache; // files only
+    bool         direct_io;
+    bool         preallocate;
+    AP4_UI64     fragment_buffer;     // bytes buffered per track of fragmented files, 0 for no limit
+    bool         encrypt;             // AES-128 with encryption_key
+    AP4_UI08     encryption_key[16];
+    std::string  encryption_key_uri;
+    bool         iframe_playlists;
+    bool         checksums;
+    unsigned int publish_every;       // segments between the publications of EVENT playlists, 0 to publish at the end
+    bool         durable;
+    bool         resume;
+    bool         profile;             // collect the stats of GetStatsJson
+    unsigned int jobs;                // renditions written in parallel
+    bool         plan;                // only plan the segments, see GetPlanJson
+    std::string  plan_out;            // only write the plan for the shards to this file
+    std::string  plan_in;             // plan file of the shards
+    unsigned int shard_index;         // from 1 to shard_count, shard_count 0 to write every segment
+    unsigned int shard_count;
+    unsigned int merge;               // write the playlists of this many shards, 0 to write the segments
+};
+
+/*----------------------------------------------------------------------
+|   Packager
++---------------------------------------------------------------------*/
+// packages a set of inputs as the renditions of an HLS ladder. Packagers do not share anything,
+// several of them can run at the same time on different threads.
+class Packager {
+public:
+    Packager(const std::vector<PackagerInput>& inputs, const PackagerOptions& options) : m_Inputs(inputs), m_Options(options) {}
+
+    // writes to the output directory, or only to the sink when there is one. A sink cannot be used
+    // with the options that work on the output directory itself (durable, resume, shards, merge,
+    // plan_out, direct_io and preallocate). The listener, if any, follows the segments written.
+    AP4_Result Run(OutputSink* sink = NULL, PackagerListener* listener = NULL);
+
+    // why Run failed, with the errors reported on the way
+    const std::string& GetError() const { return m_Error; }
+    // what Run reported without failing (predictions that did not hold, options ignored, ...)
+    const std::vector<std::string>& GetWarnings() const { return m_Warnings; }
+    // the segment plans, after Run with the plan option
+    const std::string& GetPlanJson() const { return m_PlanJson; }
+    // per rendition and per stage stats, after Run with the profile option. The CPU time is that
+    // of the threads of the run.
+    const std::string& GetStatsJson() const { return m_StatsJson; }
+
+private:
+    AP4_Result Execute(OutputSink* sink, PackagerListener* listener);
+    AP4_Result Fail(AP4_Result result, const std::string& error) { m_Error = error; return result; }
+
+    std::vector<PackagerInput> m_Inputs;
+    PackagerOptions            m_Options;
+    std::string                m_Error;
+    std::vector<std::string>   m_Warnings;
+    std::string                m_PlanJson;
+    std::string                m_StatsJson;
+};
+
+/*----------------------------------------------------------------------
+|   functions
++---------------------------------------------------------------------*/
+// check the segments of an output directory written earlier, report gets a line per rendition
+// and errors a line per error
+AP4_Result VerifyLadder(const std::string& output_dir, unsigned int jobs, std::string& report, std::string& errors);
+
+// record the spans of every packager of the process from now on, until SaveTrace, which has to be
+// called when no packager runs
+void       StartTrace();
+AP4_Result SaveTrace(const std::string& path);
+
+}
+
+#endif // _BENTO5_PACKAGER_H_
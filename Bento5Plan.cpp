@@ -0,0 +1,406 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <cmath>
+#include <algorithm>
+#include "Bento5Plan.h"
+#include "Bento5Rendition.h"
+#include "Bento5Committer.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   IsSegmentBoundary
++---------------------------------------------------------------------*/
+// the segmenting rule: inputs with video are cut at the keyframes close to one of the aligned
+// segment points, audio-only inputs every seg_duration. Only asked for sync samples.
+bool
+IsSegmentBoundary(bool has_video, double ts, double last_ts, float seg_duration, const std::vector<float>& segment_points)
+{
+    if (!has_video) return ts-last_ts >= seg_duration;
+    return std::find_if(segment_points.begin(), segment_points.end(), [ts](float x) {return abs(x - ts) <= 2 * MAX_DTS_DELTA; }) != segment_points.end();
+}
+
+/*----------------------------------------------------------------------
+|   GetTargetDuration
++---------------------------------------------------------------------*/
+unsigned int
+GetTargetDuration(const std::vector<double>& segment_durations)
+{
+    unsigned int target_duration = 0;
+    for (unsigned int i=0; i<segment_durations.size(); i++) {
+        if ((unsigned int)(segment_durations[i]+0.5) > target_duration) {
+            target_duration = (unsigned int)(segment_durations[i]+0.5);
+        }
+    }
+    return target_duration;
+}
+
+/*----------------------------------------------------------------------
+|   VectorCommonFloatFinder
++---------------------------------------------------------------------*/
+class VectorCommonFloatFinder {
+public:
+    VectorCommonFloatFinder(std::vector<float> vec) : vec(vec), index(0) {}
+    bool exist(float value) {
+        while(index < vec.size()) {
+            if (abs(vec.at(index) - value) < MAX_DTS_DELTA) {
+                return true;
+            }
+            if(vec.at(index) > value) {
+                break;
+            }
+            index++;
+        }
+        return false;
+    }
+private:
+    std::vector<float> vec;
+    unsigned int index;
+};
+
+/*----------------------------------------------------------------------
+|   findAlignedDTS
++---------------------------------------------------------------------*/
+std::vector<float>
+findAlignedDTS(std::vector<std::vector<float>> array)
+{
+    if (array.size() == 0) {
+        return std::vector<float>();
+    } else if (array.size() == 1) {
+        return array.at(0);
+    } else {
+        std::vector<float> res;
+        std::vector<float> front = array.front();
+        std::vector<VectorCommonFloatFinder*> finderArray;
+        std::transform(array.begin(), array.end(), std::back_inserter(finderArray), [](std::vector<float> x) {return new VectorCommonFloatFinder(x);});
+        for (unsigned int i = 0; i < front.size(); i++) {
+            bool not_exist = false;
+            for(unsigned int j = 0; j < finderArray.size(); j++) {
+                if(finderArray.at(j)->exist(front.at(i))==false) {
+                    not_exist = true;
+                    break;
+                }
+            }
+            if(not_exist == false) {
+                res.push_back(front.at(i));
+            }
+        }
+        std::for_each(finderArray.begin(), finderArray.end(), [](VectorCommonFloatFinder *ptr) {delete ptr;});
+        return res;
+    }
+}
+
+/*----------------------------------------------------------------------
+|   filterDTSBySegmentDuration
++---------------------------------------------------------------------*/
+std::vector<float>
+filterDTSBySegmentDuration(std::vector<float> array, float segment_duration)
+{
+    float lastDTS = 0;
+    std::vector<float> res;
+    for (unsigned int i = 0; i < array.size(); i++) {
+        if ((array.at(i)-lastDTS) >= segment_duration || abs(array.at(i)-lastDTS-segment_duration) < 1) {
+            res.push_back(array.at(i));
+            lastDTS = array.at(i);
+        }
+    }
+    return res;
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::planSegments
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::planSegments(float seg_duration, const std::vector<float>& segmentPoints, const WriteOptions& options)
+{
+    const InputStream* input = input_stream;
+    bool               has_video = input->video_track != NULL;
+    const SampleIndex& main_index = has_video ? input->video_index : input->audio_index;
+    AP4_Track*         main_track = has_video ? input->video_track : input->audio_track;
+    const SampleIndex& audio_index = input->audio_index;
+    if (main_index.GetSampleCount() == 0) return AP4_ERROR_NOT_SUPPORTED;
+    if (has_video && input->audio_track && audio_index.GetSampleCount() == 0) return AP4_ERROR_NOT_SUPPORTED;
+
+    // TS size of a sample, the PCR goes with the video, or with the audio when there is no video
+    auto audio_packetized_size = [this, has_video](AP4_Ordinal i) -> AP4_UI64 {
+        AP4_UI64 payload_size = audio_stream->GetPayloadSize(input_stream->audio_index.GetSize(i), input_stream->audio_index.GetDescriptionIndex(i));
+        return (AP4_UI64)TsPacketizer::GetPacketCount(payload_size, false, !has_video)*AP4_MPEG2TS_PACKET_SIZE;
+    };
+    auto video_packetized_size = [this](AP4_Ordinal i) -> AP4_UI64 {
+        const SampleIndex& index = input_stream->video_index;
+        AP4_UI64 payload_size = video_stream->GetPayloadSize(index.GetSize(i), index.IsSync(i), index.GetDescriptionIndex(i));
+        return (AP4_UI64)TsPacketizer::GetPacketCount(payload_size, true, true)*AP4_MPEG2TS_PACKET_SIZE;
+    };
+
+    plan = SegmentPlan();
+    SegmentPlan::Segment segment = {};
+    bool     open = false;
+    double   last_ts = 0.0;
+    AP4_UI64 dts = main_index.GetDts(0);
+    AP4_Ordinal  audio_sample = 0;
+    AP4_Cardinal audio_sample_count = (has_video && input->audio_track) ? audio_index.GetSampleCount() : 0;
+    AP4_UI64     audio_dts = audio_sample_count ? audio_index.GetDts(0) : 0;
+    std::vector<double>   keyframe_times;
+    std::vector<AP4_UI64> keyframe_sizes;
+    auto add_audio_sample = [&]() {
+        segment.audio_count++;
+        segment.payload_size   += audio_index.GetSize(audio_sample);
+        segment.predicted_size += audio_packetized_size(audio_sample);
+        audio_dts += audio_index.GetDuration(audio_sample);
+        audio_sample++;
+        open = true;
+    };
+    for (AP4_Ordinal i = 0; i < main_index.GetSampleCount(); i++) {
+        double ts = (double)dts/main_track->GetMediaTimeScale();
+
+        // audio samples strictly before the video sample are written first
+        while (audio_sample < audio_sample_count && (double)audio_dts/input->audio_track->GetMediaTimeScale() < ts) {
+            add_audio_sample();
+        }
+
+        bool sync = has_video ? main_index.IsSync(i) : true;
+        if (seg_duration && sync && IsSegmentBoundary(has_video, ts, last_ts, seg_duration, segmentPoints)) {
+            if (open) {
+                segment.duration = ts-last_ts;
+                plan.segments.push_back(segment);
+                segment = SegmentPlan::Segment();
+                segment.video_start = has_video ? i : 0;
+                segment.audio_start = has_video ? audio_sample : i;
+            }
+            segment.start = ts;
+            last_ts = ts;
+        }
+
+        if (has_video) {
+            segment.video_count++;
+        } else {
+            segment.audio_count++;
+        }
+        segment.payload_size   += main_index.GetSize(i);
+        segment.predicted_size += has_video ? video_packetized_size(i) : audio_packetized_size(i);
+        if (has_video && sync) {
+            keyframe_times.push_back(ts);
+            keyframe_sizes.push_back(video_packetized_size(i));
+        }
+        open = true;
+        if (i+1 < main_index.GetSampleCount()) dts += main_index.GetDuration(i);
+    }
+    while (audio_sample < audio_sample_count) add_audio_sample();
+
+    // the last segment ends at the DTS of the last sample of the main track
+    segment.duration = (double)dts/main_track->GetMediaTimeScale()-last_ts;
+    plan.segments.push_back(segment);
+    for (SegmentPlan::Segment& planned : plan.segments) {
+        // PAT and PMT, and the PKCS7 padding of encrypted segments
+        planned.predicted_size += psi_packets.GetDataSize();
+        if (options.encryption) planned.predicted_size += 16-planned.predicted_size%16;
+    }
+
+    // the I-frame playlist, where each I-frame lasts until the next one or the end of the video
+    if (has_video && options.iframe_playlist && options.encryption == NULL && keyframe_times.size()) {
+        double   video_end = (double)(dts+main_index.GetDuration(main_index.GetSampleCount()-1))/main_track->GetMediaTimeScale();
+        AP4_UI64 keyframes_total_size = 0;
+        for (unsigned int i = 0; i < keyframe_times.size(); i++) {
+            double duration = (i+1 < keyframe_times.size() ? keyframe_times[i+1] : video_end)-keyframe_times[i];
+            if (duration > 0.0 && 8.0*keyframe_sizes[i]/duration > plan.iframe_max_bitrate) {
+                plan.iframe_max_bitrate = 8.0*keyframe_sizes[i]/duration;
+            }
+            keyframes_total_size += keyframe_sizes[i];
+        }
+        if (video_end > keyframe_times[0]) {
+            plan.iframe_average_bitrate = 8.0*keyframes_total_size/(video_end-keyframe_times[0]);
+        }
+        plan.iframe_count = keyframe_times.size();
+    }
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::planContinuityCounters
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::planContinuityCounters()
+{
+    const InputStream*  input = input_stream;
+    bool                has_video = input->video_track != NULL;
+    IndexedSampleReader video_reader(input->video_index, *input->input);
+    AP4_Sample          sample;
+    AP4_DataBuffer      sample_data;
+    AP4_UI64            video_packets = 0;
+    AP4_UI64            audio_packets = 0;
+    for (SegmentPlan::Segment& segment : plan.segments) {
+        segment.video_continuity_counter = (AP4_UI08)(video_packets & 0x0F);
+        segment.audio_continuity_counter = (AP4_UI08)(audio_packets & 0x0F);
+        for (AP4_Cardinal i = 0; has_video && i < segment.video_count; i++) {
+            AP4_Result result = video_reader.ReadSample(sample, sample_data, NULL);
+            if (AP4_FAILED(result)) return result;
+            AP4_UI64 payload_size = 0;
+            result = video_stream->GetPayloadSize(sample, sample_data, payload_size);
+            if (AP4_FAILED(result)) return result;
+            video_packets += TsPacketizer::GetPacketCount(payload_size, true, true);
+        }
+        for (AP4_Ordinal i = segment.audio_start; audio_stream && i < segment.audio_start+segment.audio_count; i++) {
+            AP4_UI64 payload_size = audio_stream->GetPayloadSize(input->audio_index.GetSize(i), input->audio_index.GetDescriptionIndex(i));
+            audio_packets += TsPacketizer::GetPacketCount(payload_size, false, !has_video);
+        }
+    }
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::writePlanFile
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::writePlanFile(const std::vector<OutputStream*>& output_streams, std::filesystem::path path)
+{
+    std::string content;
+    char        line[1024];
+    content += "# mov2hls plan\n";
+    for (OutputStream* os : output_streams) {
+        sprintf(line, "rendition %u %u %u %u\n", os->index, (unsigned int)os->plan.segments.size(),
+                os->input_stream->video_index.GetSampleCount(), os->input_stream->audio_index.GetSampleCount());
+        content += line;
+        for (const SegmentPlan::Segment& segment : os->plan.segments) {
+            sprintf(line, "segment %.17g %.17g %u %u %u %u %u %u\n", segment.start, segment.duration,
+                    segment.video_start, segment.video_count, segment.audio_start, segment.audio_count,
+                    segment.video_continuity_counter, segment.audio_continuity_counter);
+            content += line;
+        }
+    }
+    return WriteOutputAtomically(path.parent_path(), path.filename().string().c_str(), content);
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::readPlanFile
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::readPlanFile(const std::vector<OutputStream*>& output_streams, std::filesystem::path path)
+{
+    std::string content;
+    AP4_Result  result = ReadTextFile(path, content);
+    if (AP4_FAILED(result)) return result;
+
+    std::istringstream lines(content);
+    std::string        line;
+    OutputStream*      os = NULL;
+    unsigned int       segment_count = 0;
+    unsigned int       rendition_count = 0;
+    while (std::getline(lines, line)) {
+        unsigned int index, video_sample_count, audio_sample_count;
+        unsigned int video_start, video_count, audio_start, audio_count, video_cc, audio_cc;
+        SegmentPlan::Segment segment = {};
+        if (line.empty() || line[0] == '#') continue;
+        if (sscanf(line.c_str(), "rendition %u %u %u %u", &index, &segment_count, &video_sample_count, &audio_sample_count) == 4) {
+            if (os && os->plan.segments.size() != segment_count) return AP4_ERROR_INVALID_FORMAT;
+            if (index != rendition_count || index >= output_streams.size()) return AP4_ERROR_INVALID_FORMAT;
+            os = output_streams[index];
+            if (os->input_stream->video_index.GetSampleCount() != video_sample_count ||
+                os->input_stream->audio_index.GetSampleCount() != audio_sample_count) {
+                return AP4_ERROR_INVALID_FORMAT;
+            }
+            os->plan = SegmentPlan();
+            rendition_count++;
+        } else if (os && sscanf(line.c_str(), "segment %lf %lf %u %u %u %u %u %u", &segment.start, &segment.duration,
+                                &video_start, &video_count, &audio_start, &audio_count, &video_cc, &audio_cc) == 8) {
+            segment.video_start              = video_start;
+            segment.video_count              = video_count;
+            segment.audio_start              = audio_start;
+            segment.audio_count              = audio_count;
+            segment.video_continuity_counter = (AP4_UI08)(video_cc & 0x0F);
+            segment.audio_continuity_counter = (AP4_UI08)(audio_cc & 0x0F);
+            os->plan.segments.push_back(segment);
+        } else {
+            return AP4_ERROR_INVALID_FORMAT;
+        }
+    }
+    if (os && os->plan.segments.size() != segment_count) return AP4_ERROR_INVALID_FORMAT;
+    return rendition_count == output_streams.size() ? AP4_SUCCESS : AP4_ERROR_INVALID_FORMAT;
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::getPlanJson
++---------------------------------------------------------------------*/
+std::string
+OutputStream::getPlanJson(std::vector<OutputStream*> output_streams, double segment_duration, const std::vector<float>& segment_points)
+{
+    JsonWriter json;
+    json.BeginObject();
+    json.Key("segment_duration");
+    json.Number(segment_duration);
+    json.Key("segment_points");
+    json.BeginArray();
+    for (float point : segment_points) json.Number(point);
+    json.EndArray();
+
+    json.Key("renditions");
+    json.BeginArray();
+    std::for_each(output_streams.begin(), output_streams.end(), [&json](OutputStream* os) {
+        const SegmentPlan& plan = os->plan;
+        AP4_UI64 predicted_total_size = 0;
+        for (const SegmentPlan::Segment& segment : plan.segments) predicted_total_size += segment.predicted_size;
+        json.BeginObject();
+        json.Key("input");
+        json.String(os->input_stream->file_path);
+        json.Key("output");
+        json.String(os->out_folder.filename().string());
+        json.Key("codecs");
+        json.String(os->stats.codecs);
+        json.Key("resolution");
+        json.String(os->stats.resolution);
+        json.Key("target_duration");
+        json.Integer(GetTargetDuration(plan.GetDurations()));
+        json.Key("segment_count");
+        json.Integer(plan.segments.size());
+        json.Key("predicted_total_size");
+        json.Integer(predicted_total_size);
+        json.Key("predicted_average_bitrate");
+        json.Number(plan.GetAverageBitrate());
+        json.Key("predicted_max_bitrate");
+        json.Number(plan.GetMaxBitrate());
+        json.Key("segments");
+        json.BeginArray();
+        for (const SegmentPlan::Segment& segment : plan.segments) {
+            json.BeginObject();
+            json.Key("start");
+            json.Number(segment.start);
+            json.Key("duration");
+            json.Number(segment.duration);
+            json.Key("video_samples");
+            json.Integer(segment.video_count);
+            json.Key("audio_samples");
+            json.Integer(segment.audio_count);
+            json.Key("payload_size");
+            json.Integer(segment.payload_size);
+            json.Key("predicted_size");
+            json.Integer(segment.predicted_size);
+            json.EndObject();
+        }
+        json.EndArray();
+        json.EndObject();
+    });
+    json.EndArray();
+    json.EndObject();
+    return json.GetString();
+}
+
+}
@@ -0,0 +1,99 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENTO5_PLAN_H_
+#define _BENTO5_PLAN_H_
+
+#include <vector>
+#include "Ap4.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   functions
++---------------------------------------------------------------------*/
+// the segmenting rule: inputs with video are cut at the keyframes close to one of the aligned
+// segment points, audio-only inputs every seg_duration. Only asked for sync samples.
+bool IsSegmentBoundary(bool has_video, double ts, double last_ts, float seg_duration, const std::vector<float>& segment_points);
+
+unsigned int GetTargetDuration(const std::vector<double>& segment_durations);
+
+// the keyframe times common to every input, then those of them that are at least segment_duration apart
+std::vector<float> findAlignedDTS(std::vector<std::vector<float>> array);
+std::vector<float> filterDTSBySegmentDuration(std::vector<float> array, float segment_duration);
+
+/*----------------------------------------------------------------------
+|   SegmentPlan
++---------------------------------------------------------------------*/
+// the segments write_samples will produce, worked out from the sample indexes alone
+class SegmentPlan {
+public:
+    struct Segment {
+        double       start;
+        double       duration;
+        AP4_Ordinal  video_start;
+        AP4_Cardinal video_count;
+        AP4_Ordinal  audio_start;
+        AP4_Cardinal audio_count;
+        AP4_UI64     payload_size;
+        // TS size, exact for the audio, for the video as if the frames were single NAL units. With
+        // 4-byte NAL lengths that overestimates the video: each NAL unit after the first one loses
+        // a byte to its 3-byte start code, and delimiters in the samples are dropped. Shorter
+        // lengths, or in-band parameter sets missing from a keyframe, can make it underestimate.
+        AP4_UI64     predicted_size;
+        AP4_UI08     video_continuity_counter; // of the first packets of the segment, from planContinuityCounters
+        AP4_UI08     audio_continuity_counter;
+    };
+
+    std::vector<double> GetDurations() const {
+        std::vector<double> durations;
+        for (const Segment& segment : segments) durations.push_back(segment.duration);
+        return durations;
+    }
+    double GetMaxBitrate() const {
+        double max_bitrate = 0.0;
+        for (const Segment& segment : segments) {
+            if (segment.duration > 0.0 && 8.0*segment.predicted_size/segment.duration > max_bitrate) {
+                max_bitrate = 8.0*segment.predicted_size/segment.duration;
+            }
+        }
+        return max_bitrate;
+    }
+    double GetAverageBitrate() const {
+        AP4_UI64 total_size = 0;
+        double   total_duration = 0.0;
+        for (const Segment& segment : segments) {
+            total_size     += segment.predicted_size;
+            total_duration += segment.duration;
+        }
+        return total_duration > 0.0 ? 8.0*total_size/total_duration : 0.0;
+    }
+
+    SegmentPlan() : iframe_count(0), iframe_max_bitrate(0.0), iframe_average_bitrate(0.0) {}
+
+    std::vector<Segment> segments;
+    AP4_UI32             iframe_count; // entries of the I-frame playlist, 0 when there is none
+    double               iframe_max_bitrate;
+    double               iframe_average_bitrate;
+};
+
+}
+
+#endif // _BENTO5_PLAN_H_
@@ -0,0 +1,1055 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <cmath>
+#include <map>
+#include <algorithm>
+#include "Bento5Rendition.h"
+#include "Bento5Committer.h"
+#include "Bento5Crypto.h"
+#include "Bento5FragmentDemuxer.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   OutputStream::createStreams
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::createStreams(std::string& error)
+{
+    const InputStream* input = input_stream;
+    // create an MPEG2 TS Writer, for the PAT and PMT
+    AP4_Mpeg2TsWriter ts_writer(PMT_PID);
+    // add the audio stream
+    if (input->audio_track) {
+        AP4_Result result = CreateAudioStream(ts_writer, *input->audio_track, audio_stream);
+        if (result == AP4_ERROR_INVALID_FORMAT) {
+            error = "unable to parse audio sample description of "+input->file_path;
+            return result;
+        } else if (result == AP4_ERROR_NOT_SUPPORTED) {
+            error = "audio codec not supported for "+input->file_path;
+            return result;
+        } else if (AP4_FAILED(result)) {
+            error = "could not create audio stream of "+input->file_path;
+            return result;
+        }
+    }
+
+    // add the video stream
+    if (input->video_track) {
+        AP4_SampleDescription *sample_description = input->video_track->GetSampleDescription(0);
+        if (sample_description == NULL) {
+            error = "unable to parse video sample description of "+input->file_path;
+            return AP4_ERROR_INVALID_FORMAT;
+        }
+
+        // decide on the stream type
+        unsigned int stream_type = 0;
+        unsigned int stream_id   = AP4_MPEG2_TS_DEFAULT_STREAM_ID_VIDEO;
+        if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_AVC1 ||
+                sample_description->GetFormat() == AP4_SAMPLE_FORMAT_AVC2 ||
+                sample_description->GetFormat() == AP4_SAMPLE_FORMAT_AVC3 ||
+                sample_description->GetFormat() == AP4_SAMPLE_FORMAT_AVC4 ||
+                sample_description->GetFormat() == AP4_SAMPLE_FORMAT_DVAV ||
+                sample_description->GetFormat() == AP4_SAMPLE_FORMAT_DVA1) {
+            stream_type = AP4_MPEG2_STREAM_TYPE_AVC;
+        } else if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_HEV1 ||
+                   sample_description->GetFormat() == AP4_SAMPLE_FORMAT_HVC1 ||
+                   sample_description->GetFormat() == AP4_SAMPLE_FORMAT_DVHE ||
+                   sample_description->GetFormat() == AP4_SAMPLE_FORMAT_DVH1) {
+            stream_type = AP4_MPEG2_STREAM_TYPE_HEVC;
+        } else {
+            error = "video codec not supported for "+input->file_path;
+            return AP4_ERROR_NOT_SUPPORTED;
+        }
+
+        // setup the video stream, the one of the TS writer is only there for the PMT
+        AP4_Mpeg2TsWriter::SampleStream* pmt_stream = NULL;
+        AP4_Result result = ts_writer.SetVideoStream(input->video_track->GetMediaTimeScale(),
+                                                     stream_type,
+                                                     stream_id,
+                                                     pmt_stream,
+                                                     VIDEO_PID,
+                                                     NULL, 0,
+                                                     AP4_MPEG2_TS_DEFAULT_PCR_OFFSET);
+        if (AP4_FAILED(result)) {
+            error = "could not create video stream of "+input->file_path;
+            return result;
+        }
+        result = AnnexBVideoStream::Create(*input->video_track,
+                                           stream_type,
+                                           VIDEO_PID,
+                                           stream_id,
+                                           AP4_MPEG2_TS_DEFAULT_PCR_OFFSET,
+                                           video_stream);
+        if (AP4_FAILED(result)) {
+            error = "unable to parse video sample description of "+input->file_path;
+            return result;
+        }
+    }
+
+    // the PAT and PMT never change, only their continuity counters
+    AP4_MemoryByteStream* psi = new AP4_MemoryByteStream();
+    ts_writer.WritePAT(*psi);
+    ts_writer.WritePMT(*psi);
+    psi_packets.SetData(psi->GetData(), psi->GetDataSize());
+    psi->Release();
+
+    setCodecs();
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::createOutputFolder
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::createOutputFolder(std::string& error, bool reuse)
+{
+    if (reuse && std::filesystem::is_directory(out_folder)) return AP4_SUCCESS;
+    std::error_code create_error;
+    if (bool flag = std::filesystem::create_directories(out_folder, create_error); flag == false) {
+        error = "failed to create output folder at "+std::filesystem::absolute(out_folder).string()+", maybe it already exists?";
+        return AP4_ERROR_CANNOT_OPEN_FILE;
+    }
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::writeMediaPlaylist
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::writeMediaPlaylist(OutputStream* output, const std::vector<double>& segment_durations, bool ended, const WriteOptions& options)
+{
+    char         string_buffer[4096];
+    std::string  playlist;
+    unsigned int target_duration = GetTargetDuration(segment_durations);
+    if (options.publish_every) {
+        unsigned int planned_target_duration = GetTargetDuration(output->plan.GetDurations());
+        if (ended && target_duration > planned_target_duration) {
+            LogWarning("target duration of %s is %u, %u was planned", output->out_folder.string().c_str(), target_duration, planned_target_duration);
+        }
+        target_duration = std::max(target_duration, planned_target_duration);
+    }
+
+    playlist += "#EXTM3U\r\n";
+    sprintf(string_buffer, "#EXT-X-VERSION:%d\r\n", 3);
+    playlist += string_buffer;
+    playlist += options.publish_every ? "#EXT-X-PLAYLIST-TYPE:EVENT\r\n" : "#EXT-X-PLAYLIST-TYPE:VOD\r\n";
+    if (output->input_stream->video_track) {
+        playlist += "#EXT-X-INDEPENDENT-SEGMENTS\r\n";
+    }
+    playlist += "#EXT-X-TARGETDURATION:";
+    sprintf(string_buffer, "%d\r\n", target_duration);
+    playlist += string_buffer;
+    playlist += "#EXT-X-MEDIA-SEQUENCE:0\r\n";
+    if (options.encryption) {
+        sprintf(string_buffer, "#EXT-X-KEY:METHOD=AES-128,URI=\"%s\"\r\n", options.encryption->uri.c_str());
+        playlist += string_buffer;
+    }
+
+    for (unsigned int i=0; i<segment_durations.size(); i++) {
+        sprintf(string_buffer, "#EXTINF:%f,\r\n", segment_durations[i]);
+        playlist += string_buffer;
+        sprintf(string_buffer, SEGMENT_FILENAME_TEMPLATE, i);
+        playlist += string_buffer;
+        playlist += "\r\n";
+    }
+
+    if (ended) playlist += "#EXT-X-ENDLIST\r\n";
+
+    // the segments go in place before the playlist that lists them
+    if (options.committer) {
+        AP4_Result result = options.committer->Flush();
+        if (AP4_FAILED(result)) return result;
+    }
+    return WriteOutputAtomically(output->out_folder, INDEX_FILENAME, playlist, options.committer != NULL, options.sink);
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::write_samples
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::write_samples(OutputStream *output, float seg_duration, std::vector<float> segmentPoints, const WriteOptions& options)
+{
+    AP4_Sample              audio_sample;
+    AP4_DataBuffer          audio_sample_data;
+    unsigned int            audio_sample_count = 0;
+    AP4_Ordinal             audio_sample_index = 0;
+    double                  audio_ts = 0.0;
+    double                  audio_frame_duration = 0.0;
+    bool                    audio_eos = false;
+    AP4_Sample              video_sample;
+    AP4_DataBuffer          video_sample_data;
+    AP4_DataBuffer          sample_packets; // TS packets of the current sample
+    unsigned int            video_sample_count = 0;
+    AP4_Ordinal             video_sample_index = 0;
+    double                  video_ts = 0.0;
+    double                  video_frame_duration = 0.0;
+    bool                    video_eos = false;
+    double                  last_ts = 0.0;
+    unsigned int            segment_number = 0;
+    char                    segment_filename[64];
+    AP4_ByteStream*         segment_output = NULL;
+    ByteStreamReleaser      segment_output_releaser(segment_output);
+    ChecksumByteStream*     segment_checksum = NULL;
+    EncryptingByteStream*   segment_encryption = NULL;
+    bool                    segment_preallocated = false;
+    double                  segment_duration = 0.0;
+    std::vector<double>     segment_durations;
+    AP4_Array<AP4_UI32>     segment_sizes;
+    AP4_Position            segment_position = 0;
+    AP4_Array<AP4_Position> segment_positions;
+    std::vector<IFrame>     iframes;
+    bool                    new_segment = true;
+    const EncryptionKey*    encryption = options.encryption;
+    AP4_Result              result = AP4_SUCCESS;
+
+    SegmentArena            arena;
+
+    // durable segments only get their name once they are on disk
+    std::string segment_filename_template = std::string(SEGMENT_FILENAME_TEMPLATE)+(options.committer ? ".tmp" : "");
+
+    const InputStream *input = output->input_stream;
+    TraceRecorder*     recorder = TraceRecorder::Instance.load();
+    TraceSpan          rendition_span("rendition", "mux", "index", output->index);
+    double             segment_start = 0.0;
+
+    StageStats* read_stage      = options.profile ? &output->stats.stages[STAGE_SAMPLE_READ] : NULL;
+    StageStats* packetize_stage = options.profile ? &output->stats.stages[STAGE_PACKETIZE] : NULL;
+    StageStats* write_stage     = options.profile ? &output->stats.stages[STAGE_WRITE] : NULL;
+    IoCounters  loop_io_start;
+    if (options.profile) loop_io_start = IoCounters::Sample();
+
+    AP4_Cardinal keyframe_count = 0;
+    for (AP4_Ordinal i = 0; i < input->video_index.GetSampleCount(); i++) {
+        if (input->video_index.IsSync(i)) keyframe_count++;
+    }
+    iframes.reserve(keyframe_count);
+
+    // the written segments are journaled, unless a sink keeps the files
+    SegmentJournal                     journal;
+    std::vector<SegmentJournal::Entry> journaled;
+    AP4_Cardinal                       journaled_iframe_count = 0;
+    bool                               journaling = options.shard_count == 0 && options.sink == NULL;
+    if (journaling) {
+        bool   ended = false;
+        double video_end = 0.0;
+        std::string fingerprint = getJournalFingerprint(output, seg_duration, segmentPoints, options);
+        if (options.resume) {
+            result = loadJournal(output, options, fingerprint, journaled, iframes, ended, video_end);
+            if (AP4_FAILED(result)) return result;
+        }
+        for (const SegmentJournal::Entry& entry : journaled) {
+            segment_durations.push_back(entry.duration);
+            segment_sizes.Append(entry.size);
+            if (options.checksums) output->stats.segment_checksums.push_back(entry.checksum);
+        }
+        if (ended) {
+            output->stats.stages[STAGE_OPEN]          = input->open_stage;
+            output->stats.stages[STAGE_KEYFRAME_SCAN] = input->keyframe_scan_stage;
+            return finishRendition(output, segment_durations, segment_sizes, iframes, video_end, options);
+        }
+        result = journal.Open(output->out_folder/JOURNAL_FILENAME, journaled.size() ? journaled.back().journal_end : 0);
+        if (AP4_SUCCEEDED(result) && journaled.empty()) result = journal.AppendFingerprint(fingerprint);
+        if (AP4_FAILED(result)) return result;
+        journaled_iframe_count = iframes.size();
+
+        // the published playlist of a resumed rendition starts with the segments kept
+        if (options.resume && options.publish_every) {
+            result = writeMediaPlaylist(output, segment_durations, false, options);
+            if (AP4_FAILED(result)) return result;
+        }
+    }
+
+    // a shard starts at its first planned segment, a resumed rendition after its journal
+    SegmentPlan::Segment start = {};
+    unsigned int         end_segment = 0;
+    if (options.shard_count) {
+        unsigned int plan_size = output->plan.segments.size();
+        segment_number = (options.shard_index-1)*plan_size/options.shard_count;
+        end_segment    = options.shard_index*plan_size/options.shard_count;
+        if (segment_number >= end_segment) return AP4_ERROR_INVALID_PARAMETERS;
+        start = output->plan.segments[segment_number];
+    } else if (journaled.size()) {
+        const SegmentJournal::Entry& last = journaled.back();
+        segment_number                 = journaled.size();
+        start.start                    = last.next_start;
+        start.video_start              = last.next_video_sample;
+        start.audio_start              = last.next_audio_sample;
+        start.video_continuity_counter = last.video_continuity_counter;
+        start.audio_continuity_counter = last.audio_continuity_counter;
+    }
+    if (segment_number) {
+        if (input->audio_reader) result = input->audio_reader->SeekSample(start.audio_start);
+        if (input->video_reader && AP4_SUCCEEDED(result)) result = input->video_reader->SeekSample(start.video_start);
+        if (AP4_FAILED(result)) {
+            LogError("cannot start %s at segment %u", output->out_folder.string().c_str(), segment_number);
+            return result;
+        }
+        if (output->video_stream) output->video_stream->GetPacketizer().SetContinuityCounter(start.video_continuity_counter);
+        if (output->audio_stream) output->audio_stream->GetPacketizer().SetContinuityCounter(start.audio_continuity_counter);
+        output->audio_continuity_counter = start.audio_continuity_counter;
+        audio_sample_index = start.audio_start;
+        video_sample_index = start.video_start;
+        last_ts            = start.start;
+    }
+
+    // prime the samples
+    if (input->audio_reader) {
+        StageTimer timer(read_stage);
+        result = ReadSample(*input->audio_reader, *input->audio_track, audio_sample, audio_sample_data, &arena, audio_ts, audio_frame_duration, audio_eos);
+        if (AP4_FAILED(result)) return result;
+    }
+    if (input->video_reader) {
+        StageTimer timer(read_stage);
+        result = ReadSample(*input->video_reader, *input->video_track, video_sample, video_sample_data, &arena, video_ts, video_frame_duration, video_eos);
+        if (AP4_FAILED(result)) return result;
+    }
+
+    for (;;) {
+        bool sync_sample = false;
+        AP4_Track* chosen_track= NULL;
+        if (input->audio_track && !audio_eos) {
+            chosen_track = input->audio_track;
+            if (input->video_track == NULL) sync_sample = true;
+        }
+        if (input->video_track && !video_eos) {
+            if (input->audio_track) {
+                if (video_ts <= audio_ts) {
+                    chosen_track = input->video_track;
+                }
+            } else {
+                chosen_track = input->video_track;
+            }
+            if (chosen_track == input->video_track && video_sample.IsSync()) {
+                sync_sample = true;
+            }
+        }
+
+        // check if we need to start a new segment
+        if (seg_duration && (sync_sample || chosen_track == NULL)) {
+            if (input->video_track) {
+                segment_duration = video_ts - last_ts;
+            } else {
+                segment_duration = audio_ts - last_ts;
+            }
+            if ((chosen_track && IsSegmentBoundary(input->video_track != NULL, input->video_track ? video_ts : audio_ts, last_ts, seg_duration, segmentPoints))
+                 || chosen_track == NULL) {
+                if (input->video_track) {
+                    last_ts = video_ts;
+                } else {
+                    last_ts = audio_ts;
+                }
+                if (segment_output) {
+                    StageTimer timer(write_stage);
+
+                    // write the padded last block of an encrypted segment
+                    if (segment_encryption) {
+                        result = segment_encryption->Finish();
+                        if (AP4_FAILED(result)) return result;
+                        segment_encryption = NULL;
+                    }
+
+                    // flush the output stream
+                    {
+                        TraceSpan span("Flush", "io");
+                        segment_output->Flush();
+                    }
+
+                    // compute the segment size (including padding)
+                    AP4_Position segment_end = 0;
+                    segment_output->Tell(segment_end);
+                    AP4_UI32 segment_size = 0;
+                    if (segment_end > segment_position) {
+                        segment_size = (AP4_UI32)(segment_end-segment_position);
+                    }
+
+                    // update counters
+                    segment_sizes.Append(segment_size);
+                    segment_positions.Append(segment_position);
+                    segment_durations.push_back(segment_duration);
+                    if (segment_checksum) {
+                        output->stats.segment_checksums.push_back(segment_checksum->Finish());
+                        segment_checksum = NULL;
+                    }
+                    {
+                        TraceSpan span("Release", "io");
+                        segment_output->Release();
+                    }
+                    segment_output = NULL;
+                    if (segment_preallocated) {
+                        result = TrimOutput(output->out_folder, segment_filename, segment_end);
+                        if (AP4_FAILED(result)) return result;
+                        segment_preallocated = false;
+                    }
+                    if (options.committer) {
+                        char filename[64];
+                        sprintf(filename, SEGMENT_FILENAME_TEMPLATE, segment_number);
+                        options.committer->Commit(output->out_folder/(std::string(filename)+".tmp"), output->out_folder/filename);
+                    }
+
+                    if (journaling) {
+                        SegmentJournal::Entry entry = {};
+                        entry.number                   = segment_number;
+                        entry.size                     = segment_size;
+                        entry.duration                 = segment_duration;
+                        entry.has_checksum             = options.checksums;
+                        if (entry.has_checksum) entry.checksum = output->stats.segment_checksums.back();
+                        entry.next_video_sample        = video_sample_index;
+                        entry.next_audio_sample        = audio_sample_index;
+                        entry.video_continuity_counter = output->video_stream ? output->video_stream->GetPacketizer().GetContinuityCounter() : 0;
+                        entry.audio_continuity_counter = output->shared_audio ? output->audio_continuity_counter :
+                                                         output->audio_stream ? output->audio_stream->GetPacketizer().GetContinuityCounter() : 0;
+                        entry.next_start               = last_ts;
+                        result = journal.Append(entry, iframes.data()+journaled_iframe_count, iframes.size()-journaled_iframe_count);
+                        if (AP4_FAILED(result)) return result;
+                        journaled_iframe_count = iframes.size();
+                    }
+
+                    // the samples read ahead move to the start of the arena
+                    sample_packets.SetDataSize(0);
+                    arena.Reset();
+
+                    if (recorder) recorder->AddSpan("segment", "mux", segment_start, recorder->Now(), "segment", segment_number);
+                    if (options.listener) options.listener->OnSegmentWritten(output->index, segment_number, output->plan.segments.size());
+
+                    ++segment_number;
+                    audio_sample_count = 0;
+                    video_sample_count = 0;
+
+                    // make the new segments available to the players
+                    if (options.publish_every && segment_number % options.publish_every == 0 && chosen_track) {
+                        TraceSpan span("publish", "playlist");
+                        result = writeMediaPlaylist(output, segment_durations, false, options);
+                        if (AP4_FAILED(result)) return result;
+                    }
+
+                    // the next shard takes over from here
+                    if (segment_number == end_segment) chosen_track = NULL;
+                }
+                new_segment = true;
+            }
+        }
+
+        // check if we're done
+        if (chosen_track == NULL) break;
+
+        if (new_segment) {
+            new_segment = false;
+
+            // compute the new segment position
+            segment_position = 0;
+            if (recorder) segment_start = recorder->Now();
+
+            StageTimer timer(write_stage);
+
+            // manage the new segment stream
+            if (segment_output == NULL) {
+                // the plan mostly overestimates the video, the margin covers the rest
+                AP4_UI64 preallocate_size = 0;
+                if (options.preallocate && segment_number < output->plan.segments.size()) {
+                    AP4_UI64 predicted_size = output->plan.segments[segment_number].predicted_size;
+                    preallocate_size = predicted_size+predicted_size/16;
+                }
+                sprintf(segment_filename, segment_filename_template.c_str(), segment_number);
+                segment_output = OpenOutput(output->out_folder, segment_filename, options.direct_io ? &output->stats.direct_written_size : NULL,
+                                            preallocate_size, options.sink);
+                segment_preallocated = preallocate_size != 0;
+                if (segment_output == NULL) return AP4_ERROR_CANNOT_OPEN_FILE;
+
+                // hash the segment while it is being written
+                if (options.checksums) {
+                    segment_checksum = new ChecksumByteStream(segment_output);
+                    segment_output->Release();
+                    segment_output = segment_checksum;
+                }
+
+                // encrypt the segment before it reaches the file (and the hashes)
+                if (encryption) {
+                    AP4_UI08 iv[16];
+                    EncryptionKey::GetSegmentIV(segment_number, iv);
+                    segment_encryption = new EncryptingByteStream(segment_output, encryption->encrypter, iv);
+                    segment_output->Release();
+                    segment_output = segment_encryption;
+                }
+            }
+
+            // write the PAT and PMT, their continuity counters advance once per segment
+            AP4_UI08* psi = output->psi_packets.UseData();
+            for (AP4_Size offset = 0; offset+AP4_MPEG2TS_PACKET_SIZE <= output->psi_packets.GetDataSize(); offset += AP4_MPEG2TS_PACKET_SIZE) {
+                psi[offset+3] = (psi[offset+3] & 0xF0) | (segment_number & 0x0F);
+            }
+            result = segment_output->Write(psi, output->psi_packets.GetDataSize());
+            if (AP4_FAILED(result)) return result;
+        }
+
+        // the packets of a sample are only staged when profiling
+        AP4_ByteStream* packet_output = options.profile ? NULL : segment_output;
+        AP4_UI64        allocations = AllocationCounter::Get();
+        if (chosen_track == input->audio_track) {
+
+            // write the sample data
+            if (output->shared_audio) {
+                StageTimer timer(packetize_stage);
+                result = output->shared_audio->CopySample(audio_sample_index, sample_packets, &arena, output->audio_continuity_counter, packet_output);
+            } else if (output->audio_stream) {
+                StageTimer timer(packetize_stage);
+                sample_packets.SetDataSize(0);
+                result = output->audio_stream->WriteSample(audio_sample, audio_sample_data, input->video_track==NULL, sample_packets, &arena, packet_output);
+            } else {
+                return AP4_ERROR_INTERNAL;
+            }
+            if (AP4_FAILED(result)) return result;
+            if (packet_output == NULL) {
+                result = write_sample_packets(*segment_output, sample_packets, write_stage);
+                if (AP4_FAILED(result)) return result;
+            }
+            output->stats.payload_size += audio_sample.GetSize();
+
+            StageTimer timer(read_stage);
+            result = ReadSample(*input->audio_reader, *input->audio_track, audio_sample, audio_sample_data, &arena, audio_ts, audio_frame_duration, audio_eos);
+            if (AP4_FAILED(result)) return result;
+            ++audio_sample_count;
+            ++audio_sample_index;
+        } else if (chosen_track == input->video_track) {
+            // write the sample data
+            AP4_Position frame_start = 0;
+            segment_output->Tell(frame_start);
+            {
+                StageTimer timer(packetize_stage);
+                sample_packets.SetDataSize(0);
+                result = output->video_stream->WriteSample(video_sample, video_sample_data, true, sample_packets, &arena, packet_output);
+            }
+            if (AP4_FAILED(result)) return result;
+            if (packet_output == NULL) {
+                result = write_sample_packets(*segment_output, sample_packets, write_stage);
+                if (AP4_FAILED(result)) return result;
+            }
+            AP4_Position frame_end = 0;
+            segment_output->Tell(frame_end);
+            if (video_sample.IsSync() && frame_end > frame_start) {
+                IFrame iframe = { segment_number, frame_start, (AP4_UI32)(frame_end-frame_start), video_ts };
+                iframes.push_back(iframe);
+            }
+            output->stats.payload_size += video_sample_data.GetDataSize();
+
+            // read the next sample
+            StageTimer timer(read_stage);
+            result = ReadSample(*input->video_reader, *input->video_track, video_sample, video_sample_data, &arena, video_ts, video_frame_duration, video_eos);
+            if (AP4_FAILED(result)) return result;
+            ++video_sample_count;
+            ++video_sample_index;
+        } else {
+            break;
+        }
+        allocations = AllocationCounter::Get()-allocations;
+        output->stats.sample_allocations += allocations;
+        if (segment_number) output->stats.steady_state_allocations += allocations;
+    }
+    output->stats.arena_size = arena.GetSize();
+    if (input->fragment_demuxer) {
+        output->stats.fragment_peak_buffered_size = input->fragment_demuxer->GetPeakBufferedSize();
+        output->stats.fragment_rereads            = input->fragment_demuxer->GetRereadCount();
+    }
+    if (input->sequential_input) output->stats.input_cache_released = input->sequential_input->GetReleasedSize();
+
+    if (options.profile) {
+        IoCounters loop_io = IoCounters::Delta(loop_io_start, IoCounters::Sample());
+        IoCounters read_io;
+        read_io.bytes_read    = loop_io.bytes_read;
+        read_io.read_syscalls = loop_io.read_syscalls;
+        IoCounters write_io;
+        write_io.bytes_written  = loop_io.bytes_written;
+        write_io.write_syscalls = loop_io.write_syscalls;
+        read_stage->AddIo(read_io);
+        write_stage->AddIo(write_io);
+    }
+
+    // a shard only leaves what --merge needs to finish the rendition
+    output->stats.stages[STAGE_OPEN]          = input->open_stage;
+    output->stats.stages[STAGE_KEYFRAME_SCAN] = input->keyframe_scan_stage;
+    if (options.shard_count) {
+        result = writeShardFile(output, segment_durations, segment_sizes, iframes, video_ts+video_frame_duration, options);
+    } else {
+        if (journaling) result = journal.AppendEnd(video_ts+video_frame_duration);
+        if (AP4_SUCCEEDED(result)) result = finishRendition(output, segment_durations, segment_sizes, iframes, video_ts+video_frame_duration, options);
+    }
+
+    return result;
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::mergeShards
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::mergeShards(OutputStream* output, unsigned int shard_count, const WriteOptions& options)
+{
+    std::vector<double> segment_durations;
+    AP4_Array<AP4_UI32> segment_sizes;
+    std::vector<IFrame> iframes;
+    double              video_end = 0.0;
+    bool                ended = false;
+    for (unsigned int k = 1; k <= shard_count; k++) {
+        char filename[64];
+        sprintf(filename, SHARD_FILENAME_TEMPLATE, k, shard_count);
+        std::string content;
+        AP4_Result  result = ReadTextFile(output->out_folder/filename, content);
+        if (AP4_FAILED(result)) {
+            LogError("cannot read %s", (output->out_folder/filename).string().c_str());
+            return result;
+        }
+
+        std::istringstream lines(content);
+        std::string        line;
+        while (std::getline(lines, line)) {
+            unsigned int       number, size;
+            unsigned long long offset;
+            double             duration, ts;
+            char               crc32c[16], sha256[80];
+            if (sscanf(line.c_str(), "segment %u %u %lf %15s %79s", &number, &size, &duration, crc32c, sha256) == 5) {
+                if (number != segment_durations.size()) {
+                    LogError("%s does not continue at segment %u", filename, (unsigned int)segment_durations.size());
+                    return AP4_ERROR_INVALID_FORMAT;
+                }
+                segment_durations.push_back(duration);
+                segment_sizes.Append(size);
+                if (options.checksums) {
+                    SegmentChecksum checksum;
+                    checksum.crc32c = (AP4_UI32)strtoul(crc32c, NULL, 16);
+                    if (strcmp(crc32c, "-") == 0 || AP4_FAILED(AP4_ParseHex(sha256, checksum.sha256, 32))) {
+                        LogError("%s has no checksums, the shards have to be written with --checksums", filename);
+                        return AP4_ERROR_INVALID_FORMAT;
+                    }
+                    output->stats.segment_checksums.push_back(checksum);
+                }
+            } else if (sscanf(line.c_str(), "iframe %u %llu %u %lf", &number, &offset, &size, &ts) == 4) {
+                IFrame iframe = { number, (AP4_Position)offset, size, ts };
+                iframes.push_back(iframe);
+            } else if (sscanf(line.c_str(), "end %lf", &video_end) == 1) {
+                ended = true;
+            } else if (!line.empty()) {
+                return AP4_ERROR_INVALID_FORMAT;
+            }
+        }
+    }
+    if (!ended) {
+        LogError("the last shard of %s is missing its end", output->out_folder.string().c_str());
+        return AP4_ERROR_INVALID_FORMAT;
+    }
+    return finishRendition(output, segment_durations, segment_sizes, iframes, video_end, options);
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::checkPrediction
++---------------------------------------------------------------------*/
+bool
+OutputStream::checkPrediction() const
+{
+    bool holds = true;
+    if (int(ceil(stats.max_segment_bitrate)) > int(ceil(plan.GetMaxBitrate()))) {
+        LogWarning("BANDWIDTH of %s is %d, %d was predicted", out_folder.string().c_str(), int(ceil(stats.max_segment_bitrate)), int(ceil(plan.GetMaxBitrate())));
+        holds = false;
+    }
+    double average_bitrate = stats.segments_total_duration > 0.0 ? 8.0*stats.segments_total_size/stats.segments_total_duration : 0.0;
+    if (int(ceil(average_bitrate)) > int(ceil(plan.GetAverageBitrate()))) {
+        LogWarning("AVERAGE-BANDWIDTH of %s is %d, %d was predicted", out_folder.string().c_str(), int(ceil(average_bitrate)), int(ceil(plan.GetAverageBitrate())));
+        holds = false;
+    }
+    if (stats.iframe_count != plan.iframe_count || int(ceil(stats.iframe_max_bitrate)) > int(ceil(plan.iframe_max_bitrate)) ||
+        int(ceil(stats.iframe_average_bitrate)) > int(ceil(plan.iframe_average_bitrate))) {
+        LogWarning("I-frame playlist of %s differs from the predicted one", out_folder.string().c_str());
+        holds = false;
+    }
+    return holds;
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::generateMasterPlaylist
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::generateMasterPlaylist(std::vector<OutputStream*> output_streams, std::filesystem::path output_dir, bool predicted, bool durable, OutputSink* sink)
+{
+    std::string playlist;
+    playlist += "#EXTM3U\r\n";
+    playlist += "# Created with Bento5 mov2hls\r\n\r\n";
+    playlist += "# Media Playlists\r\n";
+
+    std::for_each(output_streams.begin(), output_streams.end(), [&playlist, predicted](OutputStream* os) {
+        char string_buffer[4096];
+        double average_bandwidth = predicted ? os->plan.GetAverageBitrate() : 8.0 * os->stats.segments_total_size/os->stats.segments_total_duration;
+        double bandwidth         = predicted ? os->plan.GetMaxBitrate() : os->stats.max_segment_bitrate;
+        sprintf(string_buffer, "#EXT-X-STREAM-INF:AVERAGE-BANDWIDTH=%d,BANDWIDTH=%d,CODECS=\"%s\"", int(ceil(average_bandwidth)), int(ceil(bandwidth)), os->stats.codecs.c_str());
+        playlist += string_buffer;
+        if (os->input_stream->video_track) {
+            sprintf(string_buffer, ",RESOLUTION=%s", os->stats.resolution.c_str());
+            playlist += string_buffer;
+        }
+        playlist += "\r\n";
+        sprintf(string_buffer, "%s/stream.m3u8\r\n", os->out_folder.filename().string().c_str());
+        playlist += string_buffer;
+    });
+
+    auto iframe_count = [predicted](OutputStream* os) { return predicted ? os->plan.iframe_count : os->stats.iframe_count; };
+    if (std::find_if(output_streams.begin(), output_streams.end(), [&iframe_count](OutputStream* os) { return iframe_count(os) > 0; }) != output_streams.end()) {
+        playlist += "\r\n# I-Frame Playlists\r\n";
+        std::for_each(output_streams.begin(), output_streams.end(), [&playlist, &iframe_count, predicted](OutputStream* os) {
+            if (iframe_count(os) == 0) return;
+            char string_buffer[4096];
+            double average_bandwidth = predicted ? os->plan.iframe_average_bitrate : os->stats.iframe_average_bitrate;
+            double bandwidth         = predicted ? os->plan.iframe_max_bitrate : os->stats.iframe_max_bitrate;
+            sprintf(string_buffer, "#EXT-X-I-FRAME-STREAM-INF:AVERAGE-BANDWIDTH=%d,BANDWIDTH=%d,CODECS=\"%s\",RESOLUTION=%s,URI=\"%s/%s\"\r\n",
+                    int(ceil(average_bandwidth)), int(ceil(bandwidth)), os->stats.video_codec.c_str(),
+                    os->stats.resolution.c_str(), os->out_folder.filename().string().c_str(), IFRAME_INDEX_FILENAME);
+            playlist += string_buffer;
+        });
+    }
+    return WriteOutputAtomically(output_dir, "master.m3u8", playlist, durable, sink);
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::getStatsJson
++---------------------------------------------------------------------*/
+std::string
+OutputStream::getStatsJson(std::vector<OutputStream*> output_streams, const StageStats& alignment, const StageStats& shared_audio, const StageStats& master_playlist, double wall_time, double cpu_time)
+{
+    JsonWriter json;
+    json.BeginObject();
+    json.Key("wall_time");
+    json.Number(wall_time);
+    json.Key("cpu_time");
+    json.Number(cpu_time);
+    json.Key("stages");
+    json.BeginObject();
+    writeStageJson(json, "alignment", alignment);
+    writeStageJson(json, "shared_audio", shared_audio);
+    writeStageJson(json, "master_playlist", master_playlist);
+    json.EndObject();
+
+    json.Key("renditions");
+    json.BeginArray();
+    std::for_each(output_streams.begin(), output_streams.end(), [&json](OutputStream* os) {
+        const Stats& stats = os->stats;
+        json.BeginObject();
+        json.Key("input");
+        json.String(os->input_stream->file_path);
+        json.Key("output");
+        json.String(os->out_folder.filename().string());
+        json.Key("codecs");
+        json.String(stats.codecs);
+        json.Key("resolution");
+        json.String(stats.resolution);
+        json.Key("segment_count");
+        json.Integer(stats.segment_count);
+        json.Key("total_size");
+        json.Integer(stats.segments_total_size);
+        json.Key("total_duration");
+        json.Number(stats.segments_total_duration);
+        json.Key("max_segment_bitrate");
+        json.Number(stats.max_segment_bitrate);
+        json.Key("payload_size");
+        json.Integer(stats.payload_size);
+        json.Key("iframe_count");
+        json.Integer(stats.iframe_count);
+        json.Key("iframe_max_bitrate");
+        json.Number(stats.iframe_max_bitrate);
+        json.Key("mux_overhead_ratio");
+        json.Number(stats.payload_size ? (double)stats.segments_total_size/(double)stats.payload_size : 0.0);
+        json.Key("sample_allocations");
+        json.Integer(stats.sample_allocations);
+        json.Key("steady_state_allocations");
+        json.Integer(stats.steady_state_allocations);
+        json.Key("arena_size");
+        json.Integer(stats.arena_size);
+        json.Key("fragment_peak_buffered_size");
+        json.Integer(stats.fragment_peak_buffered_size);
+        json.Key("fragment_rereads");
+        json.Integer(stats.fragment_rereads);
+        json.Key("input_cache_released");
+        json.Integer(stats.input_cache_released);
+        json.Key("direct_written_size");
+        json.Integer(stats.direct_written_size);
+        if (os->plan.segments.size()) {
+            json.Key("predicted_total_size");
+            AP4_UI64 predicted_total_size = 0;
+            for (const SegmentPlan::Segment& segment : os->plan.segments) predicted_total_size += segment.predicted_size;
+            json.Integer(predicted_total_size);
+            json.Key("predicted_max_bitrate");
+            json.Number(os->plan.GetMaxBitrate());
+        }
+
+        json.Key("stages");
+        json.BeginObject();
+        for (unsigned int i = 0; i < STAGE_COUNT; i++) {
+            writeStageJson(json, STAGE_NAMES[i], stats.stages[i]);
+        }
+        json.EndObject();
+
+        json.Key("segments");
+        json.BeginArray();
+        for (unsigned int i = 0; i < stats.segment_sizes.size(); i++) {
+            json.BeginObject();
+            json.Key("size");
+            json.Integer(stats.segment_sizes[i]);
+            json.Key("duration");
+            json.Number(stats.segment_durations[i]);
+            if (i < stats.segment_checksums.size()) {
+                json.Key("crc32c");
+                json.String(stats.segment_checksums[i].GetCrc32cString());
+                json.Key("sha256");
+                json.String(stats.segment_checksums[i].GetSha256String());
+            }
+            json.EndObject();
+        }
+        json.EndArray();
+
+        // sizes in power of two buckets starting at 64KB, durations in 1 second buckets
+        std::map<AP4_UI64, unsigned int> size_histogram;
+        std::map<AP4_UI64, unsigned int> duration_histogram;
+        for (unsigned int i = 0; i < stats.segment_sizes.size(); i++) {
+            AP4_UI64 bucket = 64*1024;
+            while (bucket*2 <= stats.segment_sizes[i]) bucket *= 2;
+            if (stats.segment_sizes[i] < bucket) bucket = 0;
+            size_histogram[bucket]++;
+            duration_histogram[(AP4_UI64)(stats.segment_durations[i] > 0.0 ? stats.segment_durations[i] : 0.0)]++;
+        }
+        json.Key("segment_size_histogram");
+        json.BeginArray();
+        for (auto& bucket : size_histogram) {
+            json.BeginObject();
+            json.Key("min");
+            json.Integer(bucket.first);
+            json.Key("max");
+            json.Integer(bucket.first ? bucket.first*2 : 64*1024);
+            json.Key("count");
+            json.Integer(bucket.second);
+            json.EndObject();
+        }
+        json.EndArray();
+        json.Key("segment_duration_histogram");
+        json.BeginArray();
+        for (auto& bucket : duration_histogram) {
+            json.BeginObject();
+            json.Key("min");
+            json.Integer(bucket.first);
+            json.Key("max");
+            json.Integer(bucket.first+1);
+            json.Key("count");
+            json.Integer(bucket.second);
+            json.EndObject();
+        }
+        json.EndArray();
+        json.EndObject();
+    });
+    json.EndArray();
+    json.EndObject();
+    return json.GetString();
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::setCodecs
++---------------------------------------------------------------------*/
+void
+OutputStream::setCodecs()
+{
+    const InputStream *input = input_stream;
+    std::vector<std::string> codecs;
+    if(input->audio_track) {
+        AP4_String codec;
+        AP4_SampleDescription *sdesc = input->audio_track->GetSampleDescription(0);
+        if (sdesc) {
+            sdesc ->GetCodecString(codec);
+            codecs.push_back(std::string(codec.GetChars()));
+        }
+    }
+    if(input->video_track) {
+        AP4_String codec;
+        AP4_SampleDescription *sdesc = input->video_track->GetSampleDescription(0);
+        if (sdesc) {
+            sdesc ->GetCodecString(codec);
+            codecs.push_back(std::string(codec.GetChars()));
+            stats.video_codec = std::string(codec.GetChars());
+        }
+        char buffer[1024];
+        AP4_VideoSampleDescription* vsd = AP4_DYNAMIC_CAST(AP4_VideoSampleDescription, input->video_track->GetSampleDescription(0));
+        sprintf(buffer, "%dx%d", vsd->GetWidth(), vsd->GetHeight());
+        stats.resolution = std::string(buffer);
+    }
+    std::ostringstream ss_codecs;
+    std::copy(codecs.rbegin(),codecs.rend(), std::ostream_iterator<std::string>(ss_codecs,","));
+    stats.codecs = ss_codecs.str().substr(0, ss_codecs.str().size()-1);
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::writeStageJson
++---------------------------------------------------------------------*/
+void
+OutputStream::writeStageJson(JsonWriter& json, const char* name, const StageStats& stage)
+{
+    json.Key(name);
+    json.BeginObject();
+    json.Key("wall_time");
+    json.Number(stage.wall_time);
+    json.Key("cpu_time");
+    json.Number(stage.cpu_time);
+    json.Key("bytes_read");
+    json.Integer(stage.io.bytes_read);
+    json.Key("bytes_written");
+    json.Integer(stage.io.bytes_written);
+    json.Key("read_syscalls");
+    json.Integer(stage.io.read_syscalls);
+    json.Key("write_syscalls");
+    json.Integer(stage.io.write_syscalls);
+    json.EndObject();
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::finishRendition
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::finishRendition(OutputStream* output, const std::vector<double>& segment_durations, const AP4_Array<AP4_UI32>& segment_sizes, const std::vector<IFrame>& iframes, double video_end, const WriteOptions& options)
+{
+    const InputStream* input = output->input_stream;
+    char               string_buffer[4096];
+    StageTimer         playlist_timer(&output->stats.stages[STAGE_PLAYLIST], options.profile);
+
+    // create the media playlist/index file
+    AP4_Result result = writeMediaPlaylist(output, segment_durations, true, options);
+    if (AP4_FAILED(result)) return result;
+    double total_duration = 0.0;
+    for (unsigned int i=0; i<segment_durations.size(); i++) {
+        total_duration += segment_durations[i];
+    }
+
+    // create the I-frame playlist, not possible once the segments are encrypted
+    if (options.iframe_playlist && input->video_track && options.encryption == NULL && iframes.size()) {
+        // each I-frame lasts until the next one
+        std::vector<double> iframe_durations;
+        unsigned int        iframe_target_duration = 0;
+        AP4_UI64            iframes_total_size = 0;
+        for (unsigned int i=0; i<iframes.size(); i++) {
+            double duration = (i+1 < iframes.size() ? iframes[i+1].ts : video_end)-iframes[i].ts;
+            iframe_durations.push_back(duration);
+            if ((unsigned int)(duration+0.5) > iframe_target_duration) {
+                iframe_target_duration = (unsigned int)(duration+0.5);
+            }
+            if (duration > 0.0 && 8.0*iframes[i].size/duration > output->stats.iframe_max_bitrate) {
+                output->stats.iframe_max_bitrate = 8.0*iframes[i].size/duration;
+            }
+            iframes_total_size += iframes[i].size;
+        }
+        if (video_end > iframes[0].ts) {
+            output->stats.iframe_average_bitrate = 8.0*iframes_total_size/(video_end-iframes[0].ts);
+        }
+        output->stats.iframe_count = iframes.size();
+
+        std::string playlist;
+        playlist += "#EXTM3U\r\n";
+        sprintf(string_buffer, "#EXT-X-VERSION:%d\r\n", 5);
+        playlist += string_buffer;
+        playlist += "#EXT-X-PLAYLIST-TYPE:VOD\r\n";
+        playlist += "#EXT-X-I-FRAMES-ONLY\r\n";
+        sprintf(string_buffer, "#EXT-X-TARGETDURATION:%d\r\n", iframe_target_duration);
+        playlist += string_buffer;
+        playlist += "#EXT-X-MEDIA-SEQUENCE:0\r\n";
+
+        char segment_filename[64];
+        for (unsigned int i=0; i<iframes.size(); i++) {
+            sprintf(segment_filename, SEGMENT_FILENAME_TEMPLATE, iframes[i].segment);
+            if (i == 0 || iframes[i].segment != iframes[i-1].segment) {
+                sprintf(string_buffer, "#EXT-X-MAP:URI=\"%s\",BYTERANGE=\"%u@0\"\r\n", segment_filename, 2*AP4_MPEG2TS_PACKET_SIZE);
+                playlist += string_buffer;
+            }
+            sprintf(string_buffer, "#EXTINF:%f,\r\n", iframe_durations[i]);
+            playlist += string_buffer;
+            sprintf(string_buffer, "#EXT-X-BYTERANGE:%u@%llu\r\n", iframes[i].size, (unsigned long long)iframes[i].offset);
+            playlist += string_buffer;
+            playlist += segment_filename;
+            playlist += "\r\n";
+        }
+
+        playlist += "#EXT-X-ENDLIST\r\n";
+        result = WriteOutputAtomically(output->out_folder, IFRAME_INDEX_FILENAME, playlist, options.committer != NULL, options.sink);
+        if (AP4_FAILED(result)) return result;
+    }
+
+    // write the checksum manifest
+    if (options.checksums) {
+        std::string manifest;
+        manifest += "# filename size crc32c sha256\n";
+        for (unsigned int i=0; i<output->stats.segment_checksums.size(); i++) {
+            const SegmentChecksum& checksum = output->stats.segment_checksums[i];
+            char filename[64];
+            sprintf(filename, SEGMENT_FILENAME_TEMPLATE, i);
+            sprintf(string_buffer, "%s %u %s %s\n", filename, segment_sizes[i], checksum.GetCrc32cString().c_str(), checksum.GetSha256String().c_str());
+            manifest += string_buffer;
+        }
+        result = WriteOutputAtomically(output->out_folder, CHECKSUMS_FILENAME, manifest, options.committer != NULL, options.sink);
+        if (AP4_FAILED(result)) return result;
+    }
+
+    // update stats
+    output->stats.segment_count = segment_sizes.ItemCount();
+    output->stats.segments_total_duration = total_duration;
+    for (unsigned int i=0; i<segment_sizes.ItemCount(); i++) {
+        output->stats.segments_total_size  += segment_sizes[i];
+        output->stats.segment_sizes.push_back(segment_sizes[i]);
+        output->stats.segment_durations.push_back(segment_durations[i]);
+        if (abs(segment_durations[i]) > 0.0 && 8.0*segment_sizes[i]/segment_durations[i] > output->stats.max_segment_bitrate) {
+            output->stats.max_segment_bitrate = 8.0*segment_sizes[i]/segment_durations[i];
+        }
+    }
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   OutputStream::writeShardFile
++---------------------------------------------------------------------*/
+AP4_Result
+OutputStream::writeShardFile(OutputStream* output, const std::vector<double>& segment_durations, const AP4_Array<AP4_UI32>& segment_sizes, const std::vector<IFrame>& iframes, double video_end, const WriteOptions& options)
+{
+    std::string  content;
+    char         line[1024];
+    unsigned int first_segment = (options.shard_index-1)*output->plan.segments.size()/options.shard_count;
+    for (unsigned int i = 0; i < segment_durations.size(); i++) {
+        bool checksum = i < output->stats.segment_checksums.size();
+        sprintf(line, "segment %u %u %.17g %s %s\n", first_segment+i, segment_sizes[i], segment_durations[i],
+                checksum ? output->stats.segment_checksums[i].GetCrc32cString().c_str() : "-",
+                checksum ? output->stats.segment_checksums[i].GetSha256String().c_str() : "-");
+        content += line;
+    }
+    for (const IFrame& iframe : iframes) {
+        sprintf(line, "iframe %u %llu %u %.17g\n", iframe.segment, (unsigned long long)iframe.offset, iframe.size, iframe.ts);
+        content += line;
+    }
+    if (options.shard_index == options.shard_count) {
+        sprintf(line, "end %.17g\n", video_end);
+        content += line;
+    }
+    if (options.committer) {
+        AP4_Result result = options.committer->Flush();
+        if (AP4_FAILED(result)) return result;
+    }
+    sprintf(line, SHARD_FILENAME_TEMPLATE, options.shard_index, options.shard_count);
+    return WriteOutputAtomically(output->out_folder, line, content, options.committer != NULL);
+}
+
+}
@@ -0,0 +1,157 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENTO5_RENDITION_H_
+#define _BENTO5_RENDITION_H_
+
+#include <string>
+#include <vector>
+#include <filesystem>
+#include "Ap4.h"
+#include "Bento5Common.h"
+#include "Bento5Input.h"
+#include "Bento5TsPacketizer.h"
+#include "Bento5Journal.h"
+#include "Bento5Plan.h"
+
+namespace Bento5 {
+
+class EncryptionKey;
+class SegmentCommitter;
+
+/*----------------------------------------------------------------------
+|   WriteOptions
++---------------------------------------------------------------------*/
+// what write_samples does on top of muxing, from the command line
+class WriteOptions {
+public:
+    WriteOptions() : profile(false), checksums(false), encryption(NULL), iframe_playlist(true), publish_every(0), shard_index(0), shard_count(0), resume(false), committer(NULL), direct_io(false), preallocate(false), sink(NULL), listener(NULL) {}
+    bool                 profile;         // per-sample stage timing
+    bool                 checksums;       // CRC32C and SHA-256 of the segments
+    const EncryptionKey* encryption;      // AES-128 segment encryption, NULL for clear segments
+    bool                 iframe_playlist;
+    unsigned int         publish_every;   // republish the media playlist every N segments, 0 to write it at the end only
+    unsigned int         shard_index;     // --shard k/N: only write the k-th of N slices of the planned segments (k from 1)
+    unsigned int         shard_count;     // 0 to write all the segments
+    bool                 resume;          // continue after the segments of the journal
+    SegmentCommitter*    committer;       // --durable: commits the segments written under a temporary name, NULL to write them in place
+    bool                 direct_io;       // write the segments with O_DIRECT
+    bool                 preallocate;     // allocate the segment files from their predicted sizes
+    OutputSink*          sink;            // gets the files instead of the output directory, NULL to write them there
+    PackagerListener*    listener;        // told about every segment written, can be NULL
+};
+
+/*----------------------------------------------------------------------
+|   OutputStream
++---------------------------------------------------------------------*/
+class OutputStream {
+public:
+    OutputStream(std::filesystem::path out_folder, const InputStream* input, unsigned int index): audio_stream(NULL), video_stream(NULL), shared_audio(NULL), audio_continuity_counter(0), input_stream(input), out_folder(out_folder), index(index) {}
+
+    // the TS streams of the tracks, and the PAT and PMT
+    AP4_Result createStreams(std::string& error);
+    ~OutputStream() {
+        delete audio_stream;
+        delete video_stream;
+        delete input_stream;
+    };
+
+    // replay the audio packets of a SharedAudio instead of packetizing the audio samples
+    void setSharedAudio(const SharedAudio* audio) { shared_audio = audio; }
+
+    unsigned int getPlannedSegmentCount() const { return plan.segments.size(); }
+
+    // a --resume run picks up the segments of the journal
+    bool hasJournal() const { return std::filesystem::exists(out_folder/JOURNAL_FILENAME); }
+
+    // nothing is written before this, shards, --merge and --resume reuse the folder of an earlier run
+    AP4_Result createOutputFolder(std::string& error, bool reuse = false);
+
+    // replay the interleaving of write_samples on the sample indexes to know the segments
+    AP4_Result planSegments(float seg_duration, const std::vector<float>& segmentPoints, const WriteOptions& options);
+
+    // continuity counters of the first video and audio packets of each planned segment, for --shard
+    AP4_Result planContinuityCounters();
+
+    // the plan file of --plan-out, one line per rendition followed by one line per segment
+    static AP4_Result writePlanFile(const std::vector<OutputStream*>& output_streams, std::filesystem::path path);
+
+    // load the plans of a plan file written for the same inputs
+    static AP4_Result readPlanFile(const std::vector<OutputStream*>& output_streams, std::filesystem::path path);
+
+    // write stream.m3u8, an EVENT playlist with the planned target duration while publishing
+    static AP4_Result writeMediaPlaylist(OutputStream* output, const std::vector<double>& segment_durations, bool ended, const WriteOptions& options);
+
+    static AP4_Result write_samples(OutputStream *output, float seg_duration, std::vector<float> segmentPoints, const WriteOptions& options);
+    // --merge: finish a rendition from the shard files of its --shard runs
+    static AP4_Result mergeShards(OutputStream* output, unsigned int shard_count, const WriteOptions& options);
+
+    // whether the master playlist written from the plan still holds, differences go to stderr
+    bool checkPrediction() const;
+
+    // with predicted, the bandwidths come from the segment plans
+    static AP4_Result generateMasterPlaylist(std::vector<OutputStream*> output_streams, std::filesystem::path output_dir, bool predicted, bool durable = false, OutputSink* sink = NULL);
+    static std::string getStatsJson(std::vector<OutputStream*> output_streams, const StageStats& alignment, const StageStats& shared_audio, const StageStats& master_playlist, double wall_time, double cpu_time);
+
+    // the segment plans of --plan, planSegments has to be called first
+    static std::string getPlanJson(std::vector<OutputStream*> output_streams, double segment_duration, const std::vector<float>& segment_points);
+
+private:
+    // codecs and resolution for the master playlist
+    void setCodecs();
+
+    static void writeStageJson(JsonWriter& json, const char* name, const StageStats& stage);
+
+    // write the media playlist, the I-frame playlist and the checksum manifest of a rendition
+    static AP4_Result finishRendition(OutputStream* output, const std::vector<double>& segment_durations, const AP4_Array<AP4_UI32>& segment_sizes,
+                                      const std::vector<IFrame>& iframes, double video_end, const WriteOptions& options);
+
+    // what the segments depend on besides the code, a journal with another fingerprint is not resumed
+    static std::string getJournalFingerprint(OutputStream* output, float seg_duration, const std::vector<float>& segment_points, const WriteOptions& options);
+
+    // the segments of the journal of a --resume run that are still there as they were written
+    static AP4_Result loadJournal(OutputStream* output, const WriteOptions& options, const std::string& fingerprint,
+                                  std::vector<SegmentJournal::Entry>& entries, std::vector<IFrame>& iframes, bool& ended, double& video_end);
+
+    // the shard file of a --shard run, for --merge
+    static AP4_Result writeShardFile(OutputStream* output, const std::vector<double>& segment_durations, const AP4_Array<AP4_UI32>& segment_sizes,
+                                     const std::vector<IFrame>& iframes, double video_end, const WriteOptions& options);
+
+    // write the TS packets staged in sample_packets to the segment, in one go
+    static AP4_Result write_sample_packets(AP4_ByteStream& segment_output, const AP4_DataBuffer& sample_packets, StageStats* write_stage) {
+        StageTimer timer(write_stage);
+        return segment_output.Write(sample_packets.GetData(), sample_packets.GetDataSize());
+    }
+
+    PesAudioStream*                  audio_stream;
+    AnnexBVideoStream*               video_stream;
+    AP4_DataBuffer                   psi_packets;    // PAT and PMT
+    const SharedAudio*               shared_audio;
+    AP4_UI08                         audio_continuity_counter;
+    const InputStream *input_stream;
+    std::filesystem::path out_folder;
+    unsigned int index;
+    SegmentPlan plan;
+    Stats stats;
+};
+
+}
+
+#endif // _BENTO5_RENDITION_H_
@@ -0,0 +1,595 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <string.h>
+#include <algorithm>
+#include "Ap4Mp4AudioInfo.h"
+#include "Bento5TsPacketizer.h"
+#include "Bento5Crypto.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   TsPacketizer::TsPacketizer
++---------------------------------------------------------------------*/
+TsPacketizer::TsPacketizer(AP4_UI16 pid, AP4_UI08 stream_id, AP4_UI64 pcr_offset) :
+    m_StreamId(stream_id),
+    m_PcrOffset(pcr_offset),
+    m_ContinuityCounter(0)
+{
+    m_Header[0] = 0x47;
+    m_Header[1] = (AP4_UI08)(pid >> 8);
+    m_Header[2] = (AP4_UI08)(pid & 0xFF);
+    m_Header[3] = 0;
+    memcpy(m_StartHeader, m_Header, 4);
+    m_StartHeader[1] |= 0x40;
+
+    memset(m_PesHeader, 0, sizeof(m_PesHeader));
+    m_PesHeader[2] = 0x01;
+    m_PesHeader[3] = stream_id;
+    m_PesHeader[6] = 0x84; // data_alignment_indicator
+}
+
+/*----------------------------------------------------------------------
+|   TsPacketizer::WritePes
++---------------------------------------------------------------------*/
+AP4_Result
+TsPacketizer::WritePes(const std::vector<Piece>& payload, AP4_UI64 dts, AP4_UI64 pts, bool with_dts, bool with_pcr, AP4_DataBuffer& packets, SegmentArena* arena,
+                       AP4_ByteStream* stream)
+{
+    AP4_UI64 payload_size = 0;
+    for (const Piece& piece : payload) payload_size += piece.size;
+
+    // PES header, video PES packets have no length
+    AP4_Size header_size = with_dts ? 19 : 14;
+    AP4_UI64 pes_packet_length = payload_size+header_size-6;
+    if (m_StreamId == AP4_MPEG2_TS_DEFAULT_STREAM_ID_VIDEO || pes_packet_length > 0xFFFF) pes_packet_length = 0;
+    m_PesHeader[4] = (AP4_UI08)(pes_packet_length >> 8);
+    m_PesHeader[5] = (AP4_UI08)(pes_packet_length & 0xFF);
+    m_PesHeader[7] = with_dts ? 0xC0 : 0x80;
+    m_PesHeader[8] = (AP4_UI08)(header_size-9);
+    WriteTimestamp(m_PesHeader+9, with_dts ? 0x3 : 0x2, pts+m_PcrOffset);
+    if (with_dts) WriteTimestamp(m_PesHeader+14, 0x1, dts+m_PcrOffset);
+
+    // the headers of the packets written to a stream are stamped one at a time
+    AP4_Cardinal packet_count = GetPacketCount(payload_size, with_dts, with_pcr);
+    AP4_Result   result       = AP4_SUCCESS;
+    AP4_UI08     scratch[AP4_MPEG2TS_PACKET_SIZE];
+    AP4_UI08*    packet       = scratch;
+    AP4_Size     packet_step  = 0;
+    if (stream == NULL) {
+        AP4_Size start = packets.GetDataSize();
+        AP4_Size size  = start+packet_count*AP4_MPEG2TS_PACKET_SIZE;
+        result = arena ? arena->SetDataSize(packets, size) : packets.SetDataSize(size);
+        if (AP4_FAILED(result)) return result;
+        packet      = packets.UseData()+start;
+        packet_step = AP4_MPEG2TS_PACKET_SIZE;
+    }
+
+    // the PES header is gathered first, then the pieces
+    const AP4_UI08* data      = m_PesHeader;
+    AP4_Size        available = header_size;
+    unsigned int    next      = 0;
+    AP4_UI64        remaining = payload_size+header_size;
+    for (AP4_Cardinal i = 0; i < packet_count; i++, packet += packet_step) {
+        bool         pcr                   = i == 0 && with_pcr;
+        unsigned int adaptation_field_size = pcr ? 2+6 : 0;
+        AP4_Size     packet_payload_size   = (AP4_Size)std::min<AP4_UI64>(remaining, AP4_MPEG2TS_PACKET_PAYLOAD_SIZE-adaptation_field_size);
+        if (adaptation_field_size+packet_payload_size < AP4_MPEG2TS_PACKET_PAYLOAD_SIZE) {
+            // stuffing
+            adaptation_field_size = AP4_MPEG2TS_PACKET_PAYLOAD_SIZE-packet_payload_size;
+        }
+
+        memcpy(packet, i == 0 ? m_StartHeader : m_Header, 4);
+        packet[3] = (AP4_UI08)((adaptation_field_size ? 0x30 : 0x10) | m_ContinuityCounter);
+        m_ContinuityCounter = (m_ContinuityCounter+1) & 0x0F;
+        if (adaptation_field_size == 1) {
+            packet[4] = 0;
+        } else if (adaptation_field_size) {
+            packet[4] = (AP4_UI08)(adaptation_field_size-1);
+            packet[5] = pcr ? 0x10 : 0x00;
+            unsigned int pcr_size = 0;
+            if (pcr) {
+                AP4_UI64 pcr_base = (with_dts ? dts : pts) & 0x1FFFFFFFFULL;
+                packet[6]  = (AP4_UI08)(pcr_base >> 25);
+                packet[7]  = (AP4_UI08)(pcr_base >> 17);
+                packet[8]  = (AP4_UI08)(pcr_base >> 9);
+                packet[9]  = (AP4_UI08)(pcr_base >> 1);
+                packet[10] = (AP4_UI08)(((pcr_base & 1) << 7) | 0x7E);
+                packet[11] = 0;
+                pcr_size = 6;
+            }
+            memset(packet+6+pcr_size, 0xFF, adaptation_field_size-2-pcr_size);
+        }
+
+        // whole packets from a single piece are a fixed size copy
+        AP4_UI08* output = packet+4+adaptation_field_size;
+        if (stream) {
+            result = stream->Write(packet, 4+adaptation_field_size);
+            if (AP4_FAILED(result)) return result;
+        }
+        if (packet_payload_size == AP4_MPEG2TS_PACKET_PAYLOAD_SIZE && available >= AP4_MPEG2TS_PACKET_PAYLOAD_SIZE) {
+            if (stream) {
+                result = stream->Write(data, AP4_MPEG2TS_PACKET_PAYLOAD_SIZE);
+                if (AP4_FAILED(result)) return result;
+            } else {
+                memcpy(output, data, AP4_MPEG2TS_PACKET_PAYLOAD_SIZE);
+            }
+            data      += AP4_MPEG2TS_PACKET_PAYLOAD_SIZE;
+            available -= AP4_MPEG2TS_PACKET_PAYLOAD_SIZE;
+        } else {
+            for (AP4_Size copied = 0; copied < packet_payload_size;) {
+                if (available == 0) {
+                    if (next == payload.size()) return AP4_ERROR_INTERNAL;
+                    data      = payload[next].data;
+                    available = payload[next].size;
+                    next++;
+                    continue;
+                }
+                AP4_Size chunk = std::min<AP4_Size>(packet_payload_size-copied, available);
+                if (stream) {
+                    result = stream->Write(data, chunk);
+                    if (AP4_FAILED(result)) return result;
+                } else {
+                    memcpy(output+copied, data, chunk);
+                }
+                copied    += chunk;
+                data      += chunk;
+                available -= chunk;
+            }
+        }
+        remaining -= packet_payload_size;
+        if (available == 0 && next < payload.size()) {
+            data      = payload[next].data;
+            available = payload[next].size;
+            next++;
+        }
+    }
+    return AP4_SUCCESS;
+}
+
+static const AP4_UI08 ANNEXB_START_CODE[4]          = { 0x00, 0x00, 0x00, 0x01 };
+static const AP4_UI08 AVC_ACCESS_UNIT_DELIMITER[6]  = { 0x00, 0x00, 0x00, 0x01, 0x09, 0xF0 };
+static const AP4_UI08 HEVC_ACCESS_UNIT_DELIMITER[7] = { 0x00, 0x00, 0x00, 0x01, 0x46, 0x01, 0x50 };
+const unsigned int AVC_NALU_TYPE_SPS                    = 7;
+const unsigned int AVC_NALU_TYPE_PPS                    = 8;
+const unsigned int AVC_NALU_TYPE_ACCESS_UNIT_DELIMITER  = 9;
+const unsigned int HEVC_NALU_TYPE_VPS                   = 32;
+const unsigned int HEVC_NALU_TYPE_SPS                   = 33;
+const unsigned int HEVC_NALU_TYPE_PPS                   = 34;
+const unsigned int HEVC_NALU_TYPE_ACCESS_UNIT_DELIMITER = 35;
+
+/*----------------------------------------------------------------------
+|   AnnexBVideoStream::AnnexBVideoStream
++---------------------------------------------------------------------*/
+AnnexBVideoStream::AnnexBVideoStream(AP4_UI32 timescale, bool hevc, AP4_UI16 pid, AP4_UI08 stream_id, AP4_UI64 pcr_offset) :
+    m_TimeScale(timescale),
+    m_Hevc(hevc),
+    m_Packetizer(pid, stream_id, pcr_offset)
+{
+}
+
+/*----------------------------------------------------------------------
+|   AnnexBVideoStream::Create
++---------------------------------------------------------------------*/
+AP4_Result
+AnnexBVideoStream::Create(AP4_Track&          track,
+                          unsigned int        stream_type,
+                          AP4_UI16            pid,
+                          AP4_UI08            stream_id,
+                          AP4_UI64            pcr_offset,
+                          AnnexBVideoStream*& stream)
+{
+    stream = NULL;
+    if (stream_type != AP4_MPEG2_STREAM_TYPE_AVC && stream_type != AP4_MPEG2_STREAM_TYPE_HEVC) return AP4_ERROR_NOT_SUPPORTED;
+    bool hevc = stream_type == AP4_MPEG2_STREAM_TYPE_HEVC;
+
+    std::vector<Description> descriptions;
+    for (AP4_Ordinal i = 0; i < track.GetSampleDescriptionCount(); i++) {
+        AP4_SampleDescription* sample_description = track.GetSampleDescription(i);
+        if (sample_description == NULL) return AP4_ERROR_INVALID_FORMAT;
+        AP4_UI32 format = sample_description->GetFormat();
+
+        Description description;
+        auto append_parameter_set = [&description](const AP4_DataBuffer& nalu) {
+            description.parameter_sets.insert(description.parameter_sets.end(), ANNEXB_START_CODE, ANNEXB_START_CODE+4);
+            description.parameter_sets.insert(description.parameter_sets.end(), nalu.GetData(), nalu.GetData()+nalu.GetDataSize());
+        };
+        if (hevc) {
+            AP4_HevcSampleDescription* hevc_description = AP4_DYNAMIC_CAST(AP4_HevcSampleDescription, sample_description);
+            if (hevc_description == NULL) return AP4_ERROR_INVALID_FORMAT;
+            description.nalu_length_size = hevc_description->GetNaluLengthSize();
+            description.in_band = format == AP4_SAMPLE_FORMAT_HEV1 || format == AP4_SAMPLE_FORMAT_DVHE;
+            // VPS, SPS and PPS arrays, in the order of the hvcC
+            const AP4_Array<AP4_HvccAtom::Sequence>& sequences = hevc_description->GetSequences();
+            for (unsigned int j = 0; j < sequences.ItemCount(); j++) {
+                for (unsigned int k = 0; k < sequences[j].m_Nalus.ItemCount(); k++) {
+                    append_parameter_set(sequences[j].m_Nalus[k]);
+                }
+            }
+        } else {
+            AP4_AvcSampleDescription* avc_description = AP4_DYNAMIC_CAST(AP4_AvcSampleDescription, sample_description);
+            if (avc_description == NULL) return AP4_ERROR_INVALID_FORMAT;
+            description.nalu_length_size = avc_description->GetNaluLengthSize();
+            description.in_band = format == AP4_SAMPLE_FORMAT_AVC3 || format == AP4_SAMPLE_FORMAT_AVC4 || format == AP4_SAMPLE_FORMAT_DVAV;
+            const AP4_Array<AP4_DataBuffer>& sps = avc_description->GetSequenceParameters();
+            const AP4_Array<AP4_DataBuffer>& pps = avc_description->GetPictureParameters();
+            for (unsigned int j = 0; j < sps.ItemCount(); j++) append_parameter_set(sps[j]);
+            for (unsigned int j = 0; j < pps.ItemCount(); j++) append_parameter_set(pps[j]);
+        }
+        if (description.nalu_length_size == 0 || description.nalu_length_size > 4) return AP4_ERROR_INVALID_FORMAT;
+        descriptions.push_back(description);
+    }
+    if (descriptions.empty()) return AP4_ERROR_INVALID_FORMAT;
+
+    stream = new AnnexBVideoStream(track.GetMediaTimeScale(), hevc, pid, stream_id, pcr_offset);
+    stream->m_Descriptions.swap(descriptions);
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   AnnexBVideoStream::MakePieces
++---------------------------------------------------------------------*/
+AP4_Result
+AnnexBVideoStream::MakePieces(const AP4_Sample& sample, const AP4_DataBuffer& sample_data)
+{
+    if (sample.GetDescriptionIndex() >= m_Descriptions.size()) return AP4_ERROR_INVALID_FORMAT;
+    const Description& description = m_Descriptions[sample.GetDescriptionIndex()];
+
+    // access unit delimiter, then the NAL units of the sample with a start code each
+    m_Pieces.clear();
+    if (m_Hevc) {
+        m_Pieces.push_back({ HEVC_ACCESS_UNIT_DELIMITER, sizeof(HEVC_ACCESS_UNIT_DELIMITER) });
+    } else {
+        m_Pieces.push_back({ AVC_ACCESS_UNIT_DELIMITER, sizeof(AVC_ACCESS_UNIT_DELIMITER) });
+    }
+    bool            has_sps = false;
+    bool            first   = true;
+    const AP4_UI08* data    = sample_data.GetData();
+    AP4_Size        size    = sample_data.GetDataSize();
+    while (size) {
+        if (size < description.nalu_length_size) return AP4_ERROR_INVALID_FORMAT;
+        AP4_UI32 nalu_size = 0;
+        for (unsigned int i = 0; i < description.nalu_length_size; i++) {
+            nalu_size = (nalu_size << 8) | data[i];
+        }
+        data += description.nalu_length_size;
+        size -= description.nalu_length_size;
+        if (nalu_size > size) return AP4_ERROR_INVALID_FORMAT;
+        if (nalu_size) {
+            unsigned int nalu_type = m_Hevc ? (data[0] >> 1) & 0x3F : data[0] & 0x1F;
+            if (nalu_type != (m_Hevc ? HEVC_NALU_TYPE_ACCESS_UNIT_DELIMITER : AVC_NALU_TYPE_ACCESS_UNIT_DELIMITER)) {
+                bool parameter_set = m_Hevc ? nalu_type >= HEVC_NALU_TYPE_VPS && nalu_type <= HEVC_NALU_TYPE_PPS
+                                            : nalu_type == AVC_NALU_TYPE_SPS || nalu_type == AVC_NALU_TYPE_PPS;
+                if (nalu_type == (m_Hevc ? HEVC_NALU_TYPE_SPS : AVC_NALU_TYPE_SPS)) has_sps = true;
+                if (first || parameter_set) {
+                    m_Pieces.push_back({ ANNEXB_START_CODE, 4 });
+                } else {
+                    m_Pieces.push_back({ ANNEXB_START_CODE+1, 3 });
+                }
+                m_Pieces.push_back({ data, nalu_size });
+                first = false;
+            }
+        }
+        data += nalu_size;
+        size -= nalu_size;
+    }
+
+    // keyframes get the parameter sets of the sample description unless they are in-band
+    if (sample.IsSync() && description.parameter_sets.size() && !(description.in_band && has_sps)) {
+        m_Pieces.insert(m_Pieces.begin()+1, { description.parameter_sets.data(), (AP4_Size)description.parameter_sets.size() });
+    }
+
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   AnnexBVideoStream::WriteSample
++---------------------------------------------------------------------*/
+AP4_Result
+AnnexBVideoStream::WriteSample(const AP4_Sample& sample, const AP4_DataBuffer& sample_data, bool with_pcr, AP4_DataBuffer& packets, SegmentArena* arena,
+                               AP4_ByteStream* stream)
+{
+    AP4_Result result = MakePieces(sample, sample_data);
+    if (AP4_FAILED(result)) return result;
+
+    AP4_UI64 dts = AP4_ConvertTime(sample.GetDts(), m_TimeScale, 90000);
+    AP4_UI64 pts = AP4_ConvertTime(sample.GetCts(), m_TimeScale, 90000);
+    return m_Packetizer.WritePes(m_Pieces, dts, pts, true, with_pcr, packets, arena, stream);
+}
+
+/*----------------------------------------------------------------------
+|   AnnexBVideoStream::GetPayloadSize
++---------------------------------------------------------------------*/
+AP4_Result
+AnnexBVideoStream::GetPayloadSize(const AP4_Sample& sample, const AP4_DataBuffer& sample_data, AP4_UI64& payload_size)
+{
+    payload_size = 0;
+    AP4_Result result = MakePieces(sample, sample_data);
+    if (AP4_FAILED(result)) return result;
+    for (const TsPacketizer::Piece& piece : m_Pieces) payload_size += piece.size;
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   AnnexBVideoStream::GetPayloadSize
++---------------------------------------------------------------------*/
+AP4_UI64
+AnnexBVideoStream::GetPayloadSize(AP4_Size sample_size, bool sync, AP4_Ordinal description_index) const
+{
+    const Description& description = m_Descriptions[description_index < m_Descriptions.size() ? description_index : 0];
+    AP4_UI64 payload_size = m_Hevc ? sizeof(HEVC_ACCESS_UNIT_DELIMITER) : sizeof(AVC_ACCESS_UNIT_DELIMITER);
+    if (sample_size > description.nalu_length_size) payload_size += sample_size-description.nalu_length_size+4;
+    if (sync && !description.in_band) payload_size += description.parameter_sets.size();
+    return payload_size;
+}
+
+/*----------------------------------------------------------------------
+|   PesAudioStream::Create
++---------------------------------------------------------------------*/
+AP4_Result
+PesAudioStream::Create(AP4_Track& track, AP4_UI16 pid, AP4_UI08 stream_id, AP4_UI64 pcr_offset, PesAudioStream*& stream)
+{
+    static const unsigned int sampling_frequencies[13] = {
+        96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350
+    };
+
+    stream = NULL;
+    std::vector<Description> descriptions;
+    for (AP4_Ordinal i = 0; i < track.GetSampleDescriptionCount(); i++) {
+        AP4_SampleDescription* sample_description = track.GetSampleDescription(i);
+        if (sample_description == NULL) return AP4_ERROR_INVALID_FORMAT;
+
+        Description description = { false, 0, 0 };
+        if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_MP4A) {
+            AP4_MpegAudioSampleDescription* mpeg_description = AP4_DYNAMIC_CAST(AP4_MpegAudioSampleDescription, sample_description);
+            if (mpeg_description == NULL) return AP4_ERROR_INVALID_FORMAT;
+            description.adts = true;
+
+            // from the decoder config, or from the sample entry when there is none
+            AP4_Mp4AudioDecoderConfig decoder_config;
+            const AP4_DataBuffer& decoder_info = mpeg_description->GetDecoderInfo();
+            if (decoder_info.GetDataSize() && AP4_SUCCEEDED(decoder_config.Parse(decoder_info.GetData(), decoder_info.GetDataSize()))) {
+                description.sampling_frequency_index = decoder_config.m_SamplingFrequencyIndex;
+                description.channel_configuration    = decoder_config.m_ChannelConfiguration;
+            } else {
+                description.sampling_frequency_index = 15;
+                for (unsigned int j = 0; j < 13; j++) {
+                    if (sampling_frequencies[j] == mpeg_description->GetSampleRate()) description.sampling_frequency_index = j;
+                }
+                if (description.sampling_frequency_index == 15) return AP4_ERROR_NOT_SUPPORTED;
+                description.channel_configuration = mpeg_description->GetChannelCount();
+            }
+        } else if (sample_description->GetFormat() != AP4_SAMPLE_FORMAT_AC_3 &&
+                   sample_description->GetFormat() != AP4_SAMPLE_FORMAT_EC_3) {
+            return AP4_ERROR_NOT_SUPPORTED;
+        }
+        descriptions.push_back(description);
+    }
+    if (descriptions.empty()) return AP4_ERROR_INVALID_FORMAT;
+
+    stream = new PesAudioStream(track.GetMediaTimeScale(), pid, stream_id, pcr_offset);
+    stream->m_Descriptions.swap(descriptions);
+    return AP4_SUCCESS;
+}
+
+/*----------------------------------------------------------------------
+|   PesAudioStream::WriteSample
++---------------------------------------------------------------------*/
+AP4_Result
+PesAudioStream::WriteSample(const AP4_Sample& sample, const AP4_DataBuffer& sample_data, bool with_pcr, AP4_DataBuffer& packets, SegmentArena* arena,
+                            AP4_ByteStream* stream)
+{
+    if (sample.GetDescriptionIndex() >= m_Descriptions.size()) return AP4_ERROR_INVALID_FORMAT;
+    const Description& description = m_Descriptions[sample.GetDescriptionIndex()];
+
+    m_Pieces.clear();
+    if (description.adts) {
+        // AAC LC, no CRC
+        AP4_Size frame_size = sample_data.GetDataSize()+7;
+        if (frame_size > 0x1FFF) return AP4_ERROR_INVALID_FORMAT;
+        m_AdtsHeader[0] = 0xFF;
+        m_AdtsHeader[1] = 0xF1;
+        m_AdtsHeader[2] = (AP4_UI08)(0x40 | (description.sampling_frequency_index << 2) | (description.channel_configuration >> 2));
+        m_AdtsHeader[3] = (AP4_UI08)(((description.channel_configuration & 0x3) << 6) | (frame_size >> 11));
+        m_AdtsHeader[4] = (AP4_UI08)((frame_size >> 3) & 0xFF);
+        m_AdtsHeader[5] = (AP4_UI08)(((frame_size << 5) & 0xFF) | 0x1F);
+        m_AdtsHeader[6] = 0xFC;
+        m_Pieces.push_back({ m_AdtsHeader, sizeof(m_AdtsHeader) });
+    }
+    m_Pieces.push_back({ sample_data.GetData(), sample_data.GetDataSize() });
+
+    AP4_UI64 ts = AP4_ConvertTime(sample.GetDts(), m_TimeScale, 90000);
+    return m_Packetizer.WritePes(m_Pieces, ts, ts, false, with_pcr, packets, arena, stream);
+}
+
+/*----------------------------------------------------------------------
+|   CreateAudioStream
++---------------------------------------------------------------------*/
+AP4_Result
+CreateAudioStream(AP4_Mpeg2TsWriter& ts_writer, AP4_Track& track, PesAudioStream*& stream)
+{
+    AP4_SampleDescription *sample_description = track.GetSampleDescription(0);
+    if (sample_description == NULL) return AP4_ERROR_INVALID_FORMAT;
+
+    unsigned int stream_type = 0;
+    unsigned int stream_id   = 0;
+    if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_MP4A) {
+        stream_type = AP4_MPEG2_STREAM_TYPE_ISO_IEC_13818_7;
+        stream_id   = AP4_MPEG2_TS_DEFAULT_STREAM_ID_AUDIO;
+    } else if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_AC_3) {
+        stream_type = AP4_MPEG2_STREAM_TYPE_ATSC_AC3;
+        stream_id   = AP4_MPEG2_TS_STREAM_ID_PRIVATE_STREAM_1;
+    } else if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_EC_3) {
+        stream_type = AP4_MPEG2_STREAM_TYPE_ATSC_EAC3;
+        stream_id   = AP4_MPEG2_TS_STREAM_ID_PRIVATE_STREAM_1;
+    } else {
+        return AP4_ERROR_NOT_SUPPORTED;
+    }
+
+    // setup the audio stream
+    AP4_Mpeg2TsWriter::SampleStream* pmt_stream = NULL;
+    AP4_Result result = ts_writer.SetAudioStream(track.GetMediaTimeScale(),
+                                                 stream_type,
+                                                 stream_id,
+                                                 pmt_stream,
+                                                 AUDIO_PID,
+                                                 NULL, 0,
+                                                 AP4_MPEG2_TS_DEFAULT_PCR_OFFSET);
+    if (AP4_FAILED(result)) return result;
+    return PesAudioStream::Create(track, AUDIO_PID, stream_id, AP4_MPEG2_TS_DEFAULT_PCR_OFFSET, stream);
+}
+
+/*----------------------------------------------------------------------
+|   SharedAudio::GetKey
++---------------------------------------------------------------------*/
+std::string
+SharedAudio::GetKey(InputStream& input)
+{
+    if (input.audio_track == NULL || input.fragment_demuxer || input.audio_index.GetSampleCount() == 0) return "";
+    const SampleIndex& index = input.audio_index;
+    Sha256 hash;
+
+    AP4_UI08 header[17];
+    AP4_BytesFromUInt32BE(header, input.audio_track->GetMediaTimeScale());
+    AP4_BytesFromUInt32BE(header+4, index.GetSampleCount());
+    AP4_BytesFromUInt64BE(header+8, index.GetDts(0));
+    header[16] = input.video_track == NULL;
+    hash.Update(header, sizeof(header));
+
+    for (AP4_Ordinal i = 0; i < input.audio_track->GetSampleDescriptionCount(); i++) {
+        AP4_SampleDescription* sample_description = input.audio_track->GetSampleDescription(i);
+        AP4_Atom* atom = sample_description ? sample_description->ToAtom() : NULL;
+        if (atom == NULL) return "";
+        AP4_MemoryByteStream* atom_data = new AP4_MemoryByteStream();
+        AP4_Result result = atom->Write(*atom_data);
+        delete atom;
+        if (AP4_SUCCEEDED(result)) hash.Update(atom_data->GetData(), atom_data->GetDataSize());
+        atom_data->Release();
+        if (AP4_FAILED(result)) return "";
+    }
+
+    for (AP4_Ordinal i = 0; i < index.GetSampleCount(); i++) {
+        AP4_UI08 entry[17];
+        AP4_BytesFromUInt32BE(entry, index.GetSize(i));
+        AP4_BytesFromUInt32BE(entry+4, index.GetDuration(i));
+        AP4_BytesFromUInt32BE(entry+8, index.GetCtsDelta(i));
+        AP4_BytesFromUInt32BE(entry+12, index.GetDescriptionIndex(i));
+        entry[16] = index.IsSync(i);
+        hash.Update(entry, sizeof(entry));
+    }
+
+    AP4_DataBuffer sample_data;
+    for (unsigned int probe = 0; probe < PROBE_SAMPLE_COUNT; probe++) {
+        AP4_Ordinal i = (AP4_Ordinal)(((AP4_UI64)probe*(index.GetSampleCount()-1))/(PROBE_SAMPLE_COUNT-1));
+        sample_data.SetDataSize(index.GetSize(i));
+        if (AP4_FAILED(input.input->Seek(index.GetOffset(i))) ||
+            AP4_FAILED(input.input->Read(sample_data.UseData(), sample_data.GetDataSize()))) {
+            return "";
+        }
+        hash.Update(sample_data.GetData(), sample_data.GetDataSize());
+    }
+
+    AP4_UI08 digest[32];
+    hash.Final(digest);
+    return std::string((const char*)digest, sizeof(digest));
+}
+
+/*----------------------------------------------------------------------
+|   SharedAudio::Build
++---------------------------------------------------------------------*/
+AP4_Result
+SharedAudio::Build(InputStream& input)
+{
+    TraceSpan span("shared_audio", "mux");
+    AP4_Mpeg2TsWriter ts_writer(PMT_PID);
+    PesAudioStream*   audio_stream = NULL;
+    AP4_Result result = CreateAudioStream(ts_writer, *input.audio_track, audio_stream);
+    if (AP4_FAILED(result)) return result;
+
+    // the packets are appended to a single buffer, sized for all of them up front
+    const SampleIndex& index = input.audio_index;
+    bool               with_pcr = input.video_track == NULL;
+    AP4_UI64           packets_size = 0;
+    for (AP4_Ordinal i = 0; i < index.GetSampleCount(); i++) {
+        packets_size += TsPacketizer::GetPacketCount(index.GetSize(i)+7, false, with_pcr)*AP4_MPEG2TS_PACKET_SIZE;
+    }
+    if (packets_size > MAX_PACKETS_SIZE) {
+        delete audio_stream;
+        return AP4_ERROR_OUT_OF_RANGE;
+    }
+    result = packets.Reserve((AP4_Size)packets_size);
+    if (AP4_FAILED(result)) {
+        delete audio_stream;
+        return result;
+    }
+
+    IndexedSampleReader reader(index, *input.input);
+    AP4_Sample          sample;
+    AP4_DataBuffer      sample_data;
+    sample_offsets.reserve(index.GetSampleCount()+1);
+    sample_offsets.push_back(0);
+    while (AP4_SUCCEEDED(result = reader.ReadSample(sample, sample_data, NULL))) {
+        result = audio_stream->WriteSample(sample, sample_data, with_pcr, packets, NULL);
+        if (AP4_FAILED(result)) break;
+        sample_offsets.push_back(packets.GetDataSize());
+    }
+    delete audio_stream;
+    return result == AP4_ERROR_EOS ? AP4_SUCCESS : result;
+}
+
+/*----------------------------------------------------------------------
+|   SharedAudio::CopySample
++---------------------------------------------------------------------*/
+AP4_Result
+SharedAudio::CopySample(AP4_Ordinal index, AP4_DataBuffer& output, SegmentArena* arena, AP4_UI08& continuity_counter, AP4_ByteStream* stream) const
+{
+    if (index+1 >= sample_offsets.size()) return AP4_ERROR_OUT_OF_RANGE;
+    AP4_Size size = (AP4_Size)(sample_offsets[index+1]-sample_offsets[index]);
+    if (stream) {
+        const AP4_UI08* source = packets.GetData()+sample_offsets[index];
+        for (AP4_Size offset = 0; offset+AP4_MPEG2TS_PACKET_SIZE <= size; offset += AP4_MPEG2TS_PACKET_SIZE) {
+            AP4_UI08 header[4];
+            memcpy(header, source+offset, 4);
+            if (header[3] & 0x10) {
+                header[3] = (header[3] & 0xF0) | continuity_counter;
+                continuity_counter = (continuity_counter+1) & 0x0F;
+            }
+            AP4_Result result = stream->Write(header, 4);
+            if (AP4_SUCCEEDED(result)) result = stream->Write(source+offset+4, AP4_MPEG2TS_PACKET_SIZE-4);
+            if (AP4_FAILED(result)) return result;
+        }
+        return AP4_SUCCESS;
+    }
+    AP4_Result result = arena ? arena->SetDataSize(output, size) : output.SetDataSize(size);
+    if (AP4_FAILED(result)) return result;
+    AP4_UI08* packet = output.UseData();
+    memcpy(packet, packets.GetData()+sample_offsets[index], size);
+    for (AP4_Size offset = 0; offset+AP4_MPEG2TS_PACKET_SIZE <= size; offset += AP4_MPEG2TS_PACKET_SIZE) {
+        // only packets with a payload count
+        if (packet[offset+3] & 0x10) {
+            packet[offset+3] = (packet[offset+3] & 0xF0) | continuity_counter;
+            continuity_counter = (continuity_counter+1) & 0x0F;
+        }
+    }
+    return AP4_SUCCESS;
+}
+
+}
@@ -0,0 +1,198 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#ifndef _BENTO5_TS_PACKETIZER_H_
+#define _BENTO5_TS_PACKETIZER_H_
+
+#include <string>
+#include <vector>
+#include "Ap4.h"
+#include "Bento5Input.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   TsPacketizer
++---------------------------------------------------------------------*/
+// splits PES packets into TS packets stamped from header templates, staged in a buffer
+// or written to a stream
+class TsPacketizer
+{
+public:
+    // part of a PES payload, referenced where it is
+    struct Piece {
+        const AP4_UI08* data;
+        AP4_Size        size;
+    };
+
+    TsPacketizer(AP4_UI16 pid, AP4_UI08 stream_id, AP4_UI64 pcr_offset);
+
+    // append the TS packets of a PES packet to packets, or write them to stream, timestamps in 90kHz
+    AP4_Result WritePes(const std::vector<Piece>& payload, AP4_UI64 dts, AP4_UI64 pts, bool with_dts, bool with_pcr, AP4_DataBuffer& packets, SegmentArena* arena,
+                        AP4_ByteStream* stream = NULL);
+
+    AP4_UI08 GetContinuityCounter() const { return m_ContinuityCounter; }
+    void     SetContinuityCounter(AP4_UI08 continuity_counter) { m_ContinuityCounter = continuity_counter & 0x0F; }
+
+    // number of TS packets of a PES packet with payload_size bytes of payload
+    static AP4_Cardinal GetPacketCount(AP4_UI64 payload_size, bool with_dts, bool with_pcr) {
+        AP4_UI64 pes_size = payload_size+(with_dts ? 19 : 14);
+        AP4_UI64 first_payload_size = AP4_MPEG2TS_PACKET_PAYLOAD_SIZE-(with_pcr ? 2+6 : 0);
+        if (pes_size <= first_payload_size) return 1;
+        return (AP4_Cardinal)(1+(pes_size-first_payload_size+AP4_MPEG2TS_PACKET_PAYLOAD_SIZE-1)/AP4_MPEG2TS_PACKET_PAYLOAD_SIZE);
+    }
+
+private:
+    static void WriteTimestamp(AP4_UI08* field, AP4_UI08 prefix, AP4_UI64 ts) {
+        ts &= 0x1FFFFFFFFULL;
+        field[0] = (AP4_UI08)((prefix << 4) | ((ts >> 29) & 0x0E) | 1);
+        field[1] = (AP4_UI08)(ts >> 22);
+        field[2] = (AP4_UI08)(((ts >> 14) & 0xFE) | 1);
+        field[3] = (AP4_UI08)(ts >> 7);
+        field[4] = (AP4_UI08)(((ts << 1) & 0xFE) | 1);
+    }
+
+    AP4_UI08 m_StreamId;
+    AP4_UI64 m_PcrOffset;
+    AP4_UI08 m_ContinuityCounter;
+    AP4_UI08 m_StartHeader[4]; // packet header templates, with and without payload_unit_start_indicator
+    AP4_UI08 m_Header[4];
+    AP4_UI08 m_PesHeader[19];
+};
+
+/*----------------------------------------------------------------------
+|   AnnexBVideoStream
++---------------------------------------------------------------------*/
+// PES stream of AVC and HEVC samples, the NAL units are gathered from where they are in the sample
+class AnnexBVideoStream
+{
+public:
+    static AP4_Result Create(AP4_Track&          track,
+                             unsigned int        stream_type,
+                             AP4_UI16            pid,
+                             AP4_UI08            stream_id,
+                             AP4_UI64            pcr_offset,
+                             AnnexBVideoStream*& stream);
+
+    // append the TS packets of a sample to packets, in the arena if there is one, or write them to stream
+    AP4_Result WriteSample(const AP4_Sample& sample, const AP4_DataBuffer& sample_data, bool with_pcr, AP4_DataBuffer& packets, SegmentArena* arena,
+                           AP4_ByteStream* stream = NULL);
+
+    // PES payload size of a sample as if it was a single NAL unit
+    AP4_UI64 GetPayloadSize(AP4_Size sample_size, bool sync, AP4_Ordinal description_index) const;
+
+    // exact PES payload size of a sample, from its data
+    AP4_Result GetPayloadSize(const AP4_Sample& sample, const AP4_DataBuffer& sample_data, AP4_UI64& payload_size);
+
+    TsPacketizer& GetPacketizer() { return m_Packetizer; }
+
+private:
+    // what is needed from a sample description to write its samples
+    struct Description {
+        AP4_UI08              nalu_length_size;
+        bool                  in_band;        // avc3/hev1: the keyframes normally carry their own parameter sets
+        std::vector<AP4_UI08> parameter_sets; // with their start codes
+    };
+
+    AnnexBVideoStream(AP4_UI32 timescale, bool hevc, AP4_UI16 pid, AP4_UI08 stream_id, AP4_UI64 pcr_offset);
+
+    // the pieces of the access unit of a sample, in m_Pieces
+    AP4_Result MakePieces(const AP4_Sample& sample, const AP4_DataBuffer& sample_data);
+
+    AP4_UI32                         m_TimeScale;
+    bool                             m_Hevc;
+    TsPacketizer                     m_Packetizer;
+    std::vector<Description>         m_Descriptions;
+    std::vector<TsPacketizer::Piece> m_Pieces;
+};
+
+/*----------------------------------------------------------------------
+|   PesAudioStream
++---------------------------------------------------------------------*/
+// PES stream of AAC (with an ADTS header in front of each frame), AC-3 and E-AC-3 samples
+class PesAudioStream
+{
+public:
+    static AP4_Result Create(AP4_Track& track, AP4_UI16 pid, AP4_UI08 stream_id, AP4_UI64 pcr_offset, PesAudioStream*& stream);
+
+    // append the TS packets of a sample to packets, in the arena if there is one, or write them to stream
+    AP4_Result WriteSample(const AP4_Sample& sample, const AP4_DataBuffer& sample_data, bool with_pcr, AP4_DataBuffer& packets, SegmentArena* arena,
+                           AP4_ByteStream* stream = NULL);
+
+    // PES payload size of a sample of sample_size bytes
+    AP4_UI64 GetPayloadSize(AP4_Size sample_size, AP4_Ordinal description_index) const {
+        const Description& description = m_Descriptions[description_index < m_Descriptions.size() ? description_index : 0];
+        return sample_size+(description.adts ? 7 : 0);
+    }
+
+    TsPacketizer& GetPacketizer() { return m_Packetizer; }
+
+private:
+    // what is needed from a sample description to write its samples
+    struct Description {
+        bool         adts;
+        unsigned int sampling_frequency_index;
+        unsigned int channel_configuration;
+    };
+
+    PesAudioStream(AP4_UI32 timescale, AP4_UI16 pid, AP4_UI08 stream_id, AP4_UI64 pcr_offset) :
+        m_TimeScale(timescale), m_Packetizer(pid, stream_id, pcr_offset) {}
+
+    AP4_UI32                         m_TimeScale;
+    TsPacketizer                     m_Packetizer;
+    std::vector<Description>         m_Descriptions;
+    std::vector<TsPacketizer::Piece> m_Pieces;
+    AP4_UI08                         m_AdtsHeader[7];
+};
+
+/*----------------------------------------------------------------------
+|   CreateAudioStream
++---------------------------------------------------------------------*/
+// the stream of the AP4_Mpeg2TsWriter is only there for the PMT, the samples go through ours
+AP4_Result CreateAudioStream(AP4_Mpeg2TsWriter& ts_writer, AP4_Track& track, PesAudioStream*& stream);
+
+/*----------------------------------------------------------------------
+|   SharedAudio
++---------------------------------------------------------------------*/
+// TS packets of an audio track that several inputs have in common, packetized once
+class SharedAudio {
+public:
+    // number of samples, spread over the track, whose data is part of the key
+    static const unsigned int PROBE_SAMPLE_COUNT = 16;
+    // the packets of a track are kept in memory, larger tracks are packetized by each rendition
+    static const AP4_UI64 MAX_PACKETS_SIZE = 1024*1024*1024;
+
+    // inputs with the same key carry the same audio, empty when the audio cannot be shared
+    static std::string GetKey(InputStream& input);
+
+    // packetize all the audio samples of the input, AP4_ERROR_OUT_OF_RANGE beyond MAX_PACKETS_SIZE
+    AP4_Result Build(InputStream& input);
+
+    // stage the packets of a sample with the continuity counter of the rendition
+    AP4_Result CopySample(AP4_Ordinal index, AP4_DataBuffer& output, SegmentArena* arena, AP4_UI08& continuity_counter, AP4_ByteStream* stream = NULL) const;
+
+private:
+    AP4_DataBuffer        packets;
+    std::vector<AP4_UI64> sample_offsets;
+};
+
+}
+
+#endif // _BENTO5_TS_PACKETIZER_H_
@@ -0,0 +1,259 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+#include <stdio.h>
+#include <stdarg.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <filesystem>
+#include <sstream>
+#include <atomic>
+#include <thread>
+#include <algorithm>
+#include "Bento5Packager.h"
+#include "Bento5Common.h"
+#include "Bento5Committer.h"
+
+namespace Bento5 {
+
+/*----------------------------------------------------------------------
+|   RenditionCheck
++---------------------------------------------------------------------*/
+const AP4_Size     VERIFY_READ_SIZE  = 4096*AP4_MPEG2TS_PACKET_SIZE;
+const unsigned int VERIFY_MAX_ERRORS = 20; // printed per rendition, the others are only counted
+
+// what --verify found in the segments of one rendition folder
+class RenditionCheck {
+public:
+    RenditionCheck(std::filesystem::path folder) : folder(folder), encrypted(false), has_video(false), packet_count(0), error_count(0) {}
+
+    void Error(const char* format, ...) {
+        error_count++;
+        if (errors.size() >= VERIFY_MAX_ERRORS) return;
+        char    buffer[1024];
+        va_list args;
+        va_start(args, format);
+        vsnprintf(buffer, sizeof(buffer), format, args);
+        va_end(args);
+        errors.push_back(buffer);
+    }
+
+    std::filesystem::path    folder;
+    bool                     encrypted; // the segments cannot be read without the key, only the playlist is checked
+    bool                     has_video;
+    std::vector<std::string> segments;
+    std::vector<AP4_SI64>    first_video_pts; // of each segment, -1 when it has none
+    AP4_UI64                 packet_count;
+    AP4_UI64                 error_count;
+    std::vector<std::string> errors;
+};
+
+/*----------------------------------------------------------------------
+|   ReadPesPts
++---------------------------------------------------------------------*/
+// the PTS of the PES packet that starts in this TS packet, -1 if there is none
+static AP4_SI64
+ReadPesPts(const AP4_UI08* packet)
+{
+    unsigned int offset = 4;
+    if (packet[3] & 0x20) offset += 1+packet[4];
+    if (offset+14 > AP4_MPEG2TS_PACKET_SIZE) return -1;
+    const AP4_UI08* pes = packet+offset;
+    if (pes[0] != 0 || pes[1] != 0 || pes[2] != 1 || (pes[7] & 0x80) == 0) return -1;
+    const AP4_UI08* pts = pes+9;
+    return ((AP4_SI64)((pts[0] >> 1) & 0x07) << 30) | ((AP4_SI64)pts[1] << 22) | ((AP4_SI64)(pts[2] >> 1) << 15) |
+           ((AP4_SI64)pts[3] << 7) | (pts[4] >> 1);
+}
+
+/*----------------------------------------------------------------------
+|   VerifyRendition
++---------------------------------------------------------------------*/
+// check the sync bytes, PAT/PMT and continuity counters of the segments of a media playlist
+static void
+VerifyRendition(RenditionCheck& check)
+{
+    std::string playlist;
+    if (AP4_FAILED(ReadTextFile(check.folder/INDEX_FILENAME, playlist))) {
+        check.Error("cannot read %s", INDEX_FILENAME);
+        return;
+    }
+    std::istringstream lines(playlist);
+    std::string        line;
+    while (std::getline(lines, line)) {
+        if (line.size() && line.back() == '\r') line.pop_back();
+        if (line.compare(0, 11, "#EXT-X-KEY:") == 0) check.encrypted = true;
+        if (line.size() && line[0] != '#') check.segments.push_back(line);
+    }
+    if (check.encrypted) return;
+
+    int continuity[0x2000]; // last counter of each PID, -1 before its first packet
+    std::fill(continuity, continuity+0x2000, -1);
+    AP4_UI08* buffer = new AP4_UI08[VERIFY_READ_SIZE];
+    for (unsigned int segment = 0; segment < check.segments.size(); segment++) {
+        const char* name = check.segments[segment].c_str();
+        check.first_video_pts.push_back(-1);
+        int fd = open((check.folder/check.segments[segment]).string().c_str(), O_RDONLY);
+        if (fd < 0) {
+            check.Error("%s: cannot open", name);
+            continue;
+        }
+#if defined(POSIX_FADV_SEQUENTIAL)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+#endif
+        AP4_UI64 packet_index = 0;
+        bool     broken = false;
+        for (;;) {
+            // fill the buffer, it only holds whole packets unless the file ends
+            AP4_Size size = 0;
+            while (size < VERIFY_READ_SIZE) {
+                ssize_t result = read(fd, buffer+size, VERIFY_READ_SIZE-size);
+                if (result < 0 && errno == EINTR) continue;
+                if (result <= 0) break;
+                size += (AP4_Size)result;
+            }
+            if (size % AP4_MPEG2TS_PACKET_SIZE) {
+                check.Error("%s: size is not a multiple of %u", name, AP4_MPEG2TS_PACKET_SIZE);
+                broken = true;
+            }
+            for (const AP4_UI08* packet = buffer; packet+AP4_MPEG2TS_PACKET_SIZE <= buffer+size && !broken; packet += AP4_MPEG2TS_PACKET_SIZE, packet_index++) {
+                if (packet[0] != 0x47) {
+                    check.Error("%s: no sync byte in packet %llu", name, (unsigned long long)packet_index);
+                    broken = true;
+                    break;
+                }
+                unsigned int pid           = ((packet[1] & 0x1F) << 8) | packet[2];
+                bool         unit_start    = (packet[1] & 0x40) != 0;
+                bool         has_payload   = (packet[3] & 0x10) != 0;
+                bool         discontinuity = (packet[3] & 0x20) && packet[4] && (packet[5] & 0x80);
+                int          counter       = packet[3] & 0x0F;
+
+                if (packet_index < 2 && (pid != (packet_index ? PMT_PID : 0) || !unit_start)) {
+                    check.Error("%s: does not start with the PAT and the PMT", name);
+                }
+                if (pid != 0 && pid != PMT_PID && pid != AUDIO_PID && pid != VIDEO_PID) {
+                    check.Error("%s: unexpected PID 0x%x in packet %llu", name, pid, (unsigned long long)packet_index);
+                    continue;
+                }
+
+                int expected = continuity[pid] < 0 || discontinuity ? counter : has_payload ? (continuity[pid]+1) & 0x0F : continuity[pid];
+                if (counter != expected) {
+                    check.Error("%s: continuity counter of PID 0x%x is %d instead of %d in packet %llu", name, pid, counter, expected, (unsigned long long)packet_index);
+                }
+                continuity[pid] = counter;
+
+                if (pid == VIDEO_PID && unit_start) {
+                    check.has_video = true;
+                    if (check.first_video_pts.back() < 0) check.first_video_pts.back() = ReadPesPts(packet);
+                }
+            }
+            if (broken || size < VERIFY_READ_SIZE) break;
+        }
+        close(fd);
+        if (packet_index == 0 && !broken) check.Error("%s: empty", name);
+        check.packet_count += packet_index;
+    }
+    delete[] buffer;
+}
+
+/*----------------------------------------------------------------------
+|   VerifyLadder
++---------------------------------------------------------------------*/
+// --verify: check every media-* folder of an output directory, in parallel
+AP4_Result
+VerifyLadder(const std::string& output_path, unsigned int jobs, std::string& report, std::string& errors)
+{
+    std::filesystem::path output_dir(output_path);
+    if (std::filesystem::is_directory(output_dir/"output")) output_dir /= "output";
+    std::vector<std::pair<unsigned int, std::filesystem::path>> folders;
+    std::error_code error;
+    for (const std::filesystem::directory_entry& entry : std::filesystem::directory_iterator(output_dir, error)) {
+        unsigned int index;
+        char         extra;
+        if (entry.is_directory() && sscanf(entry.path().filename().string().c_str(), "media-%u%c", &index, &extra) == 1) {
+            folders.push_back(std::make_pair(index, entry.path()));
+        }
+    }
+    if (error || folders.empty()) {
+        errors += "no media-* folders in "+output_dir.string()+"\n";
+        return AP4_ERROR_INVALID_PARAMETERS;
+    }
+    std::sort(folders.begin(), folders.end());
+
+    std::vector<RenditionCheck> checks;
+    for (const auto& folder : folders) checks.push_back(RenditionCheck(folder.second));
+    std::atomic<unsigned int> next_check(0);
+    auto verify = [&checks, &next_check]() {
+        for (unsigned int i = next_check++; i < checks.size(); i = next_check++) {
+            VerifyRendition(checks[i]);
+        }
+    };
+    std::vector<std::thread> workers;
+    for (unsigned int i = 1; i < jobs && i < checks.size(); i++) {
+        workers.push_back(std::thread(verify));
+    }
+    verify();
+    std::for_each(workers.begin(), workers.end(), [](std::thread& worker) { worker.join(); });
+
+    // the renditions with video are cut at the same keyframes, the renditions have to line up
+    const RenditionCheck* reference = NULL;
+    for (RenditionCheck& check : checks) {
+        if (check.encrypted || !check.has_video) continue;
+        for (unsigned int i = 0; i < check.first_video_pts.size(); i++) {
+            if (check.first_video_pts[i] < 0) check.Error("%s: no video PTS", check.segments[i].c_str());
+        }
+        if (reference == NULL) {
+            reference = &check;
+            continue;
+        }
+        if (check.segments.size() != reference->segments.size()) {
+            check.Error("%u segments, %s has %u", (unsigned int)check.segments.size(),
+                        reference->folder.filename().string().c_str(), (unsigned int)reference->segments.size());
+        }
+        for (unsigned int i = 0; i < check.segments.size() && i < reference->segments.size(); i++) {
+            if (check.first_video_pts[i] != reference->first_video_pts[i]) {
+                check.Error("%s: starts at PTS %lld, at %lld in %s", check.segments[i].c_str(), (long long)check.first_video_pts[i],
+                            (long long)reference->first_video_pts[i], reference->folder.filename().string().c_str());
+            }
+        }
+    }
+
+    AP4_Result result = AP4_SUCCESS;
+    char       line[256];
+    for (const RenditionCheck& check : checks) {
+        std::string name = check.folder.filename().string();
+        if (check.encrypted) {
+            snprintf(line, sizeof(line), "%s: %u encrypted segments, not checked\n", name.c_str(), (unsigned int)check.segments.size());
+        } else {
+            snprintf(line, sizeof(line), "%s: %u segments, %llu packets, %llu errors\n", name.c_str(), (unsigned int)check.segments.size(),
+                     (unsigned long long)check.packet_count, (unsigned long long)check.error_count);
+        }
+        report += line;
+        for (const std::string& message : check.errors) errors += name+": "+message+"\n";
+        if (check.error_count > check.errors.size()) {
+            snprintf(line, sizeof(line), "%s: %llu more errors\n", name.c_str(), (unsigned long long)(check.error_count-check.errors.size()));
+            errors += line;
+        }
+        if (check.error_count) result = AP4_ERROR_INVALID_FORMAT;
+    }
+    return result;
+}
+
+}
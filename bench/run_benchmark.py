@@ -0,0 +1,250 @@
+#!/usr/bin/env python3
+#
+# copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+#
+# This file is part of Bento5.
+#
+# Bento5 is free software: you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation, either version 3 of the License, or
+# (at your option) any later version.
+#
+# Bento5 is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+#
+
+"""End-to-end throughput benchmark for mov2hls.
+
+Packages every case listed in the baseline file a number of times, records
+wall time, CPU time, peak RSS, bytes read/written and read/write syscalls of
+the mov2hls process, and compares the medians against the checked-in
+baseline. Exits with status 1 if any metric regresses beyond its tolerance,
+has no baseline yet (unless --update-baseline records it), or if a case
+cannot be run at all.
+"""
+
+import argparse
+import json
+import os
+import platform
+import shutil
+import statistics
+import subprocess
+import sys
+import time
+
+METRICS = [
+    "wall_time_s",
+    "cpu_time_s",
+    "peak_rss_kb",
+    "bytes_read",
+    "bytes_written",
+    "read_syscalls",
+    "write_syscalls",
+]
+
+
+def read_proc_io(pid):
+    """Return the /proc/<pid>/io counters, or None when unavailable."""
+    try:
+        with open("/proc/%d/io" % pid) as f:
+            fields = dict(line.split(":", 1) for line in f if ":" in line)
+    except OSError:
+        return None
+    return {key.strip(): int(value) for key, value in fields.items()}
+
+
+def run_once(command):
+    """Run mov2hls once and return its resource usage."""
+    start = time.monotonic()
+    proc = subprocess.Popen(command, stdout=subprocess.DEVNULL)
+
+    # wait for the exit without reaping the child, so that its I/O
+    # accounting is still readable from /proc
+    io = None
+    if hasattr(os, "waitid") and hasattr(os, "WNOWAIT"):
+        os.waitid(os.P_PID, proc.pid, os.WEXITED | os.WNOWAIT)
+        io = read_proc_io(proc.pid)
+    _, status, usage = os.wait4(proc.pid, 0)
+    wall_time = time.monotonic() - start
+    proc.returncode = os.waitstatus_to_exitcode(status)
+    if proc.returncode != 0:
+        raise RuntimeError("%s exited with %d" % (" ".join(command), proc.returncode))
+
+    sample = {
+        "wall_time_s": wall_time,
+        "cpu_time_s": usage.ru_utime + usage.ru_stime,
+        "peak_rss_kb": usage.ru_maxrss,
+    }
+    if io is not None:
+        sample["bytes_read"] = io.get("rchar")
+        sample["bytes_written"] = io.get("wchar")
+        sample["read_syscalls"] = io.get("syscr")
+        sample["write_syscalls"] = io.get("syscw")
+    return sample
+
+
+def describe_machine():
+    """The machine the numbers are measured on, stored with the baseline."""
+    cpu = platform.processor()
+    try:
+        with open("/proc/cpuinfo") as f:
+            for line in f:
+                if line.startswith("model name"):
+                    cpu = line.split(":", 1)[1].strip()
+                    break
+    except OSError:
+        pass
+    return {
+        "host": platform.node(),
+        "cpu": cpu,
+        "cpu_count": os.cpu_count(),
+        "system": "%s %s" % (platform.system(), platform.release()),
+    }
+
+
+def generate_input(source, loop, work_dir):
+    """Concatenate `source` `loop` times into a longer input with ffmpeg."""
+    if loop <= 1:
+        return source
+    target = os.path.join(work_dir, "inputs", "%s.x%d.mp4" % (os.path.splitext(os.path.basename(source))[0], loop))
+    if os.path.exists(target):
+        return target
+    ffmpeg = shutil.which("ffmpeg")
+    if ffmpeg is None:
+        return None
+    os.makedirs(os.path.dirname(target), exist_ok=True)
+    subprocess.check_call([ffmpeg, "-v", "error", "-y", "-stream_loop", str(loop - 1), "-i", source,
+                           "-c", "copy", "-movflags", "+faststart", target])
+    return target
+
+
+def run_case(name, case, args):
+    inputs = []
+    for filename in case["inputs"]:
+        path = generate_input(os.path.join(args.fixtures, filename), case.get("loop", 1), args.work_dir)
+        if path is None:
+            print("%s: cannot generate the inputs, ffmpeg is needed" % name)
+            return None
+        inputs.append(path)
+
+    output_dir = os.path.join(args.work_dir, name)
+    command = [args.mov2hls, "-o", output_dir, "-i", ",".join(inputs)] + case.get("args", [])
+
+    samples = []
+    for _ in range(args.repeat):
+        shutil.rmtree(output_dir, ignore_errors=True)
+        samples.append(run_once(command))
+    shutil.rmtree(output_dir, ignore_errors=True)
+
+    result = {}
+    for metric in METRICS:
+        values = [s[metric] for s in samples if s.get(metric) is not None]
+        if values:
+            result[metric] = statistics.median(values)
+    return result
+
+
+def compare(name, measured, expected, tolerances):
+    """Print a per-metric diff and return the regressed metrics and those without a baseline."""
+    regressions = []
+    missing = []
+    print("%s:" % name)
+    print("  %-16s %16s %16s %9s %9s" % ("metric", "baseline", "measured", "delta", "limit"))
+    for metric in METRICS:
+        if metric not in measured:
+            continue
+        value = measured[metric]
+        base = expected.get(metric)
+        tolerance = tolerances.get(metric, 0.0)
+        if base is None:
+            print("  %-16s %16s %16.6g %9s %9s  NO BASELINE" % (metric, "-", value, "-", "-"))
+            missing.append(metric)
+            continue
+        delta = (value - base) / base if base else 0.0
+        status = ""
+        if value > base * (1.0 + tolerance):
+            status = "REGRESSION"
+            regressions.append(metric)
+        print("  %-16s %16.6g %16.6g %+8.1f%% %+8.1f%%  %s" % (metric, base, value, 100.0 * delta, 100.0 * tolerance, status))
+    return regressions, missing
+
+
+def main():
+    here = os.path.dirname(os.path.abspath(__file__))
+    parser = argparse.ArgumentParser(description="mov2hls end-to-end throughput benchmark")
+    parser.add_argument("--mov2hls", default="./mov2hls", help="path to the mov2hls binary")
+    parser.add_argument("--baseline", default=os.path.join(here, "baseline.json"), help="baseline JSON file")
+    parser.add_argument("--fixtures", default=os.path.join(here, "..", "fixtures"), help="fixtures directory")
+    parser.add_argument("--work-dir", default="bench-work", help="scratch directory for inputs and outputs")
+    parser.add_argument("--repeat", type=int, default=None, help="runs per case (default: from the baseline)")
+    parser.add_argument("--case", action="append", help="only run the named case (can be repeated)")
+    parser.add_argument("--json-out", help="write the measured medians to this file")
+    parser.add_argument("--update-baseline", action="store_true", help="store the measured medians as the new baseline")
+    args = parser.parse_args()
+
+    with open(args.baseline) as f:
+        baseline = json.load(f)
+    if args.repeat is None:
+        args.repeat = baseline.get("repeat", 3)
+    os.makedirs(args.work_dir, exist_ok=True)
+
+    machine = describe_machine()
+    reference = baseline.get("machine")
+    if reference and reference != machine and not args.update_baseline:
+        print("warning: the baseline was measured on %s (%s), this is %s (%s)" %
+              (reference.get("host"), reference.get("cpu"), machine["host"], machine["cpu"]))
+
+    results = {}
+    regressions = []
+    missing = []
+    failed = []
+    for name, case in baseline["cases"].items():
+        if args.case and name not in args.case:
+            continue
+        measured = run_case(name, case, args)
+        if measured is None:
+            failed.append(name)
+            continue
+        results[name] = measured
+        expected = baseline.get("metrics", {}).get(name, {})
+        case_regressions, case_missing = compare(name, measured, expected, baseline.get("tolerances", {}))
+        regressions += ["%s.%s" % (name, metric) for metric in case_regressions]
+        missing += ["%s.%s" % (name, metric) for metric in case_missing]
+
+    if args.json_out:
+        with open(args.json_out, "w") as f:
+            json.dump(results, f, indent=2, sort_keys=True)
+            f.write("\n")
+
+    # a case that cannot run has nothing to record or compare
+    if failed:
+        print("FAILED: could not run %s" % ", ".join(failed))
+        return 1
+
+    if args.update_baseline:
+        baseline["machine"] = machine
+        baseline.setdefault("metrics", {}).update(results)
+        with open(args.baseline, "w") as f:
+            json.dump(baseline, f, indent=2)
+            f.write("\n")
+        print("baseline updated: %s" % args.baseline)
+        return 0
+
+    # a gate without numbers to compare against would always pass
+    if missing:
+        print("FAILED: no baseline for %s, record one with --update-baseline" % ", ".join(missing))
+    if regressions:
+        print("FAILED: %s" % ", ".join(regressions))
+    if missing or regressions:
+        return 1
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
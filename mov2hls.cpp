@@ -20,654 +20,467 @@
 
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
 #include <cxxopts.hpp>
+#include <new>
+#include <algorithm>
+#include <chrono>
 #include <filesystem>
-#include <cmath>
+#include <deque>
+#include <mutex>
+#include <thread>
+#include <condition_variable>
 #include "Ap4.h"
-#include "Ap4Mp4AudioInfo.h"
-
-const uint PMT_PID = 0x100;
-const uint AUDIO_PID = 0x101;
-const uint VIDEO_PID = 0x102;
-
-const char* SEGMENT_FILENAME_TEMPLATE = "segment-%d.ts";
-const char* INDEX_FILENAME = "stream.m3u8";
-
-const float MAX_DTS_DELTA = 0.2;
-
-class Stats {
-public:
-    Stats(): segments_total_size(0), segments_total_duration(0.0), segment_count(0), max_segment_bitrate(0.0), codecs(""), resolution("")  {}
-    AP4_UI64 segments_total_size;
-    double   segments_total_duration;
-    AP4_UI32 segment_count;
-    double   max_segment_bitrate;
-    std::string codecs;
-    std::string resolution;
-};
+#include "Bento5Packager.h"
 
 /*----------------------------------------------------------------------
-|   OpenOutput
+|   operator new
 +---------------------------------------------------------------------*/
-static AP4_ByteStream*
-OpenOutput(std::filesystem::path out_folder, const char* filename_pattern, unsigned int segment_number)
+// heap allocations counted for the stats of the packager (Bento4 included), so that the mux
+// loop can show that it does not allocate
+void* operator new(size_t size)
 {
-    AP4_ByteStream* output = NULL;
-    char filename[4096];
-    sprintf(filename, filename_pattern, segment_number);
-    AP4_Result result = AP4_FileByteStream::Create(std::filesystem::absolute(out_folder.append(filename)).string().c_str(), AP4_FileByteStream::STREAM_MODE_WRITE, output);
-    if (AP4_FAILED(result)) {
-        fprintf(stderr, "ERROR: cannot open output (%d)\n", result);
-        return NULL;
-    }
-
-    return output;
+    Bento5::AllocationCounter::count++;
+    void* memory = malloc(size ? size : 1);
+    if (memory == NULL) throw std::bad_alloc();
+    return memory;
 }
+void* operator new[](size_t size) { return operator new(size); }
+void operator delete(void* memory) noexcept { free(memory); }
+void operator delete[](void* memory) noexcept { free(memory); }
+void operator delete(void* memory, size_t) noexcept { free(memory); }
+void operator delete[](void* memory, size_t) noexcept { free(memory); }
 
 /*----------------------------------------------------------------------
-|   SampleReader
+|   WriteTextFile
 +---------------------------------------------------------------------*/
-class SampleReader
+static AP4_Result
+WriteTextFile(const std::string& path, const std::string& content)
 {
-public:
-    virtual ~SampleReader() {}
-    virtual AP4_Result ReadSample(AP4_Sample& sample, AP4_DataBuffer& sample_data) = 0;
-};
+    AP4_ByteStream* output = NULL;
+    AP4_Result result = AP4_FileByteStream::Create(path.c_str(), AP4_FileByteStream::STREAM_MODE_WRITE, output);
+    if (AP4_FAILED(result)) return result;
+    result = output->Write(content.data(), (AP4_Size)content.size());
+    if (AP4_SUCCEEDED(result)) result = output->WriteString("\n");
+    output->Release();
+    return result;
+}
 
 /*----------------------------------------------------------------------
-|   TrackSampleReader
+|   constants
 +---------------------------------------------------------------------*/
-class TrackSampleReader : public SampleReader
-{
-public:
-    TrackSampleReader(AP4_Track& track) : m_Track(track), m_SampleIndex(0) {}
-    AP4_Result ReadSample(AP4_Sample& sample, AP4_DataBuffer& sample_data);
+const size_t       DAEMON_MAX_REQUEST_SIZE      = 64*1024;
+const unsigned int DAEMON_REQUEST_TIMEOUT       = 10; // seconds to send a whole request
+const int          DAEMON_POLL_INTERVAL         = 500; // milliseconds between the checks for a signal
+const unsigned int DAEMON_MAX_PENDING_REQUESTS  = 64; // connections whose request is being read
+const mode_t       DAEMON_SOCKET_MODE           = 0600; // only the user of the daemon can send jobs
 
-private:
-    AP4_Track&  m_Track;
-    AP4_Ordinal m_SampleIndex;
-};
+static volatile sig_atomic_t DaemonStopping = 0;
 
 /*----------------------------------------------------------------------
-|   TrackSampleReader
+|   DaemonJob
 +---------------------------------------------------------------------*/
-AP4_Result
-TrackSampleReader::ReadSample(AP4_Sample& sample, AP4_DataBuffer& sample_data)
-{
-    if (m_SampleIndex >= m_Track.GetSampleCount()) return AP4_ERROR_EOS;
-    return m_Track.ReadSample(m_SampleIndex++, sample, sample_data);
-}
-
-/*----------------------------------------------------------------------
-|   FragmentedSampleReader
-+---------------------------------------------------------------------*/
-class FragmentedSampleReader : public SampleReader
-{
+// A packaging job sent on a connection to the daemon, as "key value" lines ended by an empty
+// line (or the end of the connection), with "\n" or "\r\n" line ends. The paths are absolute,
+// without "..", and the inputs have to be readable files:
+//   input <path>             once per rendition
+//   output-dir <path>
+//   segment-duration <seconds>
+//   checksums | no-iframe-playlists | no-shared-audio | publish-every <segments>
+// The other options are those of the daemon. The answer is a line per event:
+//   queued <jobs ahead>, started, progress <rendition> <segment> <planned segments>,
+//   warning <message>, stats <json>, done | error <message>
+class DaemonJob : public Bento5::PackagerListener {
 public:
-    FragmentedSampleReader(AP4_LinearReader& fragment_reader, AP4_UI32 track_id) :
-        m_FragmentReader(fragment_reader), m_TrackId(track_id) {
-        fragment_reader.EnableTrack(track_id);
+    DaemonJob(int fd, const Bento5::PackagerOptions& defaults) : fd(fd), connected(true), options(defaults) {}
+    ~DaemonJob() { close(fd); }
+
+    // within DAEMON_REQUEST_TIMEOUT for the whole request, and until the daemon stops
+    AP4_Result ReadRequest(std::string& error);
+
+    // a line of the answer, dropped once the client is gone
+    void Send(const std::string& line) {
+        std::lock_guard<std::mutex> guard(lock);
+        std::string data = line+"\n";
+        for (size_t sent = 0; connected && sent < data.size();) {
+            ssize_t size = send(fd, data.data()+sent, data.size()-sent, MSG_NOSIGNAL);
+            if (size < 0 && errno == EINTR) continue;
+            if (size <= 0) connected = false;
+            else sent += size;
+        }
     }
-    AP4_Result ReadSample(AP4_Sample& sample, AP4_DataBuffer& sample_data);
 
-private:
-    AP4_LinearReader& m_FragmentReader;
-    AP4_UI32          m_TrackId;
+    // PackagerListener methods
+    void OnSegmentWritten(unsigned int rendition, unsigned int segment_number, unsigned int planned_count) {
+        Send("progress "+std::to_string(rendition)+" "+std::to_string(segment_number)+" "+std::to_string(planned_count));
+    }
+
+    int                                fd;
+    bool                               connected;
+    std::mutex                         lock;
+    std::vector<Bento5::PackagerInput> inputs;
+    Bento5::PackagerOptions            options;
 };
 
 /*----------------------------------------------------------------------
-|   FragmentedSampleReader
+|   IsDaemonPath
 +---------------------------------------------------------------------*/
-AP4_Result
-FragmentedSampleReader::ReadSample(AP4_Sample& sample, AP4_DataBuffer& sample_data)
+// the paths of the jobs do not depend on where the daemon runs from, and stay where they point to
+static bool
+IsDaemonPath(const std::string& path)
 {
-    return m_FragmentReader.ReadNextSample(m_TrackId, sample, sample_data);
+    std::filesystem::path file_path(path);
+    if (!file_path.is_absolute()) return false;
+    return std::find(file_path.begin(), file_path.end(), std::filesystem::path("..")) == file_path.end();
 }
 
 /*----------------------------------------------------------------------
-|   ReadSample
+|   DaemonJob::ReadRequest
 +---------------------------------------------------------------------*/
-static AP4_Result
-ReadSample(SampleReader&   reader,
-           AP4_Track&      track,
-           AP4_Sample&     sample,
-           AP4_DataBuffer& sample_data,
-           double&         ts,
-           double&         duration,
-           bool&           eos)
+AP4_Result
+DaemonJob::ReadRequest(std::string& error)
 {
-    AP4_Result result = reader.ReadSample(sample, sample_data);
-    if (AP4_FAILED(result)) {
-        if (result == AP4_ERROR_EOS) {
-            ts += duration;
-            eos = true;
-        } else {
-            return result;
+    // up to the empty line
+    std::string request;
+    char        buffer[4096];
+    auto        deadline = std::chrono::steady_clock::now()+std::chrono::seconds(DAEMON_REQUEST_TIMEOUT);
+    while (request.find("\n\n") == std::string::npos && request.find("\n\r\n") == std::string::npos) {
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(deadline-std::chrono::steady_clock::now()).count();
+        if (left <= 0 || DaemonStopping) {
+            error = DaemonStopping ? "the daemon is stopping" : "incomplete request";
+            return AP4_ERROR_READ_FAILED;
         }
-    }
-    ts = (double)sample.GetDts()/(double)track.GetMediaTimeScale();
-    duration = sample.GetDuration()/(double)track.GetMediaTimeScale();
-
-    return AP4_SUCCESS;
-}
-
-
-class InputStream {
-public:
-    InputStream(std::string file_path) : file_path(file_path), input(NULL), input_file(NULL), movie(NULL), audio_track(NULL), video_track(NULL),
-        linear_reader(NULL), audio_reader(NULL), video_reader(NULL) {
-        AP4_Result result;
-        result = AP4_FileByteStream::Create(file_path.data(), AP4_FileByteStream::STREAM_MODE_READ, input);
-        if (AP4_FAILED(result)) {
-            fprintf(stderr, "ERROR: cannot open input (%s)\n", file_path.data());
-            exit(-1);
+        struct pollfd request_poll = { fd, POLLIN, 0 };
+        int ready = poll(&request_poll, 1, (int)std::min<long long>(left, DAEMON_POLL_INTERVAL));
+        if (ready < 0 && errno != EINTR) {
+            error = "incomplete request";
+            return AP4_ERROR_READ_FAILED;
         }
-        // open the file
-        input_file = new AP4_File(*input, true);
-
-        // get the movie
-        movie = input_file->GetMovie();
-        if (movie == NULL) {
-            fprintf(stderr, "ERROR: no movie in file %s\n", file_path.data());
-            exit(-1);
+        if (ready <= 0) continue;
+        ssize_t size = recv(fd, buffer, sizeof(buffer), MSG_DONTWAIT);
+        if (size < 0 && (errno == EINTR || errno == EAGAIN || errno == EWOULDBLOCK)) continue;
+        if (size < 0) {
+            error = "incomplete request";
+            return AP4_ERROR_READ_FAILED;
         }
-        // get the audio and video tracks
-        audio_track = movie->GetTrack(AP4_Track::TYPE_AUDIO);
-        video_track = movie->GetTrack(AP4_Track::TYPE_VIDEO);
-
-        if (audio_track == NULL && video_track == NULL) {
-            fprintf(stderr, "ERROR: no video and audio track in %s\n", file_path.data());
-            exit(-1);
+        if (size == 0) break;
+        request.append(buffer, size);
+        if (request.size() > DAEMON_MAX_REQUEST_SIZE) {
+            error = "request too large";
+            return AP4_ERROR_INVALID_PARAMETERS;
         }
+    }
 
-        if (movie->HasFragments()) {
-            // create a linear reader to get the samples
-            linear_reader = new AP4_LinearReader(*movie, input);
-
-            if (audio_track) {
-                linear_reader->EnableTrack(audio_track->GetId());
-                audio_reader = new FragmentedSampleReader(*linear_reader, audio_track->GetId());
+    for (size_t start = 0, end; start < request.size(); start = end+1) {
+        end = request.find('\n', start);
+        if (end == std::string::npos) end = request.size();
+        std::string line = request.substr(start, end-start);
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) break;
+        size_t      space = line.find(' ');
+        std::string key   = line.substr(0, space);
+        std::string value = space == std::string::npos ? "" : line.substr(space+1);
+        if ((key == "input" || key == "output-dir") && !IsDaemonPath(value)) {
+            error = "not an absolute path without \"..\": "+line;
+            return AP4_ERROR_INVALID_PARAMETERS;
+        }
+        if (key == "input") {
+            std::error_code status_error;
+            if (!std::filesystem::is_regular_file(value, status_error) || access(value.c_str(), R_OK) != 0) {
+                error = "cannot read input "+value;
+                return AP4_ERROR_INVALID_PARAMETERS;
             }
-            if (video_track) {
-                linear_reader->EnableTrack(video_track->GetId());
-                video_reader = new FragmentedSampleReader(*linear_reader, video_track->GetId());
+            inputs.push_back(Bento5::PackagerInput(value));
+        } else if (key == "output-dir") {
+            std::error_code status_error;
+            if (std::filesystem::exists(value, status_error) && !std::filesystem::is_directory(value, status_error)) {
+                error = "output-dir is not a directory: "+value;
+                return AP4_ERROR_INVALID_PARAMETERS;
             }
+            options.output_dir = value;
+        } else if (key == "segment-duration" && atof(value.c_str()) > 0) {
+            options.segment_duration = atof(value.c_str());
+        } else if (key == "publish-every") {
+            options.publish_every = (unsigned int)strtoul(value.c_str(), NULL, 10);
+        } else if (key == "checksums") {
+            options.checksums = true;
+        } else if (key == "no-iframe-playlists") {
+            options.iframe_playlists = false;
+        } else if (key == "no-shared-audio") {
+            options.shared_audio = false;
         } else {
-            if (audio_track) {
-                audio_reader = new TrackSampleReader(*audio_track);
-            }
-            if (video_track) {
-                video_reader = new TrackSampleReader(*video_track);
-            }
-        }
-    };
-    ~InputStream(){
-        if(input != NULL) {
-            input->Release();
-        }
-        delete input_file;
-        delete video_reader;
-        delete audio_reader;
-        delete linear_reader;
-    };
-
-    std::vector<float> getKeyframesDTSTimeList() {
-        std::vector<float> array;
-        AP4_Track* video_track = movie->GetTrack(AP4_Track::TYPE_VIDEO);
-        if (video_track) {
-            AP4_Sample sample;
-            for(unsigned int i = 0; i < video_track->GetSampleCount(); i++) {
-                AP4_Result result = video_track->GetSample(i, sample);
-                if (AP4_FAILED(result)) {
-                    fprintf(stderr, "failed to get video sample in %s", file_path.c_str());
-                    exit(-1);
-                }
-                if (sample.IsSync()) {
-                    array.push_back(float(sample.GetDts()) / video_track->GetMediaTimeScale());
-                }
-            }
+            error = "invalid request line: "+line;
+            return AP4_ERROR_INVALID_PARAMETERS;
         }
-        return array;
     }
-private:
-    std::string file_path;
-    AP4_ByteStream* input;
-    AP4_File* input_file;
-    AP4_Movie* movie;
-    AP4_Track* audio_track;
-    AP4_Track* video_track;
-    AP4_LinearReader* linear_reader;
-    SampleReader*     audio_reader;
-    SampleReader*     video_reader;
-    friend class OutputStream;
-};
+    if (inputs.empty() || options.output_dir.empty()) {
+        error = "a job needs inputs and an output directory";
+        return AP4_ERROR_INVALID_PARAMETERS;
+    }
+    return AP4_SUCCESS;
+}
 
-class OutputStream {
+/*----------------------------------------------------------------------
+|   DaemonQueue
++---------------------------------------------------------------------*/
+// the jobs waiting for one of the workers
+class DaemonQueue {
 public:
-    OutputStream(std::filesystem::path out_folder, const InputStream* input): ts_writer(NULL), audio_stream(NULL), video_stream(NULL), input_stream(input), out_folder(out_folder) {
-        if (bool flag = std::filesystem::create_directories(out_folder); flag == false) {
-            fprintf(stderr, "failed to create output folder at %s, maybe it already exists?\n", std::filesystem::absolute(out_folder).string().c_str());
-            exit(-1);
-        }
-        // create an MPEG2 TS Writer
-        ts_writer = new AP4_Mpeg2TsWriter(PMT_PID);
-        // add the audio stream
-        if (input->audio_track) {
-            AP4_SampleDescription *sample_description = input->audio_track->GetSampleDescription(0);
-            if (sample_description == NULL) {
-                fprintf(stderr, "ERROR: unable to parse audio sample description of %s\n", input->file_path.data());
-                exit(-1);
-            }
-
-            unsigned int stream_type = 0;
-            unsigned int stream_id   = 0;
-            if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_MP4A) {
-                stream_type = AP4_MPEG2_STREAM_TYPE_ISO_IEC_13818_7;
-                stream_id   = AP4_MPEG2_TS_DEFAULT_STREAM_ID_AUDIO;
-            } else if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_AC_3) {
-                stream_type = AP4_MPEG2_STREAM_TYPE_ATSC_AC3;
-                stream_id   = AP4_MPEG2_TS_STREAM_ID_PRIVATE_STREAM_1;
-            } else if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_EC_3) {
-                stream_type = AP4_MPEG2_STREAM_TYPE_ATSC_EAC3;
-                stream_id   = AP4_MPEG2_TS_STREAM_ID_PRIVATE_STREAM_1;
-            } else {
-                fprintf(stderr, "ERROR: audio codec not supported for %s\n", input->file_path.data());
-                exit(-1);
-            }
-
-            // setup the audio stream
-            AP4_Result result = ts_writer->SetAudioStream(input->audio_track->GetMediaTimeScale(),
-                                                          stream_type,
-                                                          stream_id,
-                                                          audio_stream,
-                                                          AUDIO_PID,
-                                                          NULL, 0,
-                                                          AP4_MPEG2_TS_DEFAULT_PCR_OFFSET);
-            if (AP4_FAILED(result)) {
-                fprintf(stderr, "could not create audio stream of %s\n", input->file_path.data());
-                exit(-1);
-            }
-        }
-
-        // add the video stream
-        if (input->video_track) {
-            AP4_SampleDescription *sample_description = input->video_track->GetSampleDescription(0);
-            if (sample_description == NULL) {
-                fprintf(stderr, "ERROR: unable to parse video sample description of %s\n", input->file_path.data());
-                exit(-1);
-            }
-
-            // decide on the stream type
-            unsigned int stream_type = 0;
-            unsigned int stream_id   = AP4_MPEG2_TS_DEFAULT_STREAM_ID_VIDEO;
-            if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_AVC1 ||
-                    sample_description->GetFormat() == AP4_SAMPLE_FORMAT_AVC2 ||
-                    sample_description->GetFormat() == AP4_SAMPLE_FORMAT_AVC3 ||
-                    sample_description->GetFormat() == AP4_SAMPLE_FORMAT_AVC4 ||
-                    sample_description->GetFormat() == AP4_SAMPLE_FORMAT_DVAV ||
-                    sample_description->GetFormat() == AP4_SAMPLE_FORMAT_DVA1) {
-                stream_type = AP4_MPEG2_STREAM_TYPE_AVC;
-            } else if (sample_description->GetFormat() == AP4_SAMPLE_FORMAT_HEV1 ||
-                       sample_description->GetFormat() == AP4_SAMPLE_FORMAT_HVC1 ||
-                       sample_description->GetFormat() == AP4_SAMPLE_FORMAT_DVHE ||
-                       sample_description->GetFormat() == AP4_SAMPLE_FORMAT_DVH1) {
-                stream_type = AP4_MPEG2_STREAM_TYPE_HEVC;
-            } else {
-                fprintf(stderr, "ERROR: video codec not supported for %s\n", input->file_path.data());
-                exit(-1);
-            }
-
-            // setup the video stream
-            AP4_Result result = ts_writer->SetVideoStream(input->video_track->GetMediaTimeScale(),
-                                                          stream_type,
-                                                          stream_id,
-                                                          video_stream,
-                                                          VIDEO_PID,
-                                                          NULL, 0,
-                                                          AP4_MPEG2_TS_DEFAULT_PCR_OFFSET);
-            if (AP4_FAILED(result)) {
-                fprintf(stderr, "could not create video stream of %s\n", input->file_path.data());
-                exit(-1);
-            }
-        }
-    };
-    ~OutputStream() {
-        delete ts_writer;
-        delete input_stream;
-    };
-
-    static AP4_Result write_samples(OutputStream *output, float seg_duration, std::vector<float> segmentPoints) {
-        AP4_Sample              audio_sample;
-        AP4_DataBuffer          audio_sample_data;
-        unsigned int            audio_sample_count = 0;
-        double                  audio_ts = 0.0;
-        double                  audio_frame_duration = 0.0;
-        bool                    audio_eos = false;
-        AP4_Sample              video_sample;
-        AP4_DataBuffer          video_sample_data;
-        unsigned int            video_sample_count = 0;
-        double                  video_ts = 0.0;
-        double                  video_frame_duration = 0.0;
-        bool                    video_eos = false;
-        double                  last_ts = 0.0;
-        unsigned int            segment_number = 0;
-        AP4_ByteStream*         segment_output = NULL;
-        double                  segment_duration = 0.0;
-        AP4_Array<double>       segment_durations;
-        AP4_Array<AP4_UI32>     segment_sizes;
-        AP4_Position            segment_position = 0;
-        AP4_Array<AP4_Position> segment_positions;
-        bool                    new_segment = true;
-        AP4_ByteStream*         playlist = NULL;
-        char                    string_buffer[4096];
-        AP4_Result              result = AP4_SUCCESS;
-
-        const InputStream *input = output->input_stream;
-
-        // prime the samples
-        if (input->audio_reader) {
-            result = ReadSample(*input->audio_reader, *input->audio_track, audio_sample, audio_sample_data, audio_ts, audio_frame_duration, audio_eos);
-            if (AP4_FAILED(result)) return result;
-        }
-        if (input->video_reader) {
-            result = ReadSample(*input->video_reader, *input->video_track, video_sample, video_sample_data, video_ts, video_frame_duration, video_eos);
-            if (AP4_FAILED(result)) return result;
-        }
-
-        for (;;) {
-            bool sync_sample = false;
-            AP4_Track* chosen_track= NULL;
-            if (input->audio_track && !audio_eos) {
-                chosen_track = input->audio_track;
-                if (input->video_track == NULL) sync_sample = true;
-            }
-            if (input->video_track && !video_eos) {
-                if (input->audio_track) {
-                    if (video_ts <= audio_ts) {
-                        chosen_track = input->video_track;
-                    }
-                } else {
-                    chosen_track = input->video_track;
-                }
-                if (chosen_track == input->video_track && video_sample.IsSync()) {
-                    sync_sample = true;
-                }
-            }
-
-            // check if we need to start a new segment
-            if (seg_duration && (sync_sample || chosen_track == NULL)) {
-                if (input->video_track) {
-                    segment_duration = video_ts - last_ts;
-                } else {
-                    segment_duration = audio_ts - last_ts;
-                }
-                if ( (input->video_track == NULL && segment_duration >= seg_duration)
-                     || (input->video_track != NULL && std::find_if(segmentPoints.begin(), segmentPoints.end(), [video_ts](float x) {return abs(x - video_ts) <= 2 * MAX_DTS_DELTA; }) != segmentPoints.end())
-                     || chosen_track == NULL) {
-                    if (input->video_track) {
-                        last_ts = video_ts;
-                    } else {
-                        last_ts = audio_ts;
-                    }
-                    if (segment_output) {
-                        // flush the output stream
-                        segment_output->Flush();
-
-                        // compute the segment size (including padding)
-                        AP4_Position segment_end = 0;
-                        segment_output->Tell(segment_end);
-                        AP4_UI32 segment_size = 0;
-                        if (segment_end > segment_position) {
-                            segment_size = (AP4_UI32)(segment_end-segment_position);
-                        }
-
-                        // update counters
-                        segment_sizes.Append(segment_size);
-                        segment_positions.Append(segment_position);
-                        segment_durations.Append(segment_duration);
-
-                        if (abs(segment_duration) > 0.0) {
-                            double segment_bitrate = 8.0*(double)segment_size/segment_duration;
-                            if (segment_bitrate > output->stats.max_segment_bitrate) {
-                                output->stats.max_segment_bitrate = segment_bitrate;
-                            }
-                        }
-                        segment_output->Release();
-                        segment_output = NULL;
-
-                        ++segment_number;
-                        audio_sample_count = 0;
-                        video_sample_count = 0;
-                    }
-                    new_segment = true;
-                }
-            }
-
-            // check if we're done
-            if (chosen_track == NULL) break;
-
-            if (new_segment) {
-                new_segment = false;
-
-                // compute the new segment position
-                segment_position = 0;
-
-                // manage the new segment stream
-                if (segment_output == NULL) {
-                    segment_output = OpenOutput(output->out_folder, SEGMENT_FILENAME_TEMPLATE, segment_number);
-                    if (segment_output == NULL) return AP4_ERROR_CANNOT_OPEN_FILE;
-                }
-
-                // write the PAT and PMT
-                if (output->ts_writer) {
-                    output->ts_writer->WritePAT(*segment_output);
-                    output->ts_writer->WritePMT(*segment_output);
-                }
-            }
+    DaemonQueue() : stopping(false) {}
+
+    // tells the job the number of jobs ahead of it, before a worker can take (and delete) it
+    void Push(DaemonJob* job) {
+        std::lock_guard<std::mutex> guard(lock);
+        job->Send("queued "+std::to_string(jobs.size()));
+        jobs.push_back(job);
+        wake.notify_one();
+    }
 
-            // write the samples out and advance to the next sample
-            if (chosen_track == input->audio_track) {
-
-                // write the sample data
-                if (output->audio_stream) {
-                    result = output->audio_stream->WriteSample(audio_sample,
-                                                               audio_sample_data,
-                                                               input->audio_track->GetSampleDescription(audio_sample.GetDescriptionIndex()),
-                                                               input->video_track==NULL,
-                                                               *segment_output);
-                } else {
-                    return AP4_ERROR_INTERNAL;
-                }
-                if (AP4_FAILED(result)) return result;
-
-                result = ReadSample(*input->audio_reader, *input->audio_track, audio_sample, audio_sample_data, audio_ts, audio_frame_duration, audio_eos);
-                if (AP4_FAILED(result)) return result;
-                ++audio_sample_count;
-            } else if (chosen_track == input->video_track) {
-                // write the sample data
-                AP4_Position frame_start = 0;
-                segment_output->Tell(frame_start);
-                result = output->video_stream->WriteSample(video_sample,
-                                                           video_sample_data,
-                                                           input->video_track->GetSampleDescription(video_sample.GetDescriptionIndex()),
-                                                           true,
-                                                           *segment_output);
-                if (AP4_FAILED(result)) return result;
-                AP4_Position frame_end = 0;
-                segment_output->Tell(frame_end);
-
-                // read the next sample
-                result = ReadSample(*input->video_reader, *input->video_track, video_sample, video_sample_data, video_ts, video_frame_duration, video_eos);
-                if (AP4_FAILED(result)) return result;
-                ++video_sample_count;
-            } else {
-                break;
-            }
-        }
+    // NULL once stopped and empty
+    DaemonJob* Pop() {
+        std::unique_lock<std::mutex> guard(lock);
+        wake.wait(guard, [this] { return stopping || !jobs.empty(); });
+        if (jobs.empty()) return NULL;
+        DaemonJob* job = jobs.front();
+        jobs.pop_front();
+        return job;
+    }
 
-        // create the media playlist/index file
-        playlist = OpenOutput(output->out_folder, INDEX_FILENAME, 0);
-        if (playlist == NULL) return AP4_ERROR_CANNOT_OPEN_FILE;
+    // the workers finish the jobs queued so far
+    void Stop() {
+        std::lock_guard<std::mutex> guard(lock);
+        stopping = true;
+        wake.notify_all();
+    }
 
-        unsigned int target_duration = 0;
-        double       total_duration = 0.0;
-        for (unsigned int i=0; i<segment_durations.ItemCount(); i++) {
-            if ((unsigned int)(segment_durations[i]+0.5) > target_duration) {
-                target_duration = (unsigned int)segment_durations[i];
-            }
-            total_duration += segment_durations[i];
-        }
+private:
+    bool                    stopping;
+    std::deque<DaemonJob*>  jobs;
+    std::mutex              lock;
+    std::condition_variable wake;
+};
 
-        playlist->WriteString("#EXTM3U\r\n");
-        sprintf(string_buffer, "#EXT-X-VERSION:%d\r\n", 3);
-        playlist->WriteString(string_buffer);
-        playlist->WriteString("#EXT-X-PLAYLIST-TYPE:VOD\r\n");
-        if (input->video_track) {
-            playlist->WriteString("#EXT-X-INDEPENDENT-SEGMENTS\r\n");
-        }
-        playlist->WriteString("#EXT-X-TARGETDURATION:");
-        sprintf(string_buffer, "%d\r\n", target_duration);
-        playlist->WriteString(string_buffer);
-        playlist->WriteString("#EXT-X-MEDIA-SEQUENCE:0\r\n");
-
-        for (unsigned int i=0; i<segment_durations.ItemCount(); i++) {
-            sprintf(string_buffer, "#EXTINF:%f,\r\n", segment_durations[i]);
-            playlist->WriteString(string_buffer);
-            sprintf(string_buffer, SEGMENT_FILENAME_TEMPLATE, i);
-            playlist->WriteString(string_buffer);
-            playlist->WriteString("\r\n");
-        }
+/*----------------------------------------------------------------------
+|   RunDaemonJob
++---------------------------------------------------------------------*/
+static void
+RunDaemonJob(DaemonJob* job)
+{
+    job->Send("started");
+    Bento5::Packager packager(job->inputs, job->options);
+    AP4_Result       result = packager.Run(NULL, job);
+    for (const std::string& warning : packager.GetWarnings()) job->Send("warning "+warning);
+    if (AP4_FAILED(result)) {
+        job->Send("error "+packager.GetError());
+    } else {
+        job->Send("stats "+packager.GetStatsJson());
+        job->Send("done");
+    }
+    delete job;
+}
 
-        playlist->WriteString("#EXT-X-ENDLIST\r\n");
-        playlist->Release();
+/*----------------------------------------------------------------------
+|   StopDaemon
++---------------------------------------------------------------------*/
+static void
+StopDaemon(int /*signal*/)
+{
+    DaemonStopping = 1;
+}
 
-        // update stats
-        output->stats.segment_count = segment_sizes.ItemCount();
-        output->stats.segments_total_duration = total_duration;
-        for (unsigned int i=0; i<segment_sizes.ItemCount(); i++) {
-            output->stats.segments_total_size  += segment_sizes[i];
+/*----------------------------------------------------------------------
+|   RunDaemon
++---------------------------------------------------------------------*/
+// --daemon: package the jobs sent on a Unix socket, at most worker_count at a time, until SIGINT
+// or SIGTERM. The jobs start from the options of the daemon, and write their renditions one after
+// the other, the workers are what bounds the packaging running on the host.
+static AP4_Result
+RunDaemon(const std::string& socket_path, const Bento5::PackagerOptions& defaults, unsigned int worker_count)
+{
+    struct sockaddr_un address;
+    memset(&address, 0, sizeof(address));
+    address.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(address.sun_path)) {
+        fprintf(stderr, "ERROR: socket path too long: %s\n", socket_path.c_str());
+        return AP4_ERROR_INVALID_PARAMETERS;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+
+    // the socket of a daemon that is gone is replaced, not the one of a running daemon
+    struct stat info;
+    if (stat(socket_path.c_str(), &info) == 0 && S_ISSOCK(info.st_mode)) {
+        int probe_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (probe_fd >= 0 && connect(probe_fd, (struct sockaddr*)&address, sizeof(address)) < 0 && errno == ECONNREFUSED) {
+            unlink(socket_path.c_str());
         }
+        if (probe_fd >= 0) close(probe_fd);
+    }
+    int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listen_fd < 0) {
+        fprintf(stderr, "ERROR: cannot create socket (%s)\n", strerror(errno));
+        return AP4_ERROR_CANNOT_OPEN_FILE;
+    }
+    // created without the permissions of the others, before anyone can connect
+    mode_t previous_umask = umask(0777 & ~DAEMON_SOCKET_MODE);
+    int    bound          = bind(listen_fd, (struct sockaddr*)&address, sizeof(address));
+    umask(previous_umask);
+    if (bound < 0 || chmod(socket_path.c_str(), DAEMON_SOCKET_MODE) < 0 || listen(listen_fd, SOMAXCONN) < 0) {
+        fprintf(stderr, "ERROR: cannot listen on %s (%s)\n", socket_path.c_str(), strerror(errno));
+        close(listen_fd);
+        if (bound == 0) unlink(socket_path.c_str());
+        return AP4_ERROR_CANNOT_OPEN_FILE;
+    }
 
-        // get codecs and resolution
-        std::vector<std::string> codecs;
-        if(input->audio_track) {
-            AP4_String codec;
-            AP4_SampleDescription *sdesc = input->audio_track->GetSampleDescription(0);
-            if (sdesc) {
-                sdesc ->GetCodecString(codec);
-                codecs.push_back(std::string(codec.GetChars()));
-            }
-        }
-        if(input->video_track) {
-            AP4_String codec;
-            AP4_SampleDescription *sdesc = input->video_track->GetSampleDescription(0);
-            if (sdesc) {
-                sdesc ->GetCodecString(codec);
-                codecs.push_back(std::string(codec.GetChars()));
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = StopDaemon;
+    sigaction(SIGINT, &action, NULL);
+    sigaction(SIGTERM, &action, NULL);
+    signal(SIGPIPE, SIG_IGN);
+
+    // the same workers run every job
+    Bento5::PackagerOptions job_defaults = defaults;
+    job_defaults.jobs    = 1;
+    job_defaults.profile = true;
+    job_defaults.plan    = false;
+    job_defaults.plan_out.clear();
+    job_defaults.plan_in.clear();
+    job_defaults.shard_index = job_defaults.shard_count = 0;
+    job_defaults.merge   = 0;
+    job_defaults.resume  = false;
+    DaemonQueue              queue;
+    std::vector<std::thread> workers;
+    for (unsigned int i = 0; i < worker_count; i++) {
+        workers.push_back(std::thread([&queue]() {
+            while (DaemonJob* job = queue.Pop()) RunDaemonJob(job);
+        }));
+    }
+    fprintf(stderr, "listening on %s with %u workers\n", socket_path.c_str(), worker_count);
+
+    // the requests are read by threads of their own, a slow client does not hold the others
+    unsigned int            reader_count = 0;
+    std::mutex              reader_lock;
+    std::condition_variable reader_done;
+    while (!DaemonStopping) {
+        struct pollfd listen_poll = { listen_fd, POLLIN, 0 };
+        int ready = poll(&listen_poll, 1, DAEMON_POLL_INTERVAL);
+        if (ready <= 0) continue;
+        int fd = accept(listen_fd, NULL, NULL);
+        if (fd < 0) continue;
+        DaemonJob* job = new DaemonJob(fd, job_defaults);
+        {
+            std::lock_guard<std::mutex> guard(reader_lock);
+            if (reader_count >= DAEMON_MAX_PENDING_REQUESTS) {
+                job->Send("error too many pending requests");
+                delete job;
+                continue;
             }
-            char buffer[1024];
-            AP4_VideoSampleDescription* vsd = AP4_DYNAMIC_CAST(AP4_VideoSampleDescription, input->video_track->GetSampleDescription(0));
-            sprintf(buffer, "%dx%d", vsd->GetWidth(), vsd->GetHeight());
-            output->stats.resolution = std::string(buffer);
+            reader_count++;
         }
-        std::ostringstream ss_codecs;
-        std::copy(codecs.rbegin(),codecs.rend(), std::ostream_iterator<std::string>(ss_codecs,","));
-        output->stats.codecs = ss_codecs.str().substr(0, ss_codecs.str().size()-1);
-
-        if (segment_output) segment_output->Release();
-        return result;
-    }
-    static AP4_Result generateMasterPlaylist(std::vector<OutputStream*> output_streams, std::filesystem::path output_dir) {
-        AP4_ByteStream* playlist = OpenOutput(output_dir, "master.m3u8", 0);
-        if (playlist == NULL) return AP4_ERROR_CANNOT_OPEN_FILE;
-
-
-        playlist->WriteString("#EXTM3U\r\n");
-        playlist->WriteString("# Created with Bento5 mov2hls\r\n\r\n");
-        playlist->WriteString("# Media Playlists\r\n");
-
-        std::for_each(output_streams.begin(), output_streams.end(), [playlist](OutputStream* os) {
-            char string_buffer[4096];
-            sprintf(string_buffer, "#EXT-X-STREAM-INF:AVERAGE-BANDWIDTH=%d,BANDWIDTH=%d,CODECS=\"%s\"", int(ceil(8.0 * os->stats.segments_total_size/os->stats.segments_total_duration)), int(ceil(os->stats.max_segment_bitrate)), os->stats.codecs.c_str());
-            playlist->WriteString(string_buffer);
-            if (os->input_stream->video_track) {
-                sprintf(string_buffer, ",RESOLUTION=%s", os->stats.resolution.c_str());
-                playlist->WriteString(string_buffer);
+        std::thread([job, &queue, &reader_count, &reader_lock, &reader_done]() {
+            std::string error;
+            if (AP4_FAILED(job->ReadRequest(error))) {
+                job->Send("error "+error);
+                delete job;
+            } else {
+                queue.Push(job);
             }
-            playlist->WriteString("\r\n");
-            sprintf(string_buffer, "%s/stream.m3u8\r\n", os->out_folder.filename().string().c_str());
-            playlist->WriteString(string_buffer);
-        });
-        return AP4_SUCCESS;
+            std::lock_guard<std::mutex> guard(reader_lock);
+            reader_count--;
+            reader_done.notify_all();
+        }).detach();
     }
 
+    fprintf(stderr, "stopping, finishing the queued jobs\n");
+    close(listen_fd);
+    unlink(socket_path.c_str());
+    {
+        // the readers give up at the next poll, the jobs read by then are still queued
+        std::unique_lock<std::mutex> guard(reader_lock);
+        reader_done.wait(guard, [&reader_count] { return reader_count == 0; });
+    }
+    queue.Stop();
+    std::for_each(workers.begin(), workers.end(), [](std::thread& worker) { worker.join(); });
+    return AP4_SUCCESS;
+}
 
-private:
-    AP4_Mpeg2TsWriter*               ts_writer;
-    AP4_Mpeg2TsWriter::SampleStream* audio_stream;
-    AP4_Mpeg2TsWriter::SampleStream* video_stream;
-    const InputStream *input_stream;
-    std::filesystem::path out_folder;
-    Stats stats;
-};
-
-class VectorCommonFloatFinder {
-public:
-    VectorCommonFloatFinder(std::vector<float> vec) : vec(vec), index(0) {}
-    bool exist(float value) {
-        while(index < vec.size()) {
-            if (abs(vec.at(index) - value) < MAX_DTS_DELTA) {
-                return true;
-            }
-            if(vec.at(index) > value) {
-                break;
-            }
-            index++;
+/*----------------------------------------------------------------------
+|   GetPackagerOptions
++---------------------------------------------------------------------*/
+// the packager options of the command line, exits on invalid ones
+static void
+GetPackagerOptions(const cxxopts::ParseResult& result, Bento5::PackagerOptions& packager_options)
+{
+    if (result.count("output-dir")) packager_options.output_dir = result["output-dir"].as<std::string>();
+    packager_options.segment_duration    = result["segment-duration"].as<double>();
+    packager_options.fast_open           = result.count("no-fast-open") == 0;
+    packager_options.shared_audio        = result.count("no-shared-audio") == 0;
+    packager_options.release_input_cache = result.count("release-input-cache") > 0;
+    packager_options.direct_io           = result.count("direct-io") > 0;
+    packager_options.preallocate         = result.count("preallocate") > 0;
+    packager_options.fragment_buffer     = (AP4_UI64)result["fragment-buffer"].as<unsigned int>()*1024*1024;
+    packager_options.iframe_playlists    = result.count("no-iframe-playlists") == 0;
+    packager_options.checksums           = result.count("checksums") > 0;
+    packager_options.publish_every       = result.count("publish-every") ? result["publish-every"].as<unsigned int>() : 0;
+    packager_options.durable             = result.count("durable") > 0;
+    packager_options.resume              = result.count("resume") > 0;
+    packager_options.profile             = result.count("stats-json") > 0;
+    packager_options.jobs                = std::max(1u, result["jobs"].as<unsigned int>());
+    packager_options.plan                = result.count("plan") > 0;
+    if (result.count("plan-out")) packager_options.plan_out = result["plan-out"].as<std::string>();
+    if (result.count("plan-in"))  packager_options.plan_in  = result["plan-in"].as<std::string>();
+    if (result.count("merge")) {
+        packager_options.merge = result["merge"].as<unsigned int>();
+        if (packager_options.merge == 0) {
+            fprintf(stderr, "ERROR: invalid number of shards\n");
+            exit(-1);
+        }
+    }
+    if (result.count("shard")) {
+        if (sscanf(result["shard"].as<std::string>().c_str(), "%u/%u", &packager_options.shard_index, &packager_options.shard_count) != 2 ||
+            packager_options.shard_index == 0 || packager_options.shard_index > packager_options.shard_count) {
+            fprintf(stderr, "ERROR: invalid shard, expected k/N with k from 1 to N\n");
+            exit(-1);
+        }
+        if (result.count("plan-in") == 0) {
+            fprintf(stderr, "ERROR: --plan-in is needed to write a shard\n");
+            exit(-1);
         }
-        return false;
     }
-private:
-    std::vector<float> vec;
-    unsigned int index;
-};
 
-std::vector<float> findAlignedDTS(std::vector<std::vector<float>> array) {
-    if (array.size() == 0) {
-        return std::vector<float>();
-    } else if (array.size() == 1) {
-        return array.at(0);
-    } else {
-        std::vector<float> res;
-        std::vector<float> front = array.front();
-        std::vector<VectorCommonFloatFinder*> finderArray;
-        std::transform(array.begin(), array.end(), std::back_inserter(finderArray), [](std::vector<float> x) {return new VectorCommonFloatFinder(x);});
-        for (unsigned int i = 0; i < front.size(); i++) {
-            bool not_exist = false;
-            for(unsigned int j = 0; j < finderArray.size(); j++) {
-                if(finderArray.at(j)->exist(front.at(i))==false) {
-                    not_exist = true;
-                    break;
-                }
+    if (result.count("encryption-key") || result.count("encryption-key-file")) {
+        AP4_UI08* key = packager_options.encryption_key;
+        if (result.count("encryption-key")) {
+            std::string key_hex = result["encryption-key"].as<std::string>();
+            if (key_hex.size() != 32 || AP4_FAILED(AP4_ParseHex(key_hex.c_str(), key, 16))) {
+                fprintf(stderr, "ERROR: invalid encryption key, expected 32 hex characters\n");
+                exit(-1);
             }
-            if(not_exist == false) {
-                res.push_back(front.at(i));
+        } else {
+            std::string key_path = result["encryption-key-file"].as<std::string>();
+            AP4_ByteStream* key_file = NULL;
+            AP4_LargeSize   key_size = 0;
+            if (AP4_FAILED(AP4_FileByteStream::Create(key_path.c_str(), AP4_FileByteStream::STREAM_MODE_READ, key_file)) ||
+                AP4_FAILED(key_file->GetSize(key_size)) || key_size != 16 || AP4_FAILED(key_file->Read(key, 16))) {
+                fprintf(stderr, "ERROR: cannot read a 16 byte key from %s\n", key_path.c_str());
+                exit(-1);
             }
+            key_file->Release();
         }
-        std::for_each(finderArray.begin(), finderArray.end(), [](VectorCommonFloatFinder *ptr) {delete ptr;});
-        return res;
-    }
-}
-
-std::vector<float> filterDTSBySegmentDuration(std::vector<float> array, float segment_duration) {
-    float lastDTS = 0;
-    std::vector<float> res;
-    for (unsigned int i = 0; i < array.size(); i++) {
-        if ((array.at(i)-lastDTS) >= segment_duration || abs(array.at(i)-lastDTS-segment_duration) < 1) {
-            res.push_back(array.at(i));
-            lastDTS = array.at(i);
+        if (result.count("encryption-key-uri") == 0) {
+            fprintf(stderr, "ERROR: --encryption-key-uri is needed to encrypt the segments\n");
+            exit(-1);
         }
+        packager_options.encrypt            = true;
+        packager_options.encryption_key_uri = result["encryption-key-uri"].as<std::string>();
     }
-    return res;
 }
 
 int main(int argc, char** argv)
@@ -679,47 +492,99 @@ int main(int argc, char** argv)
             ("o,output-dir", "Output directory", cxxopts::value<std::string>())
             ("segment-duration", "Segment duration", cxxopts::value<double>()->default_value("6"))
             ("master-playlist", "Master Playlist name", cxxopts::value<std::string>()->default_value("master.m3u8"))
+            ("stats-json", "Write per-rendition and per-stage statistics to this JSON file", cxxopts::value<std::string>())
+            ("trace", "Write a Chrome/Perfetto trace of the packaging spans to this JSON file", cxxopts::value<std::string>())
+            ("no-fast-open", "Parse the whole moov with Bento4 instead of only the selected tracks")
+            ("release-input-cache", "Read the inputs sequentially and drop them from the page cache behind the reads")
+            ("direct-io", "Write the segments with O_DIRECT, around the page cache")
+            ("preallocate", "Allocate each segment file from its predicted size before writing it, and trim it to its size after")
+            ("fragment-buffer", "Most MB of samples buffered per track for fragmented inputs, a track further ahead in the file is read again instead, 0 for no limit", cxxopts::value<unsigned int>()->default_value("32"))
+            ("no-shared-audio", "Packetize the audio of every input, even when several inputs have the same audio track")
+            ("encryption-key", "Encrypt the segments with AES-128 using this key (32 hex characters)", cxxopts::value<std::string>())
+            ("encryption-key-file", "Encrypt the segments with AES-128 using the 16 byte key stored in this file", cxxopts::value<std::string>())
+            ("encryption-key-uri", "URI of the key in the EXT-X-KEY tag of the media playlists", cxxopts::value<std::string>())
+            ("no-iframe-playlists", "Do not write I-frame playlists (they are never written for encrypted segments)")
+            ("plan", "Only print the segment plan of each rendition as JSON, with predicted segment sizes, without writing anything")
+            ("plan-out", "Write the segment plan of each rendition with the state each segment starts with to this file, for --shard, without writing anything", cxxopts::value<std::string>())
+            ("plan-in", "Plan file written by --plan-out for the same inputs, needed by --shard", cxxopts::value<std::string>())
+            ("shard", "Only write the k-th of N slices of the planned segments, given as k/N, and a shard file for --merge instead of the playlists", cxxopts::value<std::string>())
+            ("merge", "Write the playlists from the shard files of N --shard runs instead of writing the segments", cxxopts::value<unsigned int>())
+            ("durable", "Write the segments under temporary names, fsync them in batches on a background thread and rename them into place, the playlists are synced too and published after their segments")
+            ("resume", "Continue an interrupted run in the same output directory after the segments recorded in the journal of each rendition, with the same inputs and options")
+            ("publish-every", "Publish the media playlists as EVENT playlists every N segments, and the master playlist before the segments", cxxopts::value<unsigned int>())
+            ("checksums", "Compute CRC32C and SHA-256 of each segment while writing it, saved to checksums.txt in each rendition folder")
+            ("verify", "Check the segments of an output directory written earlier: sync bytes, PAT and PMT, continuity counters, and the same first video PTS in every rendition", cxxopts::value<std::string>())
+            ("daemon", "Listen on this Unix socket for packaging jobs, run with the other options, --jobs at a time, until SIGINT or SIGTERM", cxxopts::value<std::string>())
+            ("j,jobs", "Number of renditions written (or verified, or daemon jobs run) in parallel", cxxopts::value<unsigned int>()->default_value("1"))
             ("v,verbose", "Be verbose (default: false)", cxxopts::value<bool>()->default_value("false"))
             ("h,help", "Print usage")
             ;
 
     auto result = options.parse(argc, argv);
 
+    // --verify only reads what an earlier run wrote
+    if (result.count("verify")) {
+        std::string report;
+        std::string errors;
+        AP4_Result  res = Bento5::VerifyLadder(result["verify"].as<std::string>(), std::max(1u, result["jobs"].as<unsigned int>()), report, errors);
+        fputs(report.c_str(), stdout);
+        for (size_t start = 0, end; start < errors.size(); start = end+1) {
+            end = errors.find('\n', start);
+            fprintf(stderr, "ERROR: %s\n", errors.substr(start, end-start).c_str());
+        }
+        if (AP4_FAILED(res)) exit(-1);
+        return 0;
+    }
+
+    // --daemon takes the inputs and the output directory of each job from its clients
+    if (result.count("daemon") && result.count("help") == 0) {
+        Bento5::PackagerOptions packager_options;
+        GetPackagerOptions(result, packager_options);
+        if (AP4_FAILED(RunDaemon(result["daemon"].as<std::string>(), packager_options, packager_options.jobs))) exit(-1);
+        return 0;
+    }
+
     if (result.count("help") || result.count("input-files") == 0 || result.count("output-dir") == 0)
     {
         std::cout << options.help() << std::endl;
         exit(0);
     }
 
-    std::vector<std::string> file_paths = result["input-files"].as<std::vector<std::string>>();
-    std::vector<InputStream*> input_streams;
-    std::transform(file_paths.begin(), file_paths.end(), std::back_inserter(input_streams), [](std::string s) {return new InputStream(s);});
+    Bento5::PackagerOptions packager_options;
+    GetPackagerOptions(result, packager_options);
 
-    std::vector<OutputStream*> output_streams;
-    for (unsigned int i = 0; i < input_streams.size(); i++) {
-        std::ostringstream out_folder;
-        out_folder << "output/media-" << i;
-        std::filesystem::path file_path(result["output-dir"].as<std::string>());
-        output_streams.push_back(new OutputStream(file_path.append(out_folder.str()), input_streams.at(i)));
+    std::vector<Bento5::PackagerInput> inputs;
+    for (const std::string& file_path : result["input-files"].as<std::vector<std::string>>()) {
+        inputs.push_back(Bento5::PackagerInput(file_path));
     }
 
-    std::vector<std::vector<float>> keyframeDTS;
-    std::transform(input_streams.begin(), input_streams.end(), std::back_inserter(keyframeDTS), [](InputStream *input) {return input->getKeyframesDTSTimeList();});
+    if (result.count("trace")) Bento5::StartTrace();
 
-    std::vector<float> alignedDTS = findAlignedDTS(keyframeDTS);
-    std::vector<float> filterdDTSByDuration = filterDTSBySegmentDuration(alignedDTS, result["segment-duration"].as<double>());
-    std::for_each(output_streams.begin(), output_streams.end(), [result, filterdDTSByDuration](OutputStream* output_stream) {
-        OutputStream::write_samples(output_stream, result["segment-duration"].as<double>(), filterdDTSByDuration);
-    });
-
-    std::filesystem::path output_folder(result["output-dir"].as<std::string>());
-    AP4_Result res = OutputStream::generateMasterPlaylist(output_streams, output_folder.append("output"));
-    if (AP4_FAILED(res)) {
-        fprintf(stderr, "could not master playlist\n");
+    Bento5::Packager packager(inputs, packager_options);
+    AP4_Result       packager_result = packager.Run();
+    for (const std::string& warning : packager.GetWarnings()) fprintf(stderr, "WARNING: %s\n", warning.c_str());
+    if (AP4_FAILED(packager_result)) {
+        fprintf(stderr, "ERROR: %s\n", packager.GetError().c_str());
         exit(-1);
     }
 
-    // clean up
-    std::for_each(output_streams.begin(), output_streams.end(), [](OutputStream *ptr) {delete ptr;});
+    if (packager_options.plan) {
+        std::cout << packager.GetPlanJson() << std::endl;
+    }
+
+    if (packager_options.profile && !packager_options.plan && packager_options.plan_out.empty() && packager_options.merge == 0) {
+        if (AP4_FAILED(WriteTextFile(result["stats-json"].as<std::string>(), packager.GetStatsJson()))) {
+            fprintf(stderr, "could not write stats to %s\n", result["stats-json"].as<std::string>().c_str());
+            exit(-1);
+        }
+    }
+
+    if (result.count("trace") && !packager_options.plan && packager_options.plan_out.empty() && packager_options.merge == 0) {
+        if (AP4_FAILED(Bento5::SaveTrace(result["trace"].as<std::string>()))) {
+            fprintf(stderr, "could not write trace to %s\n", result["trace"].as<std::string>().c_str());
+            exit(-1);
+        }
+    }
+
     return 0;
 }
@@ -0,0 +1,187 @@
+/*
+ * copyright (c) 2020 Hailong Geng <longlongh4@gmail.com>
+ *
+ * This file is part of Bento5.
+ *
+ *
+ * Bento5 is free software: you can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Bento5 is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Bento5.  If not, see <https://www.gnu.org/licenses/>.
+ */
+
+// known-answer tests of the checksums and of the segment encryption, on the
+// hardware path when the CPU has it and always on the portable one
+
+#include <stdio.h>
+#include <string.h>
+#include <algorithm>
+#include <string>
+#include <vector>
+#include "Bento5Crypto.h"
+
+using namespace Bento5;
+
+static unsigned int failures = 0;
+
+/*----------------------------------------------------------------------
+|   FromHex
++---------------------------------------------------------------------*/
+static std::vector<AP4_UI08>
+FromHex(const char* hex)
+{
+    std::vector<AP4_UI08> bytes;
+    for (; hex[0] && hex[1]; hex += 2) {
+        unsigned int value = 0;
+        sscanf(hex, "%2x", &value);
+        bytes.push_back((AP4_UI08)value);
+    }
+    return bytes;
+}
+
+/*----------------------------------------------------------------------
+|   Check
++---------------------------------------------------------------------*/
+static void
+Check(bool passed, const char* path, const char* name)
+{
+    printf("%-4s %-8s %s\n", passed ? "ok" : "FAIL", path, name);
+    if (!passed) failures++;
+}
+
+/*----------------------------------------------------------------------
+|   TestCrc32c
++---------------------------------------------------------------------*/
+// RFC 3720 B.4
+static void
+TestCrc32c(bool hardware, const char* path)
+{
+    AP4_UI08 zeros[32], ones[32], incrementing[32], decrementing[32];
+    for (unsigned int i = 0; i < 32; i++) {
+        zeros[i]        = 0x00;
+        ones[i]         = 0xFF;
+        incrementing[i] = (AP4_UI08)i;
+        decrementing[i] = (AP4_UI08)(31-i);
+    }
+    struct { const char* name; const AP4_UI08* data; AP4_UI32 crc; } vectors[] = {
+        { "crc32c 32 bytes of zeros",       zeros,        0x8A9136AA },
+        { "crc32c 32 bytes of ones",        ones,         0x62A8AB43 },
+        { "crc32c 32 incrementing bytes",   incrementing, 0x46DD794E },
+        { "crc32c 32 decrementing bytes",   decrementing, 0x113FDB5C }
+    };
+    for (auto& vector : vectors) {
+        Crc32c crc(hardware);
+        crc.Update(vector.data, 32);
+        Check(crc.GetValue() == vector.crc, path, vector.name);
+
+        // odd sizes go through the byte loops around the word-sized steps
+        Crc32c split(hardware);
+        split.Update(vector.data, 5);
+        split.Update(vector.data+5, 27);
+        Check(split.GetValue() == vector.crc, path, (std::string(vector.name)+", split").c_str());
+    }
+}
+
+/*----------------------------------------------------------------------
+|   TestSha256
++---------------------------------------------------------------------*/
+// FIPS 180-2 appendix B
+static void
+TestSha256(bool hardware, const char* path)
+{
+    std::string million(1000000, 'a');
+    struct { const char* name; std::string message; AP4_Size chunk; const char* digest; } vectors[] = {
+        { "sha256 \"abc\"", "abc", 3,
+          "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad" },
+        { "sha256 448 bit message", "abcdbcdecdefdefgefghfghighijhijkijkljklmklmnlmnomnopnopq", 56,
+          "248d6a61d20638b8e5c026930c3e6039a33ce45964ff2167f6ecedd419db06c1" },
+        { "sha256 one million \"a\"", million, 997,
+          "cdc76e5c9914fb9281a1c7e284d73e67f1809a48a497200e046d39ccc7112cd0" }
+    };
+    for (auto& vector : vectors) {
+        Sha256 hash(hardware);
+        for (AP4_Size offset = 0; offset < vector.message.size(); offset += vector.chunk) {
+            AP4_Size size = std::min<AP4_Size>(vector.chunk, vector.message.size()-offset);
+            hash.Update((const AP4_UI08*)vector.message.data()+offset, size);
+        }
+        AP4_UI08 digest[32];
+        hash.Final(digest);
+        Check(memcmp(digest, FromHex(vector.digest).data(), 32) == 0, path, vector.name);
+    }
+}
+
+/*----------------------------------------------------------------------
+|   TestAes128Cbc
++---------------------------------------------------------------------*/
+// NIST SP 800-38A F.2.1
+static void
+TestAes128Cbc(bool hardware, const char* path)
+{
+    std::vector<AP4_UI08> key = FromHex("2b7e151628aed2a6abf7158809cf4f3c");
+    std::vector<AP4_UI08> iv  = FromHex("000102030405060708090a0b0c0d0e0f");
+    std::vector<AP4_UI08> plaintext = FromHex(
+        "6bc1bee22e409f96e93d7e117393172a"
+        "ae2d8a571e03ac9c9eb76fac45af8e51"
+        "30c81c46a35ce411e5fbc1191a0a52ef"
+        "f69f2445df4f9b17ad2b417be66c3710");
+    std::vector<AP4_UI08> ciphertext = FromHex(
+        "7649abac8119b246cee98e9b12e9197d"
+        "5086cb9b507219ee95db113a917678b2"
+        "73bed6b8e3c1743b7116e69e22229516"
+        "3ff1caa1681fac09120eca307586e1a7");
+
+    Aes128CbcEncrypter encrypter(key.data(), hardware);
+    AP4_UI08 output[64];
+    AP4_UI08 chain[16];
+    memcpy(chain, iv.data(), 16);
+    bool passed = AP4_SUCCEEDED(encrypter.Process(plaintext.data(), 64, output, chain));
+    Check(passed && memcmp(output, ciphertext.data(), 64) == 0, path, "aes-128-cbc 4 blocks");
+
+    // the chain carries over from one call to the next, as it does between the writes of a segment
+    memcpy(chain, iv.data(), 16);
+    passed = AP4_SUCCEEDED(encrypter.Process(plaintext.data(), 16, output, chain)) &&
+             AP4_SUCCEEDED(encrypter.Process(plaintext.data()+16, 48, output+16, chain));
+    Check(passed && memcmp(output, ciphertext.data(), 64) == 0, path, "aes-128-cbc 1+3 blocks");
+    Check(memcmp(chain, ciphertext.data()+48, 16) == 0, path, "aes-128-cbc chain");
+}
+
+/*----------------------------------------------------------------------
+|   main
++---------------------------------------------------------------------*/
+int
+main()
+{
+    TestCrc32c(false, "software");
+    TestSha256(false, "software");
+    TestAes128Cbc(false, "software");
+
+    if (Crc32c::HasHardwareSupport()) {
+        TestCrc32c(true, "hardware");
+    } else {
+        printf("skip hardware crc32c, not supported by this CPU\n");
+    }
+    if (Sha256::HasHardwareSupport()) {
+        TestSha256(true, "hardware");
+    } else {
+        printf("skip hardware sha256, not supported by this CPU\n");
+    }
+    if (Aes128CbcEncrypter::HasHardwareSupport()) {
+        TestAes128Cbc(true, "hardware");
+    } else {
+        printf("skip hardware aes-128-cbc, not supported by this CPU\n");
+    }
+
+    if (failures) {
+        fprintf(stderr, "%u known-answer tests failed\n", failures);
+        return 1;
+    }
+    return 0;
+}